@@ -0,0 +1,145 @@
+#include "archive.h"
+#include "memstats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORD_HEADER_LEN 24  // prev (8), author (4), date (8), length (4)
+
+static FILE *archive_file = NULL;
+static uint64_t archive_end = 0;      // Offset the next record is written at
+static uint64_t flushed_end = 0;      // Everything before this has reached the file
+static int archive_failed = 0;        // Set once a bad write can't be undone
+
+
+int archive_open(const char *path) {
+    archive_file = fopen(path, "w+");
+    if (archive_file == NULL) {
+        return -1;
+    }
+    if (fwrite(ARCHIVE_MAGIC, 1, ARCHIVE_MAGIC_LEN, archive_file) != ARCHIVE_MAGIC_LEN) {
+        fclose(archive_file);
+        archive_file = NULL;
+        return -1;
+    }
+    archive_end = ARCHIVE_MAGIC_LEN;
+    return 0;
+}
+
+int archive_adopt(int fd, uint64_t length) {
+    archive_file = fdopen(fd, "r+");
+    if (archive_file == NULL) {
+        return -1;
+    }
+    // The file offset is shared with the process that handed fd over
+    if (fseek(archive_file, length, SEEK_SET) == -1) {
+        fclose(archive_file);
+        archive_file = NULL;
+        return -1;
+    }
+    archive_end = length;
+    flushed_end = length;
+    return 0;
+}
+
+int archive_fd(void) {
+    return archive_file == NULL ? -1 : fileno(archive_file);
+}
+
+uint64_t archive_length(void) {
+    return archive_end;
+}
+
+int archive_is_open(void) {
+    return archive_file != NULL;
+}
+
+uint64_t archive_append(const Post *post, uint64_t prev) {
+    if (archive_file == NULL || archive_failed) {
+        return 0;
+    }
+
+    // The file only ever holds records written by this process, so native
+    // byte order is fine
+    char header[RECORD_HEADER_LEN];
+    uint32_t author = post->author;
+    int64_t date = post->date;
+    const char *text = post_text(post);
+    uint32_t len = strlen(text);
+    memcpy(header, &prev, 8);
+    memcpy(header + 8, &author, 4);
+    memcpy(header + 12, &date, 8);
+    memcpy(header + 20, &len, 4);
+    if (fwrite(header, 1, RECORD_HEADER_LEN, archive_file) != RECORD_HEADER_LEN ||
+        fwrite(text, 1, len, archive_file) != len) {
+        // Don't leave part of a record where the next one goes: cut it off,
+        // or if that fails too, stop archiving
+        if (fseeko(archive_file, archive_end, SEEK_SET) == -1 ||
+            ftruncate(fileno(archive_file), archive_end) == -1) {
+            archive_failed = 1;
+        }
+        return 0;
+    }
+
+    uint64_t offset = archive_end;
+    archive_end += RECORD_HEADER_LEN + len;
+    return offset;
+}
+
+int archive_read(uint64_t offset, Post *post, uint64_t *prev) {
+    if (archive_file == NULL || offset < ARCHIVE_MAGIC_LEN || offset >= archive_end) {
+        return -1;
+    }
+    if (offset >= flushed_end && archive_flush() == -1) {
+        return -1;
+    }
+
+    char header[RECORD_HEADER_LEN];
+    int fd = fileno(archive_file);
+    if (pread(fd, header, RECORD_HEADER_LEN, offset) != RECORD_HEADER_LEN) {
+        return -1;
+    }
+    memcpy(prev, header, 8);
+    if (post == NULL) {
+        return 0;
+    }
+
+    uint32_t author;
+    int64_t date;
+    uint32_t len;
+    memcpy(&author, header + 8, 4);
+    memcpy(&date, header + 12, 8);
+    memcpy(&len, header + 20, 4);
+    post->contents = mem_alloc(MEM_POSTS, len + 1);
+    if (pread(fd, post->contents, len, offset + RECORD_HEADER_LEN) != len) {
+        mem_free(MEM_POSTS, post->contents);
+        return -1;
+    }
+    post->contents[len] = '\0';
+    post->packed = 0;
+    post->author = author;
+    post->date = date;
+    post->next = NULL;
+    post->prev = NULL;
+    return 0;
+}
+
+int archive_flush(void) {
+    if (archive_file == NULL || flushed_end == archive_end) {
+        return 0;
+    }
+    if (fflush(archive_file) == EOF) {
+        // Records past flushed_end may be partly written: drop them all, as
+        // archive_append drops a partial one, or stop archiving
+        clearerr(archive_file);
+        if (fseeko(archive_file, flushed_end, SEEK_SET) == -1 ||
+            ftruncate(fileno(archive_file), flushed_end) == -1) {
+            archive_failed = 1;
+        }
+        archive_end = flushed_end;
+        return -1;
+    }
+    flushed_end = archive_end;
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+
+#include "friends.h"
+
+/*
+ * The post archive: an append-only file that posts are moved to once they
+ * leave memory. The file starts with ARCHIVE_MAGIC, then holds one record
+ * per post:
+ *
+ *   offset of the same user's previous (older) archived post, or 0 (8 bytes)
+ *   author ID (4 bytes), date (8 bytes), contents length (4 bytes)
+ *   the contents, without a null terminator
+ *
+ * so each user's archived posts form a chain running backwards in time from
+ * User.archive_head. Records are never modified once written. The archive
+ * only lives as long as the server's users do, so it is started afresh
+ * every time it's opened.
+ */
+#define ARCHIVE_MAGIC "FRARC01\n"
+#define ARCHIVE_MAGIC_LEN 8
+
+/*
+ * Create (or empty) the archive file at path and start archiving to it.
+ * Return 0 on success and -1 (with errno set) on error.
+ */
+int archive_open(const char *path);
+
+/*
+ * Carry on archiving to the open archive file fd, whose first length bytes
+ * are records, as handed over by another process (see handoff.h). Return 0
+ * on success and -1 (with errno set) on error.
+ */
+int archive_adopt(int fd, uint64_t length);
+
+/* Return the archive's file descriptor, or -1 if none is open. */
+int archive_fd(void);
+
+/* Return the archive's length in bytes. */
+uint64_t archive_length(void);
+
+/* Return 1 if an archive is open, 0 otherwise. */
+int archive_is_open(void);
+
+/*
+ * Append post to the archive, linked to the record at prev. Return the new
+ * record's offset, or 0 if it couldn't be written (in which case nothing
+ * was, or if a partial record can't be removed, nothing ever will be).
+ */
+uint64_t archive_append(const Post *post, uint64_t prev);
+
+/*
+ * Read the record at offset into post (its contents newly allocated, as
+ * MEM_POSTS's, and its links NULL), or just its link if post is NULL. Set
+ * *prev to the offset of the next older record. Return 0 on success and -1
+ * on error.
+ */
+int archive_read(uint64_t offset, Post *post, uint64_t *prev);
+
+/*
+ * Write out any buffered records. Return 0 on success and -1 on error, in
+ * which case every record appended since the last successful flush is
+ * dropped, and their offsets must not be used.
+ */
+int archive_flush(void);
+
+#endif
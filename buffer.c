@@ -0,0 +1,51 @@
+#include "buffer.h"
+#include "friends.h"
+#include "memstats.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Create a buffer holding a copy of the first len bytes of data.
+ * The header and the bytes share a single allocation.
+ */
+Buffer *buffer_new(const char *data, size_t len) {
+    Buffer *buf = mem_alloc(MEM_RESPONSES, sizeof(Buffer) + len);
+    buf->refcount = 1;
+    buf->len = len;
+    buf->data = (char *) (buf + 1);
+    buf->owns_data = 0;
+    memcpy(buf->data, data, len);
+    return buf;
+}
+
+/*
+ * Create a buffer that takes ownership of the heap-allocated string data,
+ * which must be MEM_RESPONSES's.
+ */
+Buffer *buffer_adopt(char *data, size_t len) {
+    Buffer *buf = mem_alloc(MEM_RESPONSES, sizeof(Buffer));
+    buf->refcount = 1;
+    buf->len = len;
+    buf->data = data;
+    buf->owns_data = 1;
+    return buf;
+}
+
+/* Take another reference to buf and return it. */
+Buffer *buffer_ref(Buffer *buf) {
+    __atomic_add_fetch(&buf->refcount, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+/* Drop a reference to buf, freeing it once no references remain. */
+void buffer_unref(Buffer *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    if (__atomic_sub_fetch(&buf->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (buf->owns_data) {
+            mem_free(MEM_RESPONSES, buf->data);
+        }
+        mem_free(MEM_RESPONSES, buf);
+    }
+}
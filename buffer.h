@@ -0,0 +1,34 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+/*
+ * An immutable, reference counted byte buffer. Once created the contents are
+ * never modified, so the same buffer can sit in any number of client output
+ * queues (and in the response cache) at once without being copied.
+ */
+typedef struct buffer {
+    int refcount;
+    size_t len;
+    char *data;
+    int owns_data;  // 1 if data was adopted and must be freed separately
+} Buffer;
+
+/* Create a buffer holding a copy of the first len bytes of data. */
+Buffer *buffer_new(const char *data, size_t len);
+
+/*
+ * Create a buffer that takes ownership of the heap-allocated string data,
+ * which must be counted as MEM_RESPONSES's (see memstats.h). data is freed
+ * when the last reference is dropped.
+ */
+Buffer *buffer_adopt(char *data, size_t len);
+
+/* Take another reference to buf and return it. */
+Buffer *buffer_ref(Buffer *buf);
+
+/* Drop a reference to buf, freeing it once no references remain. */
+void buffer_unref(Buffer *buf);
+
+#endif
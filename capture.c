@@ -0,0 +1,153 @@
+#include "capture.h"
+#include <string.h>
+#include <time.h>
+
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+
+static FILE *capture_file = NULL;
+static uint64_t start_us;  // When capture_open was called
+static uint64_t last_us;   // Time of the last record, relative to start_us
+
+
+/* Microseconds on the monotonic clock. */
+uint64_t capture_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Write value 7 bits at a time, low bits first, high bit set on all but the last byte. */
+static void write_varint(uint64_t value) {
+    while (value >= 0x80) {
+        putc((value & 0x7F) | 0x80, capture_file);
+        value >>= 7;
+    }
+    putc(value, capture_file);
+}
+
+/* Read a varint written by write_varint. Return 0 on success, -1 on a short or bad read. */
+static int read_varint(FILE *stream, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = getc(stream);
+        if (byte == EOF) {
+            return -1;
+        }
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Write the type, time and session common to every record. */
+static void write_record_header(int type, uint64_t at_us, uint32_t session) {
+    uint64_t time_us = at_us > start_us ? at_us - start_us : 0;
+    if (time_us < last_us) {
+        time_us = last_us;  // keep deltas non-negative
+    }
+    putc(type, capture_file);
+    write_varint(time_us - last_us);
+    write_varint(session);
+    last_us = time_us;
+}
+
+
+/*
+ * Start capturing to the file at path, replacing it.
+ */
+int capture_open(const char *path) {
+    capture_file = fopen(path, "w");
+    if (capture_file == NULL) {
+        return -1;
+    }
+    setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+    fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, capture_file);
+    start_us = capture_now_us();
+    last_us = 0;
+    return 0;
+}
+
+void capture_connect(uint32_t session) {
+    if (capture_file != NULL) {
+        write_record_header(CAPTURE_CONNECT, capture_now_us(), session);
+    }
+}
+
+void capture_disconnect(uint32_t session) {
+    if (capture_file != NULL) {
+        write_record_header(CAPTURE_DISCONNECT, capture_now_us(), session);
+    }
+}
+
+/*
+ * Record that session sent the len byte line at arrival_us.
+ */
+void capture_line(uint32_t session, const char *line, uint32_t len,
+                  uint64_t arrival_us, uint32_t service_us) {
+    if (capture_file == NULL) {
+        return;
+    }
+    if (len > CAPTURE_MAX_LINE) {
+        len = CAPTURE_MAX_LINE;
+    }
+    write_record_header(CAPTURE_LINE, arrival_us, session);
+    write_varint(service_us);
+    write_varint(len);
+    fwrite(line, 1, len, capture_file);
+}
+
+/* Write out any buffered records. */
+void capture_flush(void) {
+    if (capture_file != NULL) {
+        fflush(capture_file);
+    }
+}
+
+
+/*
+ * Check that stream starts with a capture header.
+ */
+int capture_read_header(FILE *stream) {
+    char magic[CAPTURE_MAGIC_LEN];
+    if (fread(magic, 1, CAPTURE_MAGIC_LEN, stream) != CAPTURE_MAGIC_LEN ||
+            memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the next record of stream into rec.
+ */
+int capture_read(FILE *stream, uint64_t prev_us, CaptureRecord *rec) {
+    int type = getc(stream);
+    if (type == EOF) {
+        return 0;
+    }
+
+    uint64_t delta, session, service_us, len;
+    if (read_varint(stream, &delta) == -1 || read_varint(stream, &session) == -1) {
+        return -1;
+    }
+    rec->type = type;
+    rec->time_us = prev_us + delta;
+    rec->session = session;
+    rec->service_us = 0;
+    rec->len = 0;
+    rec->line[0] = '\0';
+
+    if (type == CAPTURE_LINE) {
+        if (read_varint(stream, &service_us) == -1 || read_varint(stream, &len) == -1
+                || len > CAPTURE_MAX_LINE || fread(rec->line, 1, len, stream) != len) {
+            return -1;
+        }
+        rec->service_us = service_us;
+        rec->len = len;
+        rec->line[len] = '\0';
+    } else if (type != CAPTURE_CONNECT && type != CAPTURE_DISCONNECT) {
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,72 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A capture is a binary trace of client sessions: when each connected,
+ * every line it sent and when it disconnected. The file starts with
+ * CAPTURE_MAGIC, then has one record per event:
+ *
+ *   type (1 byte), then as varints: microseconds since the previous record,
+ *   session ID, and for CAPTURE_LINE records the microseconds the server
+ *   spent handling the line and the line's length, followed by the line
+ *   itself (without its network newline).
+ */
+#define CAPTURE_MAGIC "FRCAP01\n"
+#define CAPTURE_MAGIC_LEN 8
+
+#define CAPTURE_CONNECT 1
+#define CAPTURE_LINE 2
+#define CAPTURE_DISCONNECT 3
+
+#define CAPTURE_MAX_LINE 65535  // Longest line a record can hold
+
+typedef struct capture_record {
+    int type;
+    uint64_t time_us;      // Microseconds since the capture started
+    uint32_t session;
+    uint32_t service_us;   // CAPTURE_LINE only
+    uint32_t len;          // CAPTURE_LINE only
+    char line[CAPTURE_MAX_LINE + 1];  // CAPTURE_LINE only, null-terminated
+} CaptureRecord;
+
+/* Microseconds on the monotonic clock. */
+uint64_t capture_now_us(void);
+
+/*
+ * Start capturing to the file at path, replacing it. Return 0 on success
+ * and -1 (with errno set) on error. Until this is called, the capture_*
+ * recording functions do nothing.
+ */
+int capture_open(const char *path);
+
+/* Record that session connected, or disconnected. */
+void capture_connect(uint32_t session);
+void capture_disconnect(uint32_t session);
+
+/*
+ * Record that session sent the len byte line at arrival_us, and that the
+ * server spent service_us handling it.
+ */
+void capture_line(uint32_t session, const char *line, uint32_t len,
+                  uint64_t arrival_us, uint32_t service_us);
+
+/* Write out any buffered records. */
+void capture_flush(void);
+
+/*
+ * Check that stream starts with a capture header. Return 0 if it does and
+ * -1 otherwise.
+ */
+int capture_read_header(FILE *stream);
+
+/*
+ * Read the next record of stream into rec. prev_us is the time of the
+ * previous record (0 for the first). Return 1 on success, 0 at the end of
+ * the trace and -1 if the trace is corrupt.
+ */
+int capture_read(FILE *stream, uint64_t prev_us, CaptureRecord *rec);
+
+#endif
@@ -0,0 +1,167 @@
+#include "channel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Chained hash table of channels by name, doubled once it averages two per bucket
+static Channel **table = NULL;
+static size_t table_capacity = 0;
+static size_t num_channels = 0;
+
+
+/* FNV-1a hash of a channel name. */
+static size_t hash_name(const char *name) {
+    size_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *) name; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Return the link pointing to the channel called name, or to the NULL ending its bucket. */
+static Channel **find_link(const char *name) {
+    if (table_capacity == 0) {
+        return NULL;
+    }
+    Channel **link = &table[hash_name(name) & (table_capacity - 1)];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/* Double the table, or create it. */
+static void grow_table(void) {
+    size_t new_capacity = table_capacity == 0 ? 64 : table_capacity * 2;
+    Channel **new_table = Malloc(sizeof(Channel *) * new_capacity);
+    memset(new_table, 0, sizeof(Channel *) * new_capacity);
+    for (size_t i = 0; i < table_capacity; i++) {
+        Channel *channel = table[i];
+        while (channel != NULL) {
+            Channel *next = channel->next;
+            size_t bucket = hash_name(channel->name) & (new_capacity - 1);
+            channel->next = new_table[bucket];
+            new_table[bucket] = channel;
+            channel = next;
+        }
+    }
+    free(table);
+    table = new_table;
+    table_capacity = new_capacity;
+}
+
+/* Return where id is, or would go, in channel's subscribers. */
+static size_t subscriber_index(const Channel *channel, UserId id) {
+    size_t low = 0;
+    size_t high = channel->num_subscribers;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (channel->subscribers[mid] < id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/* Remove the subscriber at index from the channel that *link points to, and the channel if it's empty. */
+static void remove_subscriber(Channel **link, size_t index) {
+    Channel *channel = *link;
+    channel->num_subscribers--;
+    memmove(channel->subscribers + index, channel->subscribers + index + 1,
+            sizeof(UserId) * (channel->num_subscribers - index));
+    if (channel->num_subscribers == 0) {
+        *link = channel->next;
+        free(channel->subscribers);
+        free(channel);
+        num_channels--;
+    }
+}
+
+
+Channel *channel_find(const char *name) {
+    Channel **link = find_link(name);
+    return link == NULL ? NULL : *link;
+}
+
+int channel_join(const char *name, UserId id) {
+    if (name[0] == '\0' || strlen(name) >= MAX_CHANNEL_NAME) {
+        return 2;
+    }
+    if (num_channels >= table_capacity * 2) {
+        grow_table();
+    }
+    Channel **link = find_link(name);
+    if (*link == NULL) {
+        Channel *channel = Malloc(sizeof(Channel));
+        strcpy(channel->name, name);
+        channel->capacity = 4;
+        channel->subscribers = Malloc(sizeof(UserId) * channel->capacity);
+        channel->num_subscribers = 0;
+        channel->next = NULL;
+        *link = channel;
+        num_channels++;
+    }
+
+    Channel *channel = *link;
+    size_t index = subscriber_index(channel, id);
+    if (index < channel->num_subscribers && channel->subscribers[index] == id) {
+        return 1;
+    }
+    if (channel->num_subscribers == channel->capacity) {
+        channel->capacity *= 2;
+        channel->subscribers = realloc(channel->subscribers, sizeof(UserId) * channel->capacity);
+        if (channel->subscribers == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memmove(channel->subscribers + index + 1, channel->subscribers + index,
+            sizeof(UserId) * (channel->num_subscribers - index));
+    channel->subscribers[index] = id;
+    channel->num_subscribers++;
+    return 0;
+}
+
+int channel_leave(const char *name, UserId id) {
+    Channel **link = find_link(name);
+    if (link == NULL || *link == NULL) {
+        return 1;
+    }
+    size_t index = subscriber_index(*link, id);
+    if (index == (*link)->num_subscribers || (*link)->subscribers[index] != id) {
+        return 1;
+    }
+    remove_subscriber(link, index);
+    return 0;
+}
+
+int channel_subscribed(const Channel *channel, UserId id) {
+    size_t index = subscriber_index(channel, id);
+    return index < channel->num_subscribers && channel->subscribers[index] == id;
+}
+
+void channel_forget_user(UserId id) {
+    for (size_t i = 0; i < table_capacity; i++) {
+        Channel **link = &table[i];
+        while (*link != NULL) {
+            Channel *channel = *link;
+            size_t index = subscriber_index(channel, id);
+            if (index < channel->num_subscribers && channel->subscribers[index] == id) {
+                remove_subscriber(link, index);
+            }
+            if (*link == channel) {
+                link = &channel->next;
+            }
+        }
+    }
+}
+
+void channel_each(void (*fn)(const Channel *channel, void *arg), void *arg) {
+    for (size_t i = 0; i < table_capacity; i++) {
+        for (const Channel *channel = table[i]; channel != NULL; channel = channel->next) {
+            fn(channel, arg);
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stddef.h>
+
+#include "friends.h"
+
+/*
+ * Channels: named groups that users join to hear what's published to them.
+ * A channel exists while it has subscribers, kept as a sorted array of user
+ * IDs. Channels live only in the memory of the server they were joined on.
+ */
+#define MAX_CHANNEL_NAME MAX_NAME  // Including the null terminator
+
+typedef struct channel {
+    char name[MAX_CHANNEL_NAME];
+    UserId *subscribers;   // In increasing order
+    size_t num_subscribers;
+    size_t capacity;
+    struct channel *next;  // In the same bucket of the channel table
+} Channel;
+
+/* Return the channel called name, or NULL if nobody has joined it. */
+Channel *channel_find(const char *name);
+
+/*
+ * Subscribe the user with this ID to the channel called name, creating it
+ * if needed. Return 0 on success, 1 if they were already subscribed, and 2
+ * if the name is too long or empty.
+ */
+int channel_join(const char *name, UserId id);
+
+/*
+ * Unsubscribe the user with this ID from the channel called name, which
+ * goes once nobody is left. Return 0 on success and 1 if they weren't
+ * subscribed.
+ */
+int channel_leave(const char *name, UserId id);
+
+/* Return 1 if the user with this ID is subscribed to channel, 0 otherwise. */
+int channel_subscribed(const Channel *channel, UserId id);
+
+/* Unsubscribe the user with this ID from every channel, e.g. when they are deleted. */
+void channel_forget_user(UserId id);
+
+/* Call fn on every channel, in no particular order. fn must not join or leave any. */
+void channel_each(void (*fn)(const Channel *channel, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,100 @@
+#include "epoch.h"
+#include "friends.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+#define NUM_LIMBO 3  // Retired memory waits in one list per epoch, for two epochs
+
+/*
+ * One reader's state: the epoch it entered in, shifted left one,
+ * with the low bit set while it is reading. Records are never freed, so
+ * reclaim can look at them at any time.
+ */
+typedef struct reader {
+    uint64_t state;
+    struct reader *next;
+} Reader;
+
+typedef struct retired {
+    void *ptr;
+    void (*destroy)(void *);
+    struct retired *next;
+} Retired;
+
+static uint64_t global_epoch = 0;
+static __thread Reader *thread_reader = NULL;
+static Reader *all_readers = NULL;  // Every reader's record, newest first
+
+// Only touched by the writer thread. limbo[e % NUM_LIMBO] holds what was
+// retired in epoch e, which is safe to free once the epoch reaches e + 2.
+static Retired *limbo[NUM_LIMBO];
+
+
+EpochReader *epoch_reader_new(void) {
+    Reader *new = Malloc(sizeof(Reader));
+    new->state = 0;
+    new->next = __atomic_load_n(&all_readers, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&all_readers, &new->next, new, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    }
+    return new;
+}
+
+
+void epoch_enter_as(Reader *reader) {
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    // Sequentially consistent, so the writer can't miss this store and then
+    // have it overtaken by the reads that follow it
+    __atomic_store_n(&reader->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+}
+
+
+void epoch_exit_as(Reader *reader) {
+    __atomic_store_n(&reader->state, 0, __ATOMIC_RELEASE);
+}
+
+
+void epoch_enter(void) {
+    // Each thread registers its record the first time it reads
+    if (thread_reader == NULL) {
+        thread_reader = epoch_reader_new();
+    }
+    epoch_enter_as(thread_reader);
+}
+
+
+void epoch_exit(void) {
+    epoch_exit_as(thread_reader);
+}
+
+
+void epoch_retire(void *ptr, void (*destroy)(void *)) {
+    Retired *retired = Malloc(sizeof(Retired));
+    retired->ptr = ptr;
+    retired->destroy = destroy;
+    retired->next = limbo[global_epoch % NUM_LIMBO];
+    limbo[global_epoch % NUM_LIMBO] = retired;
+}
+
+
+void epoch_reclaim(void) {
+    uint64_t epoch = global_epoch;
+    for (Reader *curr = __atomic_load_n(&all_readers, __ATOMIC_ACQUIRE); curr != NULL; curr = curr->next) {
+        uint64_t state = __atomic_load_n(&curr->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch) {
+            return;  // Still reading in an older epoch
+        }
+    }
+
+    // Everyone reading now started in this epoch or later, so nobody can
+    // still hold what was retired in the one before it
+    __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    Retired *safe = limbo[(epoch + 2) % NUM_LIMBO];
+    limbo[(epoch + 2) % NUM_LIMBO] = NULL;
+    while (safe != NULL) {
+        Retired *next = safe->next;
+        safe->destroy(safe->ptr);
+        free(safe);
+        safe = next;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation. When a user or post is deleted, other threads
+ * may still be reading it, e.g. part way through rendering a profile. So
+ * instead of being freed straight away, unlinked memory is retired, and
+ * freed only once every thread that could have seen it has moved on.
+ *
+ * Readers bracket each pass over the shared data with epoch_enter and
+ * epoch_exit, and keep no pointers into it afterwards. Neither call takes
+ * a lock or waits. Retiring and reclaiming are only done by the one thread
+ * that changes the data (the server's event loop), which can read it
+ * without entering.
+ */
+
+/* Start reading. Sections may not be nested. */
+void epoch_enter(void);
+
+/* Stop reading. */
+void epoch_exit(void);
+
+/*
+ * A reader that isn't tied to a thread, for reading that is handed from one
+ * thread to another: the writer enters on its behalf when it hands over
+ * pointers into the shared data, and whichever thread uses them exits once
+ * it's done. Readers are never freed, so reuse them.
+ */
+typedef struct reader EpochReader;
+
+/* Return a new reader, not yet reading. */
+EpochReader *epoch_reader_new(void);
+
+/* epoch_enter for reader. */
+void epoch_enter_as(EpochReader *reader);
+
+/* epoch_exit for reader. */
+void epoch_exit_as(EpochReader *reader);
+
+/*
+ * Call destroy(ptr) once no reader can still be using ptr, which must
+ * already be unreachable for new readers.
+ */
+void epoch_retire(void *ptr, void (*destroy)(void *));
+
+/*
+ * Move to the next epoch if every reader has caught up with the current
+ * one, and free whatever is then safe to free. Cheap enough to call on
+ * every pass of the event loop.
+ */
+void epoch_reclaim(void);
+
+#endif
@@ -0,0 +1,179 @@
+#include "frame.h"
+#include "friends.h"
+#include "memstats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_STR 65535  // Longest string a 2 byte length can describe
+
+/* Start builder off empty. */
+void frame_init(FrameBuilder *builder) {
+    builder->data = NULL;
+    builder->len = 0;
+    builder->capacity = 0;
+}
+
+/* Make room for n more bytes and return where they go. */
+static char *reserve(FrameBuilder *builder, size_t n) {
+    if (builder->len + n > builder->capacity) {
+        size_t new_capacity = builder->capacity == 0 ? 256 : builder->capacity;
+        while (new_capacity < builder->len + n) {
+            new_capacity *= 2;
+        }
+        builder->data = realloc(builder->data, new_capacity);
+        if (builder->data == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        builder->capacity = new_capacity;
+    }
+    char *at = builder->data + builder->len;
+    builder->len += n;
+    return at;
+}
+
+/* Write value big-endian into the n bytes at out. */
+static void write_be(char *out, uint64_t value, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        out[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/* Read an n byte big-endian integer from in. */
+static uint64_t read_be(const char *in, int n) {
+    uint64_t value = 0;
+    for (int i = 0; i < n; i++) {
+        value = (value << 8) | (unsigned char) in[i];
+    }
+    return value;
+}
+
+size_t frame_begin(FrameBuilder *builder, uint8_t opcode, uint32_t tag) {
+    size_t start = builder->len;
+    char *header = reserve(builder, FRAME_HEADER_LEN);
+    write_be(header, 0, 4);
+    header[4] = opcode;
+    write_be(header + 5, tag, 4);
+    return start;
+}
+
+void frame_end(FrameBuilder *builder, size_t start) {
+    write_be(builder->data + start, builder->len - start - FRAME_HEADER_LEN, 4);
+}
+
+void frame_put_u8(FrameBuilder *builder, uint8_t value) {
+    write_be(reserve(builder, 1), value, 1);
+}
+
+void frame_put_u16(FrameBuilder *builder, uint16_t value) {
+    write_be(reserve(builder, 2), value, 2);
+}
+
+void frame_put_u32(FrameBuilder *builder, uint32_t value) {
+    write_be(reserve(builder, 4), value, 4);
+}
+
+void frame_put_u64(FrameBuilder *builder, uint64_t value) {
+    write_be(reserve(builder, 8), value, 8);
+}
+
+/* Strings too long for their length field are truncated. */
+void frame_put_str(FrameBuilder *builder, const char *str) {
+    size_t len = strlen(str);
+    if (len > MAX_STR) {
+        len = MAX_STR;
+    }
+    frame_put_u16(builder, len);
+    memcpy(reserve(builder, len), str, len);
+}
+
+void frame_put_bytes(FrameBuilder *builder, const char *data, size_t len) {
+    memcpy(reserve(builder, len), data, len);
+}
+
+Buffer *frame_take(FrameBuilder *builder) {
+    Buffer *buf = buffer_adopt(mem_adopt(MEM_RESPONSES, builder->data), builder->len);
+    frame_init(builder);
+    return buf;
+}
+
+void frame_free(FrameBuilder *builder) {
+    free(builder->data);
+    frame_init(builder);
+}
+
+
+long frame_parse_header(const char *buf, size_t n, size_t max_len,
+                        uint8_t *opcode, uint32_t *tag) {
+    if (n < 4) {
+        return 0;
+    }
+    uint64_t len = read_be(buf, 4);
+    if (len > max_len) {
+        return -1;
+    }
+    if (n < FRAME_HEADER_LEN + len) {
+        return 0;
+    }
+    *opcode = buf[4];
+    *tag = read_be(buf + 5, 4);
+    return FRAME_HEADER_LEN + len;
+}
+
+int frame_get_u8(FrameReader *reader, uint8_t *value) {
+    if (reader->left < 1) {
+        return -1;
+    }
+    *value = read_be(reader->pos, 1);
+    reader->pos += 1;
+    reader->left -= 1;
+    return 0;
+}
+
+int frame_get_u32(FrameReader *reader, uint32_t *value) {
+    if (reader->left < 4) {
+        return -1;
+    }
+    *value = read_be(reader->pos, 4);
+    reader->pos += 4;
+    reader->left -= 4;
+    return 0;
+}
+
+int frame_get_u64(FrameReader *reader, uint64_t *value) {
+    if (reader->left < 8) {
+        return -1;
+    }
+    *value = read_be(reader->pos, 8);
+    reader->pos += 8;
+    reader->left -= 8;
+    return 0;
+}
+
+char *frame_get_str(FrameReader *reader, MemTag tag) {
+    if (reader->left < 2) {
+        return NULL;
+    }
+    size_t len = read_be(reader->pos, 2);
+    if (reader->left < 2 + len) {
+        return NULL;
+    }
+    char *out = mem_alloc(tag, len + 1);
+    memcpy(out, reader->pos + 2, len);
+    out[len] = '\0';
+    reader->pos += 2 + len;
+    reader->left -= 2 + len;
+    return out;
+}
+
+const char *frame_get_bytes(FrameReader *reader, size_t len) {
+    if (reader->left < len) {
+        return NULL;
+    }
+    const char *bytes = reader->pos;
+    reader->pos += len;
+    reader->left -= len;
+    return bytes;
+}
@@ -0,0 +1,157 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "memstats.h"
+
+/*
+ * The binary protocol. A client picks it by sending FRAME_MAGIC instead of
+ * its name in reply to the server's "What is your name?\r\n" prompt, which
+ * it should skip. From then on both directions carry only frames, and no
+ * more text prompts are sent.
+ *
+ * Every frame starts with a FRAME_HEADER_LEN byte header:
+ *
+ *   length (4 bytes): the number of bytes that follow the header
+ *   opcode (1 byte)
+ *   tag    (4 bytes): chosen by the client and echoed in the reply, so
+ *                     replies can be matched to pipelined requests. It is 0
+ *                     in notifications.
+ *
+ * followed by the opcode's fields. Integers are big-endian, and strings are
+ * a 2 byte length followed by that many bytes (no null terminator).
+ *
+ * Every request except FRAME_QUIT gets exactly one reply frame, either the
+ * reply listed below or FRAME_ERROR. Requests on a connection are run, and
+ * replied to, in order.
+ */
+#define FRAME_MAGIC "\0FRIENDS1"   // The leading 0 byte can't start a name
+#define FRAME_MAGIC_LEN 9
+#define FRAME_HEADER_LEN 9
+#define FRAME_MAX_REQUEST 65536    // Longest request frame, header excluded
+
+// Requests
+#define FRAME_LOGIN 0x01           // name -> FRAME_LOGGED_IN. Must come first.
+#define FRAME_QUIT 0x02            // The server closes the connection
+#define FRAME_LIST_USERS 0x03      // -> FRAME_USERS
+#define FRAME_MAKE_FRIENDS 0x04    // name -> FRAME_FRIENDED
+#define FRAME_POST 0x05            // target name, contents -> FRAME_OK
+#define FRAME_PROFILE 0x06         // name -> FRAME_USER_PROFILE
+#define FRAME_TRACE_DUMP 0x07      // -> FRAME_TRACE_DUMPED
+#define FRAME_BATCH 0x08           // Any number of request frames -> FRAME_BATCH_REPLY
+#define FRAME_HISTORY 0x09         // name, page (4, newest is 1) -> FRAME_POSTS
+#define FRAME_UNFRIEND 0x0A        // name -> FRAME_OK
+#define FRAME_DELETE_POST 0x0B     // profile name, post number (4, newest is 1) -> FRAME_OK
+#define FRAME_DELETE_USER 0x0C     // -> FRAME_OK, then the server closes every
+                                   // connection logged in as the user
+#define FRAME_REPLICATION 0x0D     // -> FRAME_REPLICATION_STATUS
+#define FRAME_ONLINE_FRIENDS 0x0E  // -> FRAME_USERS, the friends who are online
+#define FRAME_FRIENDS_STATUS 0x0F  // -> FRAME_FRIEND_STATUSES
+#define FRAME_JOIN 0x10            // channel -> FRAME_OK
+#define FRAME_LEAVE 0x11           // channel -> FRAME_OK
+#define FRAME_PUBLISH 0x12         // channel, contents -> FRAME_OK. Subscribers, the
+                                   // publisher included, get FRAME_NOTIFY_CHANNEL.
+#define FRAME_MEMSTATS 0x13        // -> FRAME_MEMORY
+
+// Replies
+#define FRAME_OK 0x80
+#define FRAME_ERROR 0x81           // message
+#define FRAME_LOGGED_IN 0x82       // user ID (4), returning user (1)
+#define FRAME_USERS 0x83           // count (4), then that many names
+#define FRAME_FRIENDED 0x84        // name
+#define FRAME_USER_PROFILE 0x85    // name, friend count (2), friend names,
+                                   // post count (4), then per post: author,
+                                   // date (8, seconds since the epoch), contents
+#define FRAME_TRACE_DUMPED 0x86    // event count (4), path
+#define FRAME_POSTS 0x87           // post count (4), then posts as in FRAME_USER_PROFILE
+#define FRAME_BATCH_REPLY 0x88     // One reply frame per request in the batch
+#define FRAME_REPLICATION_STATUS 0x89  // role (1: 0 off, 1 primary, 2 follower),
+                                   // log bytes logged or applied (8), bytes behind (8),
+                                   // follower's lag (8, microseconds)
+#define FRAME_FRIEND_STATUSES 0x8A // count (4), then per friend: name, online (1)
+#define FRAME_MEMORY 0x8B          // count (1), then per part of the server: name, live
+                                   // bytes (8), objects (8); then the heap's bytes in use (8)
+
+// Notifications, sent with tag 0 whenever they happen
+#define FRAME_NOTIFY_FRIENDED 0xC0 // name of the user who friended you
+#define FRAME_NOTIFY_POST 0xC1     // author, contents
+#define FRAME_NOTIFY_UNFRIENDED 0xC2  // name of the user who unfriended you
+#define FRAME_NOTIFY_PRESENCE 0xC3 // count (4), then per friend who came online or
+                                   // went offline: name, online (1). Sent in batches.
+#define FRAME_NOTIFY_CHANNEL 0xC4  // channel, author, contents
+
+
+/* A growable byte string that frames are written into. */
+typedef struct frame_builder {
+    char *data;
+    size_t len;
+    size_t capacity;
+} FrameBuilder;
+
+/* Start builder off empty. */
+void frame_init(FrameBuilder *builder);
+
+/*
+ * Append the header of a frame. Its length is filled in by frame_end,
+ * which must be passed the offset this returns. Frames can be nested.
+ */
+size_t frame_begin(FrameBuilder *builder, uint8_t opcode, uint32_t tag);
+void frame_end(FrameBuilder *builder, size_t start);
+
+/* Append a field to the frame being built. */
+void frame_put_u8(FrameBuilder *builder, uint8_t value);
+void frame_put_u16(FrameBuilder *builder, uint16_t value);
+void frame_put_u32(FrameBuilder *builder, uint32_t value);
+void frame_put_u64(FrameBuilder *builder, uint64_t value);
+void frame_put_str(FrameBuilder *builder, const char *str);
+void frame_put_bytes(FrameBuilder *builder, const char *data, size_t len);  // No length field
+
+/*
+ * Move everything built so far into a new buffer and leave builder
+ * empty. The caller owns the returned reference.
+ */
+Buffer *frame_take(FrameBuilder *builder);
+
+/* Free builder's storage. */
+void frame_free(FrameBuilder *builder);
+
+
+/*
+ * If the first n bytes of buf hold a complete frame, return its total
+ * length (header included) and fill in its opcode and tag. Return 0 if
+ * more bytes are needed, and -1 if the frame is longer than max_len.
+ */
+long frame_parse_header(const char *buf, size_t n, size_t max_len,
+                        uint8_t *opcode, uint32_t *tag);
+
+/* Reads fields out of a frame's body. */
+typedef struct frame_reader {
+    const char *pos;
+    size_t left;
+} FrameReader;
+
+/*
+ * Take the next 1, 4 or 8 byte integer field of reader. Return 0 on
+ * success and -1 if the frame is too short.
+ */
+int frame_get_u8(FrameReader *reader, uint8_t *value);
+int frame_get_u32(FrameReader *reader, uint32_t *value);
+int frame_get_u64(FrameReader *reader, uint64_t *value);
+
+/*
+ * Take the next string field of reader and return it as a new
+ * null-terminated string, allocated for tag (free it with mem_free), or
+ * return NULL if the frame is too short.
+ */
+char *frame_get_str(FrameReader *reader, MemTag tag);
+
+/*
+ * Take the next len bytes of reader and return where they are, or return
+ * NULL if the frame is too short.
+ */
+const char *frame_get_bytes(FrameReader *reader, size_t len);
+
+#endif
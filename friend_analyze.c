@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "friends.h"
+
+#define INPUT_BUFFER_SIZE 256
+#define DELIM " \r\n"
+#define CHUNK_SIZE 1024  // Vertices a worker claims at a time
+
+
+/*
+ * The friendship graph in compressed sparse row form. Vertex v is the user
+ * with ID v + 1, and its neighbours are adj[offsets[v]] .. adj[offsets[v + 1] - 1].
+ */
+typedef struct graph {
+    uint32_t num_vertices;
+    uint32_t *offsets;
+    uint32_t *adj;
+} Graph;
+
+/* Results accumulated by one worker thread, merged once all workers finish. */
+typedef struct worker {
+    pthread_t thread;
+    long degree_count[MAX_FRIENDS + 1];  // degree_count[d] is the number of vertices of degree d
+    unsigned long long triangles;        // Triangles counted once per corner
+    unsigned long long triples;          // Connected triples centred on a vertex
+    double clustering_sum;               // Sum of local clustering coefficients
+} Worker;
+
+static Graph graph;
+static uint32_t *parent;        // Union-find forest over the vertices
+static uint32_t next_chunk = 0; // First vertex not yet claimed by a worker
+static int phase;               // Which pass the workers are running
+
+
+/*
+ * Replay the add_user and make_friends commands of a friendme command
+ * script into the list pointed to by user_list_ptr. Other commands are
+ * ignored since they do not change the graph.
+ * Return the number of lines read, or -1 if the file can't be opened.
+ */
+long load_script(const char *path, User **user_list_ptr) {
+    FILE *input_stream = fopen(path, "r");
+    if (input_stream == NULL) {
+        perror("Error opening file");
+        return -1;
+    }
+
+    char input[INPUT_BUFFER_SIZE];
+    long lines = 0;
+    User *last_user = NULL;
+    while (fgets(input, INPUT_BUFFER_SIZE, input_stream) != NULL) {
+        lines++;
+        char *cmd = strtok(input, DELIM);
+        char *arg1 = strtok(NULL, DELIM);
+        char *arg2 = strtok(NULL, DELIM);
+        if (cmd == NULL || arg1 == NULL) {
+            continue;
+        } else if (strcmp(cmd, "add_user") == 0) {
+            // Check for duplicates through the name index, then skip create_user's own check
+            if (find_user(arg1, *user_list_ptr) == NULL) {
+                create_user_bulk(arg1, user_list_ptr, &last_user);
+            }
+        } else if (strcmp(cmd, "make_friends") == 0 && arg2 != NULL) {
+            make_friends(arg1, arg2, *user_list_ptr);
+        }
+    }
+
+    fclose(input_stream);
+    return lines;
+}
+
+
+/* Build graph from the users in the list starting at head. */
+void build_graph(const User *head) {
+    uint32_t max_id = 0;
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        if (curr->id > max_id) {
+            max_id = curr->id;
+        }
+    }
+
+    graph.num_vertices = max_id;
+    graph.offsets = Malloc(sizeof(uint32_t) * (max_id + 1));
+    graph.offsets[0] = 0;
+    for (uint32_t v = 0; v < max_id; v++) {
+        const User *user = user_by_id(v + 1);
+        int degree = 0;
+        while (user != NULL && degree < MAX_FRIENDS && user->friends[degree] != NO_USER) {
+            degree++;
+        }
+        graph.offsets[v + 1] = graph.offsets[v] + degree;
+    }
+
+    graph.adj = Malloc(sizeof(uint32_t) * (graph.offsets[max_id] + 1));
+    for (uint32_t v = 0; v < max_id; v++) {
+        const User *user = user_by_id(v + 1);
+        for (uint32_t i = graph.offsets[v]; i < graph.offsets[v + 1]; i++) {
+            graph.adj[i] = user->friends[i - graph.offsets[v]] - 1;
+        }
+    }
+}
+
+
+/* Return the root of v's tree, halving the path on the way up. */
+static uint32_t find_root(uint32_t v) {
+    uint32_t p = __atomic_load_n(&parent[v], __ATOMIC_RELAXED);
+    while (p != v) {
+        uint32_t grandparent = __atomic_load_n(&parent[p], __ATOMIC_RELAXED);
+        // Only a shortcut, so losing the race to another thread is harmless
+        __atomic_compare_exchange_n(&parent[v], &p, grandparent, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        v = p;
+        p = __atomic_load_n(&parent[v], __ATOMIC_RELAXED);
+    }
+    return v;
+}
+
+/*
+ * Merge the trees containing a and b. Roots only ever link to a smaller
+ * root, so concurrent unions can never form a cycle.
+ */
+static void unite(uint32_t a, uint32_t b) {
+    while (1) {
+        a = find_root(a);
+        b = find_root(b);
+        if (a == b) {
+            return;
+        }
+        if (a < b) {
+            uint32_t tmp = a;
+            a = b;
+            b = tmp;
+        }
+        uint32_t expected = a;
+        if (__atomic_compare_exchange_n(&parent[a], &expected, b, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+/* Return 1 if w is a neighbour of v, 0 otherwise. */
+static int adjacent(uint32_t v, uint32_t w) {
+    for (uint32_t i = graph.offsets[v]; i < graph.offsets[v + 1]; i++) {
+        if (graph.adj[i] == w) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Union the endpoints of every edge of v. */
+static void connect_vertex(uint32_t v) {
+    for (uint32_t i = graph.offsets[v]; i < graph.offsets[v + 1]; i++) {
+        if (graph.adj[i] > v) {  // every edge is stored twice; one union is enough
+            unite(v, graph.adj[i]);
+        }
+    }
+}
+
+/* Count the degree of v and the triangles through it. */
+static void measure_vertex(uint32_t v, Worker *worker) {
+    uint32_t start = graph.offsets[v];
+    uint32_t degree = graph.offsets[v + 1] - start;
+    worker->degree_count[degree]++;
+
+    unsigned long long closed = 0;
+    for (uint32_t i = 0; i < degree; i++) {
+        for (uint32_t j = i + 1; j < degree; j++) {
+            closed += adjacent(graph.adj[start + i], graph.adj[start + j]);
+        }
+    }
+
+    unsigned long long pairs = (unsigned long long) degree * (degree - 1) / 2;
+    worker->triangles += closed;
+    worker->triples += pairs;
+    if (pairs > 0) {
+        worker->clustering_sum += (double) closed / pairs;
+    }
+}
+
+/* Claim chunks of vertices until none are left, running the current phase on each. */
+static void *run_worker(void *arg) {
+    Worker *worker = arg;
+    while (1) {
+        uint32_t first = __atomic_fetch_add(&next_chunk, CHUNK_SIZE, __ATOMIC_RELAXED);
+        if (first >= graph.num_vertices) {
+            return NULL;
+        }
+        uint32_t last = first + CHUNK_SIZE;
+        if (last > graph.num_vertices || last < first) {
+            last = graph.num_vertices;
+        }
+        for (uint32_t v = first; v < last; v++) {
+            if (phase == 0) {
+                connect_vertex(v);
+            } else {
+                measure_vertex(v, worker);
+            }
+        }
+    }
+}
+
+/* Run one phase over every vertex on num_workers threads. */
+static void run_phase(int which, Worker *workers, int num_workers) {
+    phase = which;
+    next_chunk = 0;
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+}
+
+
+void print_report(Worker *workers, int num_workers) {
+    uint32_t n = graph.num_vertices;
+    unsigned long long num_edges = graph.offsets[n] / 2;
+
+    // Components: count roots and their sizes
+    uint32_t *sizes = Malloc(sizeof(uint32_t) * (n + 1));
+    memset(sizes, 0, sizeof(uint32_t) * (n + 1));
+    for (uint32_t v = 0; v < n; v++) {
+        sizes[find_root(v)]++;
+    }
+    uint32_t components = 0, largest = 0, isolated = 0;
+    for (uint32_t v = 0; v < n; v++) {
+        if (sizes[v] > 0) {
+            components++;
+            if (sizes[v] > largest) {
+                largest = sizes[v];
+            }
+            if (sizes[v] == 1) {
+                isolated++;
+            }
+        }
+    }
+    free(sizes);
+
+    long degree_count[MAX_FRIENDS + 1] = {0};
+    unsigned long long triangles = 0, triples = 0;
+    double clustering_sum = 0;
+    for (int i = 0; i < num_workers; i++) {
+        for (int d = 0; d <= MAX_FRIENDS; d++) {
+            degree_count[d] += workers[i].degree_count[d];
+        }
+        triangles += workers[i].triangles;
+        triples += workers[i].triples;
+        clustering_sum += workers[i].clustering_sum;
+    }
+
+    printf("Users: %u\n", n);
+    printf("Friendships: %llu\n", num_edges);
+    printf("Average degree: %.3f\n", n == 0 ? 0.0 : 2.0 * num_edges / n);
+    printf("Connected components: %u (largest %u, isolated users %u)\n", components, largest, isolated);
+    printf("Triangles: %llu\n", triangles / 3);  // each triangle was counted at all three corners
+    printf("Average clustering coefficient: %.6f\n", n == 0 ? 0.0 : clustering_sum / n);
+    printf("Global clustering coefficient: %.6f\n", triples == 0 ? 0.0 : (double) triangles / triples);
+    printf("Degree distribution:\n");
+    for (int d = 0; d <= MAX_FRIENDS; d++) {
+        printf("\t%d\t%ld\n", d, degree_count[d]);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    int num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+            case 't':
+                num_workers = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] command_file\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-t threads] command_file\n", argv[0]);
+        exit(1);
+    }
+    if (num_workers < 1) {
+        num_workers = 1;
+    }
+
+    User *user_list = NULL;
+    if (load_script(argv[optind], &user_list) == -1) {
+        exit(1);
+    }
+    build_graph(user_list);
+
+    parent = Malloc(sizeof(uint32_t) * (graph.num_vertices + 1));
+    for (uint32_t v = 0; v < graph.num_vertices; v++) {
+        parent[v] = v;
+    }
+
+    Worker *workers = Malloc(sizeof(Worker) * num_workers);
+    memset(workers, 0, sizeof(Worker) * num_workers);
+    run_phase(0, workers, num_workers);
+    run_phase(1, workers, num_workers);
+
+    print_report(workers, num_workers);
+    return 0;
+}
@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "friends.h"
+#include "capture.h"
+
+#ifndef PORT
+  #define PORT 57509
+#endif
+
+#define PROMPT_END "commands>\r\n"      // End of the prompt the server sends after each command
+#define LINE_TIMEOUT_US 10000000        // Give up waiting for a reply after 10 seconds
+#define RECV_SIZE 4096
+
+
+/* One captured event, replayed by its session. */
+typedef struct event {
+    uint64_t time_us;
+    int type;
+    uint32_t service_us;
+    uint32_t len;
+    char *line;
+    struct event *next;  // Next event of the same session
+} Event;
+
+/* A captured session being replayed over its own connection. */
+typedef struct session {
+    uint32_t id;
+    int fd;                // -1 when not connected
+    Event *next_event;     // Next event to replay, NULL when done
+    Event *last_event;
+    int waiting;           // 1 while a sent line has not been answered yet
+    uint64_t sent_us;      // When the unanswered line was sent
+    int matched;           // How much of PROMPT_END the last bytes received matched
+    int heap_index;        // Position in the ready heap, or -1
+} Session;
+
+/* Running statistics of latencies (in microseconds). */
+typedef struct stats {
+    uint32_t *values;
+    size_t count;
+    size_t capacity;
+} Stats;
+
+static Session *sessions = NULL;
+static size_t num_sessions = 0;
+static size_t sessions_capacity = 0;
+
+// Min-heap of sessions whose next event can run, ordered by its scheduled time
+static Session **ready = NULL;
+static size_t num_ready = 0;
+
+static double speed = 1.0;  // 0 means as fast as possible
+static uint64_t replay_start_us;
+static size_t connected = 0;  // Sessions with an open connection
+
+
+static void stats_add(Stats *stats, uint64_t value) {
+    if (stats->count == stats->capacity) {
+        stats->capacity = stats->capacity == 0 ? 1024 : stats->capacity * 2;
+        stats->values = realloc(stats->values, sizeof(uint32_t) * stats->capacity);
+        if (stats->values == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    stats->values[stats->count++] = value > UINT32_MAX ? UINT32_MAX : value;
+}
+
+static int compare_uint32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Return the p-th percentile of stats, sorting them first. */
+static double percentile(Stats *stats, double p) {
+    if (stats->count == 0) {
+        return 0;
+    }
+    qsort(stats->values, stats->count, sizeof(uint32_t), compare_uint32);
+    size_t index = (size_t) (p / 100 * (stats->count - 1) + 0.5);
+    return stats->values[index] / 1000.0;
+}
+
+static double mean(const Stats *stats) {
+    double sum = 0;
+    for (size_t i = 0; i < stats->count; i++) {
+        sum += stats->values[i];
+    }
+    return stats->count == 0 ? 0 : sum / stats->count / 1000.0;
+}
+
+
+/* Return the session with this ID, creating it if this is its first event. */
+static Session *get_session(uint32_t id) {
+    // Session IDs are handed out in order, so new sessions are usually the last one
+    for (size_t i = num_sessions; i > 0; i--) {
+        if (sessions[i - 1].id == id) {
+            return &sessions[i - 1];
+        }
+        if (sessions[i - 1].id < id) {
+            break;
+        }
+    }
+    for (size_t i = 0; i < num_sessions; i++) {
+        if (sessions[i].id == id) {
+            return &sessions[i];
+        }
+    }
+
+    if (num_sessions == sessions_capacity) {
+        sessions_capacity = sessions_capacity == 0 ? 64 : sessions_capacity * 2;
+        sessions = realloc(sessions, sizeof(Session) * sessions_capacity);
+        if (sessions == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    Session *session = &sessions[num_sessions++];
+    session->id = id;
+    session->fd = -1;
+    session->next_event = NULL;
+    session->last_event = NULL;
+    session->waiting = 0;
+    session->matched = 0;
+    session->heap_index = -1;
+    return session;
+}
+
+/*
+ * Read the whole capture at path into per-session event lists.
+ * Store original per-line server times in service and return the total
+ * number of lines, or -1 on error.
+ */
+static long load_capture(const char *path, uint64_t *duration_us, Stats *service) {
+    FILE *stream = fopen(path, "r");
+    if (stream == NULL) {
+        perror("Error opening capture");
+        return -1;
+    }
+    if (capture_read_header(stream) == -1) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        fclose(stream);
+        return -1;
+    }
+
+    CaptureRecord *rec = Malloc(sizeof(CaptureRecord));
+    uint64_t prev_us = 0;
+    long lines = 0;
+    int result;
+    while ((result = capture_read(stream, prev_us, rec)) == 1) {
+        prev_us = rec->time_us;
+
+        Event *event = Malloc(sizeof(Event));
+        event->time_us = rec->time_us;
+        event->type = rec->type;
+        event->service_us = rec->service_us;
+        event->len = rec->len;
+        event->line = NULL;
+        event->next = NULL;
+        if (rec->type == CAPTURE_LINE) {
+            event->line = Malloc(rec->len + 2);
+            memcpy(event->line, rec->line, rec->len);
+            memcpy(event->line + rec->len, "\r\n", 2);
+            stats_add(service, rec->service_us);
+            lines++;
+        }
+
+        Session *session = get_session(rec->session);
+        if (session->last_event == NULL) {
+            session->next_event = event;
+        } else {
+            session->last_event->next = event;
+        }
+        session->last_event = event;
+    }
+    free(rec);
+    fclose(stream);
+
+    if (result == -1) {
+        fprintf(stderr, "%s is truncated or corrupt; replaying what was read\n", path);
+    }
+    *duration_us = prev_us;
+    return lines;
+}
+
+/*
+ * Add the per-line server times in the capture at path to service, e.g. the
+ * one the target server wrote during the replay. Return the number of
+ * lines, or -1 on error.
+ */
+static long load_service_times(const char *path, Stats *service) {
+    FILE *stream = fopen(path, "r");
+    if (stream == NULL) {
+        perror("Error opening target capture");
+        return -1;
+    }
+    if (capture_read_header(stream) == -1) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        fclose(stream);
+        return -1;
+    }
+
+    CaptureRecord *rec = Malloc(sizeof(CaptureRecord));
+    uint64_t prev_us = 0;
+    long lines = 0;
+    while (capture_read(stream, prev_us, rec) == 1) {
+        prev_us = rec->time_us;
+        if (rec->type == CAPTURE_LINE) {
+            stats_add(service, rec->service_us);
+            lines++;
+        }
+    }
+    free(rec);
+    fclose(stream);
+    return lines;
+}
+
+/*
+ * Print a row comparing the original and replayed server times: their p-th
+ * percentiles, or means if p is negative. replay is NULL if it wasn't read.
+ */
+static void print_service_row(const char *label, Stats *original, Stats *replay, double p) {
+    double value = p < 0 ? mean(original) : percentile(original, p);
+    if (replay == NULL) {
+        printf("%-26s%14.3f%14s\n", label, value, "-");
+    } else {
+        printf("%-26s%14.3f%14.3f\n", label, value, p < 0 ? mean(replay) : percentile(replay, p));
+    }
+}
+
+
+/* When session's next event should run, relative to the start of the replay. */
+static uint64_t due_us(const Session *session) {
+    return speed == 0 ? 0 : (uint64_t) (session->next_event->time_us / speed);
+}
+
+static void heap_swap(size_t i, size_t j) {
+    Session *tmp = ready[i];
+    ready[i] = ready[j];
+    ready[j] = tmp;
+    ready[i]->heap_index = i;
+    ready[j]->heap_index = j;
+}
+
+static void heap_push(Session *session) {
+    size_t i = num_ready++;
+    ready[i] = session;
+    session->heap_index = i;
+    while (i > 0 && due_us(ready[(i - 1) / 2]) > due_us(ready[i])) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static Session *heap_pop(void) {
+    Session *top = ready[0];
+    top->heap_index = -1;
+    if (--num_ready == 0) {
+        return top;
+    }
+    ready[0] = ready[num_ready];
+    ready[0]->heap_index = 0;
+    size_t i = 0;
+    while (1) {
+        size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < num_ready && due_us(ready[left]) < due_us(ready[smallest])) {
+            smallest = left;
+        }
+        if (right < num_ready && due_us(ready[right]) < due_us(ready[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return top;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void end_session(Session *session) {
+    if (session->fd != -1) {
+        close(session->fd);
+        session->fd = -1;
+        connected--;
+    }
+    session->waiting = 0;
+}
+
+/*
+ * Put session back in the ready heap if it has anything left to replay,
+ * or hang up if the capture ended while it was still connected.
+ */
+static void make_ready(Session *session) {
+    if (session->waiting || session->heap_index != -1) {
+        return;
+    }
+    if (session->next_event != NULL) {
+        heap_push(session);
+    } else {
+        end_session(session);
+    }
+}
+
+
+static int connect_to_server(const char *host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "Bad server address %s\n", host);
+        exit(1);
+    }
+    if (connect(fd, (struct sockaddr *) &server, sizeof(server)) == -1) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    const char *target_capture = NULL;  // Written by the server being replayed to, if given
+    int port = PORT;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:H:p:c:")) != -1) {
+        switch (opt) {
+            case 's':
+                speed = strtod(optarg, NULL);
+                break;
+            case 'H':
+                host = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'c':
+                target_capture = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s speed (0 = max)] [-H host] [-p port] [-c target_capture_file] capture_file\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+    if (optind != argc - 1 || speed < 0) {
+        fprintf(stderr, "Usage: %s [-s speed (0 = max)] [-H host] [-p port] [-c target_capture_file] capture_file\n",
+                argv[0]);
+        exit(1);
+    }
+
+    uint64_t original_us;
+    Stats service = {NULL, 0, 0};
+    long total_lines = load_capture(argv[optind], &original_us, &service);
+    if (total_lines == -1) {
+        exit(1);
+    }
+
+    ready = Malloc(sizeof(Session *) * (num_sessions + 1));
+    struct pollfd *fds = Malloc(sizeof(struct pollfd) * (num_sessions + 1));
+    Session **polled = Malloc(sizeof(Session *) * (num_sessions + 1));
+    for (size_t i = 0; i < num_sessions; i++) {
+        make_ready(&sessions[i]);
+    }
+
+    Stats latency = {NULL, 0, 0};
+    Stats slip = {NULL, 0, 0};
+    long lines_sent = 0, timeouts = 0, failed_connects = 0;
+    char recv_buf[RECV_SIZE];
+    replay_start_us = capture_now_us();
+
+    while (num_ready > 0 || connected > 0) {
+        uint64_t now = capture_now_us() - replay_start_us;
+
+        // Run every event that is due
+        while (num_ready > 0 && due_us(ready[0]) <= now) {
+            Session *session = heap_pop();
+            uint64_t due = due_us(session);
+            Event *event = session->next_event;
+            session->next_event = event->next;
+
+            if (event->type == CAPTURE_CONNECT) {
+                session->fd = connect_to_server(host, port);
+                if (session->fd == -1) {
+                    failed_connects++;
+                    session->next_event = NULL;  // nothing else in this session can run
+                } else {
+                    connected++;
+                }
+            } else if (event->type == CAPTURE_DISCONNECT) {
+                end_session(session);
+            } else if (session->fd != -1) {
+                if (send(session->fd, event->line, event->len + 2, MSG_NOSIGNAL) == -1) {
+                    end_session(session);
+                    session->next_event = NULL;
+                } else {
+                    stats_add(&slip, now - due);
+                    session->waiting = 1;
+                    session->sent_us = capture_now_us();
+                    lines_sent++;
+                }
+            }
+            make_ready(session);
+        }
+
+        // Wait for replies, or until the next event is due
+        int timeout_ms = 100;
+        if (num_ready > 0) {
+            uint64_t wait_us = due_us(ready[0]) - now;
+            timeout_ms = wait_us / 1000 < 100 ? wait_us / 1000 : 100;
+        }
+        nfds_t num_fds = 0;
+        for (size_t i = 0; i < num_sessions; i++) {
+            if (sessions[i].fd != -1) {
+                fds[num_fds].fd = sessions[i].fd;
+                fds[num_fds].events = POLLIN;
+                polled[num_fds++] = &sessions[i];
+            }
+        }
+        if (poll(fds, num_fds, timeout_ms) == -1 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+
+        uint64_t reply_us = capture_now_us();
+        for (nfds_t i = 0; i < num_fds; i++) {
+            Session *session = polled[i];
+            if (fds[i].revents == 0) {
+                if (session->waiting && reply_us - session->sent_us > LINE_TIMEOUT_US) {
+                    timeouts++;
+                    session->waiting = 0;
+                    make_ready(session);
+                }
+                continue;
+            }
+
+            ssize_t num_read = recv(session->fd, recv_buf, RECV_SIZE, 0);
+            if (num_read <= 0) {
+                // Server hung up, e.g. after quit
+                if (session->waiting) {
+                    stats_add(&latency, reply_us - session->sent_us);
+                }
+                end_session(session);
+                session->next_event = NULL;
+                continue;
+            }
+
+            // The line has been handled once the prompt that follows it arrives
+            for (ssize_t j = 0; j < num_read; j++) {
+                if (recv_buf[j] == PROMPT_END[session->matched]) {
+                    session->matched++;
+                } else {
+                    session->matched = (recv_buf[j] == PROMPT_END[0]);
+                }
+                if (PROMPT_END[session->matched] == '\0') {
+                    session->matched = 0;
+                    if (session->waiting) {
+                        stats_add(&latency, reply_us - session->sent_us);
+                        session->waiting = 0;
+                        make_ready(session);
+                    }
+                }
+            }
+        }
+    }
+
+    double original_s = original_us / 1e6;
+    double replay_s = (capture_now_us() - replay_start_us) / 1e6;
+
+    // The target records its own server time per line, which is what the
+    // capture holds; the round trip seen here also counts the network
+    Stats replay_service = {NULL, 0, 0};
+    if (target_capture != NULL && load_service_times(target_capture, &replay_service) == -1) {
+        target_capture = NULL;
+    }
+
+    printf("Sessions: %zu, lines: %ld captured, %ld replayed", num_sessions, total_lines, lines_sent);
+    printf(" (%ld timed out, %ld failed connections)\n", timeouts, failed_connects);
+    printf("%-26s%14s%14s\n", "", "original", "replay");
+    printf("%-26s%14.3f%14.3f\n", "Duration (s)", original_s, replay_s);
+    printf("%-26s%14.1f%14.1f\n", "Throughput (lines/s)",
+           original_s > 0 ? total_lines / original_s : 0.0,
+           replay_s > 0 ? lines_sent / replay_s : 0.0);
+    Stats *replayed = target_capture == NULL ? NULL : &replay_service;
+    print_service_row("Mean server time (ms)", &service, replayed, -1);
+    print_service_row("p50 server time (ms)", &service, replayed, 50);
+    print_service_row("p99 server time (ms)", &service, replayed, 99);
+    print_service_row("Max server time (ms)", &service, replayed, 100);
+    if (target_capture == NULL) {
+        printf("Replay server times need the target's capture (-c).\n");
+    }
+    printf("Replay round trip (ms): mean %.3f, p50 %.3f, p99 %.3f, max %.3f\n",
+           mean(&latency), percentile(&latency, 50), percentile(&latency, 99), percentile(&latency, 100));
+    if (speed > 0) {
+        printf("Speed %.2fx: lines were sent %.3f ms (p99 %.3f ms) behind schedule on average\n",
+               speed, mean(&slip), percentile(&slip, 99));
+    }
+    return 0;
+}
@@ -1,45 +1,382 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "friends.h"
+#include "buffer.h"
+#include "response_cache.h"
+#include "capture.h"
+#include "trace.h"
+#include "ratelimit.h"
+#include "frame.h"
+#include "timerwheel.h"
+#include "archive.h"
+#include "retention.h"
+#include "epoch.h"
+#include "repl.h"
+#include "snapshot.h"
+#include "handoff.h"
+#include "presence.h"
+#include "channel.h"
+#include "worker.h"
+#include "poststore.h"
+#include "memstats.h"
 
 #define MAX_BACKLOG 5
 #define BUF_SIZE 128
 #define DELIMITER " " // only delimiter for this program
 #define WELCOME_MSG "What is your name?\r\n"
+#define NO_SUCH_USER "no such user; users can only be created on the primary, so enter an existing name"
+#define FRAME_BUF_SIZE (FRAME_HEADER_LEN + FRAME_MAX_REQUEST)  // Input buffer of binary clients
+#define MAX_IOV 64  // Most queued buffers written with one system call
+#define TRACE_FILE_FORMAT "friend_server.%d.trace.json"  // Filled in with the pid
+
+#ifdef TRACE
+static volatile sig_atomic_t trace_requested = 0;  // Set by SIGUSR1
+#endif
 
 #ifndef PORT
   #define PORT 57509
 #endif
 
+// Every line a connection sends takes a token from its bucket
+#ifndef CONN_RATE
+  #define CONN_RATE 20.0           // Lines per second
+#endif
+#ifndef CONN_BURST
+  #define CONN_BURST 40.0
+#endif
+
+// post, make_friends and unfriend also take a token from their user's bucket,
+// shared by all of that user's connections
+#ifndef USER_RATE
+  #define USER_RATE 5.0            // Mutations per second
+#endif
+#ifndef USER_BURST
+  #define USER_BURST 20.0
+#endif
+
+// Admission control: stop reading from every socket once this much output
+// is queued or this many commands are waiting, until both drop below half.
+#ifndef OUTPUT_HIGH_WATER
+  #define OUTPUT_HIGH_WATER (64 * 1024 * 1024)
+#endif
+#ifndef BACKLOG_HIGH_WATER
+  #define BACKLOG_HIGH_WATER 10000
+#endif
+// Stop reading from a single client once this much of its output is queued
+#ifndef CLIENT_OUTPUT_LIMIT
+  #define CLIENT_OUTPUT_LIMIT (1024 * 1024)
+#endif
+
+// Clients are disconnected once they take longer than these many seconds
+// to do something; 0 turns a timeout off
+#ifndef LOGIN_TIMEOUT
+  #define LOGIN_TIMEOUT 60         // To send their name (or followers, REPL_SUBSCRIBE) after connecting
+#endif
+#ifndef IDLE_TIMEOUT
+  #define IDLE_TIMEOUT 1800        // To send anything at all
+#endif
+#ifndef WRITE_STALL_TIMEOUT
+  #define WRITE_STALL_TIMEOUT 60   // To accept any of the output queued for them
+#endif
+
+#define RETENTION_INTERVAL_US 500000  // How often to move old posts to the archive
+
+#define REPL_WINDOW (256 * 1024)      // Most of the log queued to a follower at once
+#define REPL_CHUNK (64 * 1024)        // Most of the log read for a follower at once
+#define REPL_HEARTBEAT_US 1000000     // How often followers that are up to date hear so
+#define REPL_RETRY_US 1000000         // How often a follower tries to reach its primary
+#define PRIMARY_BUF_SIZE (FRAME_HEADER_LEN + REPL_MAX_RECORD)
+
+#define PRESENCE_BATCH_US 250000      // Presence changes are collected this long before friends hear
+#ifndef MEMSTATS_INTERVAL
+  #define MEMSTATS_INTERVAL 60        // Seconds between memory use log lines, unless -m says otherwise
+#endif
+#define CHANNEL_BATCH 1024            // Most channel subscribers a pass queues publishes to
+
+// Smaller profiles and user lists are rendered on the event loop; see worker.h
+#ifndef WORKER_MIN_POSTS
+  #define WORKER_MIN_POSTS 64
+#endif
+#ifndef WORKER_MIN_USERS
+  #define WORKER_MIN_USERS 1024
+#endif
+
+static TimerWheel timers;           // Each client's timeout timer, and retention_timer
+static Timer retention_timer;
+static size_t total_out_bytes = 0;  // Bytes queued across every client
+static long command_backlog = 0;    // Complete lines held back by rate limiting
+static TokenBucket *user_buckets = NULL;  // Indexed by user ID
+static UserId num_user_buckets = 0;
+
+// Replication (see repl.h). A server is a primary if it logs changes for
+// followers, or a read-only follower if it has a primary_path.
+static Timer heartbeat_timer;
+static int heartbeat_due = 0;         // Set when up to date followers should be told so
+static const char *primary_path = NULL;
+static int primary_fd = -1;           // Our connection to the primary, if any
+static Timer reconnect_timer;
+static char primary_buf[PRIMARY_BUF_SIZE];  // What the primary has sent that isn't applied yet
+static size_t primary_inbuf = 0;
+static uint64_t primary_log_id = 0;   // 0 until we first subscribe
+static uint64_t applied_end = 0;      // How much of the primary's log we've applied
+static uint64_t primary_log_end = 0;  // How long it is, as far as we know
+static uint64_t lag_us = 0;           // How old the last record or heartbeat was when it arrived
+static uint64_t primary_seen_us = 0;  // When it arrived
+
+static uint32_t next_session_id = 1;
+
+static Timer presence_timer;
+static int presence_due = 0;          // Set when friends should hear of presence changes
+
+static Timer memstats_timer;
+static uint64_t memstats_interval_us = MEMSTATS_INTERVAL * 1000000ULL;  // 0 if never logged
+
+static struct client **user_sessions = NULL;  // Indexed by user ID: first connection logged in as them
+static UserId num_user_sessions = 0;
+
+/*
+ * A message published to a channel, being queued to its subscribers at
+ * most CHANNEL_BATCH at a time. Every subscriber's connections share the
+ * same two buffers.
+ */
+typedef struct delivery {
+    Buffer *text;
+    Buffer *frame;
+    UserId *recipients;      // The channel's subscribers when it was published
+    size_t num_recipients;
+    size_t done;             // How many have had it queued
+    struct delivery *next;
+} Delivery;
+
+static Delivery *deliveries_head = NULL;  // Oldest first
+static Delivery *deliveries_tail = NULL;
+
+
+/* A reference to a (possibly shared) buffer waiting to be written to a client. */
+typedef struct out_chunk {
+    Buffer *buf;
+    size_t offset;          // How many bytes of buf have already been written?
+    struct out_chunk *next;
+} OutChunk;
 
 typedef struct client {
     int sock_fd;
-    char *username;
-    User *user;
+    uint32_t session_id; // Identifies this connection in captures
+    UserId user_id;      // NO_USER until the client has sent their name
     struct client *next;
     
-    char buf[BUF_SIZE + 1];
+    char *buf;           // BUF_SIZE + 1 bytes, or room for a whole frame once binary
     int inbuf;           // How many bytes currently in buffer?
     int room;           // How many bytes remaining in buffer?
     char *after;       // Pointer to position after the data in buf
+
+    int binary;          // Set once the client picks the binary protocol (see frame.h)
+    uint32_t tag;        // Tag of the request frame being run
+    FrameBuilder replies;  // Reply frames being built
+    int in_batch;        // While set, replies are collected into one batch reply
+
+    OutChunk *out_head;  // Output queue, written as the socket becomes writable
+    OutChunk *out_tail;
+    size_t out_bytes;    // How many bytes are waiting in the output queue?
+    int dead;            // Set once a write fails; the client is removed by main
+
+    TokenBucket bucket;       // Limits how fast this connection's lines are run
+    uint64_t throttled_until; // While non-zero, don't read or run lines until this time
+    int deferred_lines;       // Complete lines held in buf while throttled
+    int prompt_due;           // Set once a line has run, until the client is prompted
+
+    Timer timer;              // Fires no later than the client's next timeout
+    uint64_t connected_us;
+    uint64_t last_read_us;
+    uint64_t stalled_since_us;  // Since output was queued or last written, if any is queued
+
+    struct client *next_session;  // The next connection logged in as the same user
+    struct render *render;        // Reply a worker is rendering for this client, or NULL
+    int awaiting_render;          // Set until that reply is sent; no more lines are read or run meanwhile
+    int resume_due;               // Set once it's sent, to run the lines that came in behind it
+
+    int follower;             // Set if this is a follower's replication connection
+    int subscribed;           // Set once the follower has said where to start
+    uint64_t log_offset;      // How much of the log has been queued to the follower
 } Client;
 
 
+/* Return the name of the user client is logged in as. */
+const char *client_name(const Client *client) {
+    return user_name(client->user_id);
+}
+
+/* Return the time timeout_s seconds after start_us, or 0 if the timeout is turned off. */
+static uint64_t deadline_after(uint64_t start_us, int timeout_s) {
+    return timeout_s == 0 ? 0 : start_us + timeout_s * (uint64_t) 1000000;
+}
+
+/* Return when client is next due to time out, or 0 if it can't. */
+uint64_t client_deadline(const Client *client) {
+    uint64_t deadlines[3] = {0, 0, 0};
+    if (client->follower ? !client->subscribed : client->user_id == NO_USER) {
+        deadlines[0] = deadline_after(client->connected_us, LOGIN_TIMEOUT);
+    }
+    if (!client->follower) {  // Followers never send anything after subscribing
+        deadlines[1] = deadline_after(client->last_read_us, IDLE_TIMEOUT);
+    }
+    if (client->out_head != NULL) {
+        deadlines[2] = deadline_after(client->stalled_since_us, WRITE_STALL_TIMEOUT);
+    }
+
+    uint64_t earliest = 0;
+    for (int i = 0; i < 3; i++) {
+        if (deadlines[i] != 0 && (earliest == 0 || deadlines[i] < earliest)) {
+            earliest = deadlines[i];
+        }
+    }
+    return earliest;
+}
+
+/*
+ * Make sure client's timer fires no later than its next timeout. Deadlines
+ * that move later (like the idle deadline, on every read) don't touch the
+ * wheel; the timer just fires early and is pushed back then.
+ */
+void update_timer(Client *client) {
+    uint64_t deadline = client_deadline(client);
+    if (deadline != 0 && (!timer_pending(&client->timer) ||
+                          deadline < timer_expires_us(&timers, &client->timer))) {
+        wheel_schedule(&timers, &client->timer, deadline);
+    }
+}
+
+/*
+ * Write as much of client's output queue as the socket accepts without
+ * blocking, gathering queued buffers into as few system calls as possible.
+ * Marks the client dead if the connection has gone away.
+ */
+void flush_client(Client *client) {
+    while (client->out_head != NULL) {
+        struct iovec iov[MAX_IOV];
+        int num_iov = 0;
+        for (OutChunk *chunk = client->out_head; chunk != NULL && num_iov < MAX_IOV; chunk = chunk->next) {
+            iov[num_iov].iov_base = chunk->buf->data + chunk->offset;
+            iov[num_iov].iov_len = chunk->buf->len - chunk->offset;
+            num_iov++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = num_iov;
+        ssize_t num_written = sendmsg(client->sock_fd, &msg, MSG_NOSIGNAL);
+        if (num_written < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                client->dead = 1;
+            }
+            return;
+        }
+
+        // Drop every chunk that was written completely
+        if (num_written > 0) {
+            client->stalled_since_us = capture_now_us();
+        }
+        client->out_bytes -= num_written;
+        total_out_bytes -= num_written;
+        while (num_written > 0) {
+            OutChunk *chunk = client->out_head;
+            size_t remaining = chunk->buf->len - chunk->offset;
+            if ((size_t) num_written < remaining) {
+                chunk->offset += num_written;
+                return; // socket buffer is full, wait until it is writable again
+            }
+            num_written -= remaining;
+            client->out_head = chunk->next;
+            if (client->out_head == NULL) {
+                client->out_tail = NULL;
+            }
+            buffer_unref(chunk->buf);
+            mem_free(MEM_SESSIONS, chunk);
+        }
+    }
+}
+
+/*
+ * Queue buf to be written to client. The client takes its own reference, so
+ * the same buffer can be queued to any number of clients without copying.
+ * Queues are flushed once per pass of the event loop, so everything sent to
+ * a client in one pass goes out together.
+ */
+void send_buffer(Client *client, Buffer *buf) {
+    if (client->dead || buf->len == 0) {
+        return;
+    }
+
+    OutChunk *chunk = mem_alloc(MEM_SESSIONS, sizeof(OutChunk));
+    chunk->buf = buffer_ref(buf);
+    chunk->offset = 0;
+    chunk->next = NULL;
+    client->out_bytes += buf->len;
+    total_out_bytes += buf->len;
+    if (client->out_tail == NULL) {
+        // The write stall timeout starts now
+        client->out_head = chunk;
+        client->out_tail = chunk;
+        client->stalled_since_us = capture_now_us();
+        update_timer(client);
+    } else {
+        client->out_tail->next = chunk;
+        client->out_tail = chunk;
+    }
+}
+
+/* Queue a copy of the null-terminated string msg to be written to client. */
+void send_text(Client *client, const char *msg) {
+    Buffer *buf = buffer_new(msg, strlen(msg));
+    send_buffer(client, buf);
+    buffer_unref(buf);
+}
+
+/* Start a reply frame to client's current request. Finish it with end_reply. */
+size_t begin_reply(Client *client, uint8_t opcode) {
+    return frame_begin(&client->replies, opcode, client->tag);
+}
+
+/* Finish the reply begun at start, and send it unless it's part of a batch reply. */
+void end_reply(Client *client, size_t start) {
+    frame_end(&client->replies, start);
+    if (!client->in_batch) {
+        Buffer *buf = frame_take(&client->replies);
+        send_buffer(client, buf);
+        buffer_unref(buf);
+    }
+}
+
 /* 
  * Write a formatted error message to client.
  */
 void error(char *msg, Client *client) {
-    int msg_size = strlen("Error: ") + strlen(msg) + strlen("\n\r\n");
+    if (client->binary) {
+        size_t start = begin_reply(client, FRAME_ERROR);
+        frame_put_str(&client->replies, msg);
+        end_reply(client, start);
+        return;
+    }
+
+    int msg_size = strlen("Error: ") + strlen(msg) + strlen("\n\r\n") + 1;
     char error_msg[msg_size];
     snprintf(error_msg, msg_size, "Error: %s\n\r\n", msg);
-    write(client->sock_fd, error_msg, msg_size);
+    send_text(client, error_msg);
 }
 
 /*
@@ -60,29 +397,113 @@ int find_network_newline(const char *buf, int n) {
     return -1;
 }
 
+/*
+ * Called when a client's timer fires. Marks the client dead (to be removed
+ * by main) if one of its timeouts has passed, telling it why if it's still
+ * reading; otherwise reschedules the timer for the next deadline.
+ */
+void expire_client(Timer *timer) {
+    Client *client = (Client *) ((char *) timer - offsetof(Client, timer));
+    uint64_t now_us = capture_now_us();
+    uint64_t deadline = client_deadline(client);
+    if (client->dead) {
+        return;
+    } else if (deadline == 0 || now_us < deadline) {
+        update_timer(client);
+        return;
+    }
+
+    if (client->out_head != NULL && now_us >= deadline_after(client->stalled_since_us, WRITE_STALL_TIMEOUT)) {
+        // Not reading what we send, so there's no point saying anything
+    } else if (client->follower) {
+        // Followers only understand the replication protocol
+    } else if (client->user_id == NO_USER) {
+        error("timed out waiting for your name", client);
+    } else {
+        error("disconnected for being idle", client);
+    }
+    flush_client(client);
+    client->dead = 1;
+}
+
 /* Initialises a mostly empty client. The only argument is client_fd. Use -1, if we want a 'null' client */
 Client *init_client(int client_fd) {
-    Client *new_client = Malloc(sizeof(Client));
+    Client *new_client = mem_alloc(MEM_SESSIONS, sizeof(Client));
     new_client->sock_fd = client_fd;
-    new_client->username = NULL;
+    new_client->user_id = NO_USER;
     new_client->next = NULL;
-    new_client->user = NULL;
 
+    new_client->buf = mem_alloc(MEM_SESSIONS, BUF_SIZE + 1);
     memset(new_client->buf, '\0', BUF_SIZE + 1);
     new_client->inbuf = 0;
     new_client->room = BUF_SIZE;
     new_client->after = new_client->buf;
+
+    new_client->out_head = NULL;
+    new_client->out_tail = NULL;
+    new_client->out_bytes = 0;
+    new_client->dead = 0;
+
+    new_client->binary = 0;
+    new_client->tag = 0;
+    frame_init(&new_client->replies);
+    new_client->in_batch = 0;
+
+    bucket_init(&new_client->bucket, CONN_RATE, CONN_BURST, capture_now_us());
+    new_client->throttled_until = 0;
+    new_client->deferred_lines = 0;
+    new_client->prompt_due = 0;
+
+    timer_init(&new_client->timer, expire_client);
+    new_client->connected_us = capture_now_us();
+    new_client->last_read_us = new_client->connected_us;
+    new_client->stalled_since_us = 0;
+
+    new_client->next_session = NULL;
+    new_client->render = NULL;
+    new_client->awaiting_render = 0;
+    new_client->resume_due = 0;
+    new_client->follower = 0;
+    new_client->subscribed = 0;
+    new_client->log_offset = 0;
     return new_client;
 }
 
-/* Returns pointer to client with the given username. If more than one such client available returns the first instance. Returns NULL if first_client is NULL or if username not found. */
-Client *find_client(char *username, Client *first_client) {
+/* Log client in as the user with this ID. */
+void log_in_as(Client *client, UserId id) {
+    client->user_id = id;
+    if (id >= num_user_sessions) {
+        UserId new_size = num_user_sessions == 0 ? 64 : num_user_sessions;
+        while (new_size <= id) {
+            new_size *= 2;
+        }
+        user_sessions = mem_realloc(MEM_SESSIONS, user_sessions, sizeof(Client *) * new_size);
+        memset(user_sessions + num_user_sessions, 0, sizeof(Client *) * (new_size - num_user_sessions));
+        num_user_sessions = new_size;
+    }
+    client->next_session = user_sessions[id];
+    user_sessions[id] = client;
+    presence_login(id);
+}
+
+/* Take client, which is going away, out of its user's connections. */
+void log_out(Client *client) {
+    Client **link = &user_sessions[client->user_id];
+    while (*link != client) {
+        link = &(*link)->next_session;
+    }
+    *link = client->next_session;
+    presence_logout(client->user_id);
+}
+
+/* Returns pointer to client logged in as user_id. If more than one such client available returns the first instance. Returns NULL if first_client is NULL or if no such client is found. */
+Client *find_client(UserId user_id, Client *first_client) {
     if (first_client == NULL) {
         return NULL;
     }
 
     while (first_client != NULL){
-        if (strcmp(username, first_client->username) == 0) {
+        if (first_client->user_id == user_id) {
             return first_client;
         }
         first_client = first_client->next;
@@ -104,8 +525,17 @@ int accept_connection(int fd, Client **client_list) {
         exit(1);
     }
 
+    // writes go through the output queue, so the socket must never block
+    if (fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("server: fcntl");
+        exit(1);
+    }
+
     // initialise new client on the heap
     Client *new_client = init_client(client_fd);
+    new_client->session_id = next_session_id++;
+    capture_connect(new_client->session_id);
+    update_timer(new_client);
 
     // place new client at end of linked list
     if (*client_list == NULL) {
@@ -147,11 +577,11 @@ char **create_args_array(char *user_input, int num_inputs) {
     strncpy(input_cpy, user_input, strlen(user_input));
     input_cpy[strlen(user_input)] = '\0';
 
-    char **argv = Malloc(sizeof(char *) * num_inputs);
+    char **argv = mem_alloc(MEM_PARSE, sizeof(char *) * num_inputs);
     char *token = strtok(input_cpy, DELIMITER);
     int i = 0;
     while (token != NULL){
-        char *heap_token = Malloc(sizeof(char) * (strlen(token) + 1));
+        char *heap_token = mem_alloc(MEM_PARSE, sizeof(char) * (strlen(token) + 1));
         argv[i] = heap_token;
         strncpy(heap_token, token, strlen(token));
         heap_token[strlen(token)] = '\0';    
@@ -161,19 +591,173 @@ char **create_args_array(char *user_input, int num_inputs) {
     return argv;
 }
 
-/* Send message to every instance of client in client list with username. */
-void notify_client(char *username, char *message, Client *first_client) {
-    if (first_client == NULL) {
+/*
+ * Send a notification to every instance of client in client list logged in
+ * as user_id: text to text clients, and frame to binary clients.
+ */
+void notify_client(UserId user_id, Buffer *text, Buffer *frame, Client *first_client) {
+    if (user_id >= num_user_sessions) {
         return;
     }
-    while (first_client != NULL) {
-        if ((first_client->sock_fd != -1) && strcmp(first_client->username, username) == 0) {
-            write(first_client->sock_fd, message, strlen(message));
+    for (Client *curr = user_sessions[user_id]; curr != NULL; curr = curr->next_session) {
+        if (curr->sock_fd != -1) {
+            send_buffer(curr, curr->binary ? frame : text);
         }
-        first_client = first_client->next;
     }
 }
 
+/* Build a notification frame holding the string fields first and (unless NULL) second. */
+Buffer *notification_frame(uint8_t opcode, const char *first, const char *second) {
+    FrameBuilder builder;
+    frame_init(&builder);
+    size_t start = frame_begin(&builder, opcode, 0);
+    frame_put_str(&builder, first);
+    if (second != NULL) {
+        frame_put_str(&builder, second);
+    }
+    frame_end(&builder, start);
+    return frame_take(&builder);
+}
+
+/* Reply to client with the names of every user in the list starting at head. */
+void send_users(Client *client, const User *head) {
+    uint32_t num_users = 0;
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        num_users++;
+    }
+
+    size_t start = begin_reply(client, FRAME_USERS);
+    frame_put_u32(&client->replies, num_users);
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        frame_put_str(&client->replies, curr->name);
+    }
+    end_reply(client, start);
+}
+
+/* Reply to client with user's profile. */
+void send_profile(Client *client, const User *user) {
+    size_t start = begin_reply(client, FRAME_USER_PROFILE);
+    frame_put_str(&client->replies, user->name);
+
+    int num_friends = 0;
+    while (num_friends < MAX_FRIENDS && user->friends[num_friends] != NO_USER) {
+        num_friends++;
+    }
+    frame_put_u16(&client->replies, num_friends);
+    for (int i = 0; i < num_friends; i++) {
+        frame_put_str(&client->replies, user_name(user->friends[i]));
+    }
+
+    uint32_t num_posts = 0;
+    for (const Post *post = user->first_post; post != NULL; post = post->next) {
+        num_posts++;
+    }
+    frame_put_u32(&client->replies, num_posts);
+    for (const Post *post = user->first_post; post != NULL; post = post->next) {
+        frame_put_str(&client->replies, user_name(post->author));
+        frame_put_u64(&client->replies, post->date);
+        frame_put_str(&client->replies, post_text(post));
+    }
+    end_reply(client, start);
+}
+
+/*
+ * A profile or the user list that's being rendered by a worker, from a view
+ * taken when it was asked for, for a text client.
+ */
+typedef struct render {
+    Client *client;         // Who asked, or NULL once they've gone
+    UserId key;             // The user's ID, or NO_USER for the user list
+    unsigned long version;  // The user's version, or users_version, when the view was taken
+    UserView profile;       // What to render, unless key is NO_USER
+    UserListView list;      // What to render if it is
+    char *rendered;
+} Render;
+
+/* Render a Render's view, on a worker. */
+void run_render(void *arg) {
+    Render *render = arg;
+    if (render->key == NO_USER) {
+        render->rendered = print_user_list_view(&render->list);
+    } else {
+        render->rendered = print_user_view(&render->profile);
+    }
+}
+
+/*
+ * Back on the event loop: cache the rendering if nothing has changed since
+ * its view was taken, and send it. The client's lines that came in behind
+ * the command are run, and it is prompted, in the same pass.
+ */
+void finish_render(void *arg) {
+    Render *render = arg;
+    Buffer *buf = buffer_adopt(render->rendered, strlen(render->rendered));
+    User *user = user_by_id(render->key);
+    if (render->key == NO_USER) {
+        free_user_list_view(&render->list);
+        if (render->version == users_version) {
+            cache_store(NO_USER, render->version, buf);
+        }
+    } else {
+        free_user_view(&render->profile);
+        if (user != NULL && render->version == user->version) {
+            cache_store(render->key, render->version, buf);
+        }
+    }
+
+    Client *client = render->client;
+    if (client != NULL) {
+        client->render = NULL;
+        client->awaiting_render = 0;
+        client->resume_due = 1;
+        send_buffer(client, buf);
+    }
+    buffer_unref(buf);
+    mem_free(MEM_RESPONSES, render);
+}
+
+/*
+ * Send client user's profile, or the user list if user is NULL, from the
+ * cache, or have a worker render it if it's big enough to be worth it.
+ * Return 1 if either was done, and 0 if the caller should render it.
+ */
+int render_later(Client *client, const User *user, const User *user_list) {
+    if (user == NULL ? user_count() < WORKER_MIN_USERS : user->num_posts < WORKER_MIN_POSTS) {
+        return 0;
+    }
+
+    UserId key = user == NULL ? NO_USER : user->id;
+    unsigned long version = user == NULL ? users_version : user->version;
+    Buffer *buf = cache_lookup(key, version);
+    if (buf != NULL) {
+        send_buffer(client, buf);
+        buffer_unref(buf);
+        return 1;
+    }
+
+    Render *render = mem_alloc(MEM_RESPONSES, sizeof(Render));
+    render->client = client;
+    render->key = key;
+    render->version = version;
+    if (user == NULL) {
+        view_users(user_list, &render->list);
+    } else {
+        view_user(user, &render->profile);
+    }
+    if (worker_submit(run_render, finish_render, render) == -1) {
+        if (user == NULL) {
+            free_user_list_view(&render->list);
+        } else {
+            free_user_view(&render->profile);
+        }
+        mem_free(MEM_RESPONSES, render);
+        return 0;
+    }
+    client->render = render;
+    client->awaiting_render = 1;
+    return 1;
+}
+
 /* Removes client from list of clients pointed to by client_list. Does nothing if either argument is NULL.*/
 void remove_client(Client* client, Client **client_list) {
     if (client_list == NULL || client == NULL) {
@@ -194,172 +778,1602 @@ void remove_client(Client* client, Client **client_list) {
             prev_client->next = curr_client->next;
         }
     }
+    if (client->user_id != NO_USER) {
+        log_out(client);
+    }
+    if (client->render != NULL) {
+        client->render->client = NULL;  // It's dropped once the worker is done
+    }
+    capture_disconnect(client->session_id);
+    wheel_cancel(&timers, &client->timer);
     close(client->sock_fd);
-    free(client->username);
-    free(client);
+    total_out_bytes -= client->out_bytes;
+    command_backlog -= client->deferred_lines;
+    mem_free(MEM_SESSIONS, client->buf);
+    frame_free(&client->replies);
+    while (client->out_head != NULL) {
+        OutChunk *chunk = client->out_head;
+        client->out_head = chunk->next;
+        buffer_unref(chunk->buf);
+        mem_free(MEM_SESSIONS, chunk);
+    }
+    mem_free(MEM_SESSIONS, client);
     return;
 }
 
 
 
-/* Processes the arguments from the user and calls the appropriate functions from friends.c. Returns -1 if client quit. */
-int process_args(int cmd_argc, char **cmd_argv, Client *first_client, Client *client, User **users) {
-    User *user_list = *users;
-    char *buf;
-    if (cmd_argc <= 0) {
-        return 0;
-    } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
-        return -1;
-    } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 1) {
-        buf = list_users(user_list);
-        write(client->sock_fd, buf, strlen(buf));
-        free(buf);
+#ifdef TRACE
+/*
+ * Write the trace to TRACE_FILE_FORMAT. If client is not NULL, tell them
+ * how it went; otherwise report on stderr.
+ */
+void dump_trace(Client *client) {
+    char path[64];
+    snprintf(path, sizeof(path), TRACE_FILE_FORMAT, (int) getpid());
+    long num_events = trace_dump(path);
 
-    } else if (strcmp(cmd_argv[0], "make_friends") == 0 && cmd_argc == 2) {
-        int notif_size = strlen("You have been friended by \n\r\n") + strlen(client->username); // +1 for \n and +2 for \r\n
-        char friend_message[notif_size + 1]; // +1 because snprintf always null terminates strings
+    char msg[128];
+    if (num_events == -1) {
+        snprintf(msg, sizeof(msg), "could not write trace to %s", path);
+    } else {
+        snprintf(msg, sizeof(msg), "Wrote %ld trace events to %s", num_events, path);
+    }
+    if (client == NULL) {
+        fprintf(stderr, "server: %s\n", msg);
+    } else if (num_events == -1) {
+        error(msg, client);
+    } else if (client->binary) {
+        size_t start = begin_reply(client, FRAME_TRACE_DUMPED);
+        frame_put_u32(&client->replies, num_events);
+        frame_put_str(&client->replies, path);
+        end_reply(client, start);
+    } else {
+        strcat(msg, "\r\n");
+        send_text(client, msg);
+    }
+}
 
-        int client_message_size = strlen("You are now friends with \n\r\n") + strlen(cmd_argv[1]);
-        char client_message[client_message_size + 1];
-        switch (make_friends(cmd_argv[1], client->username, user_list)) {
-            case 0:
-                snprintf(friend_message, notif_size, "You have been friended by %s\n\r\n", client->username);
-                notify_client(cmd_argv[1], friend_message, first_client);
-                snprintf(client_message, client_message_size, "You are now friends with %s\n\r\n", cmd_argv[1]);
-                write(client->sock_fd, client_message, client_message_size);
-                break;
-            case 1:
-                error("users are already friends", client);
-                break;
-            case 2:
-                error("at least one user you entered has the max number of friends", client);
-                break;
-            case 3:
-                error("you must enter two different users", client);
-                break;
-            case 4:
-                error("User you entered does not exist", client);
-                break;
-        }
-    } else if (strcmp(cmd_argv[0], "post") == 0 && cmd_argc >= 3) {
-        // first determine how long a string we need
-        int space_needed = 0;
-        for (int i = 2; i < cmd_argc; i++) {
-            space_needed += strlen(cmd_argv[i]) + 1;
-        }
+static void request_trace(int signal) {
+    trace_requested = 1;
+}
+#endif
 
-        // allocate the space
-        char *contents = malloc(space_needed);
-        if (contents == NULL) {
-            perror("malloc");
-            exit(1);
-        }
+/*
+ * Move a batch of old posts to the archive, then wait for the next batch:
+ * right away if there was more to do than fit in this one.
+ */
+void run_retention(Timer *timer) {
+    TRACE_BEGIN("retention");
+    int archived = retention_step(time(NULL));
+    TRACE_END("retention");
+    uint64_t next_us = capture_now_us();
+    if (archived < RETENTION_POSTS_PER_STEP) {
+        next_us += RETENTION_INTERVAL_US;
+    }
+    wheel_schedule(&timers, timer, next_us);
+}
 
-        // copy in the bits to make a single string
-        strcpy(contents, cmd_argv[2]);
-        for (int i = 3; i < cmd_argc; i++) {
-            strcat(contents, " ");
-            strcat(contents, cmd_argv[i]);
-        }
+/* Free the list of posts starting at first. */
+void free_posts(Post *first) {
+    while (first != NULL) {
+        Post *next = first->next;
+        mem_free(MEM_POSTS, first->contents);
+        mem_free(MEM_POSTS, first);
+        first = next;
+    }
+}
 
-        User *author = client->user;
-        User *target = find_user(cmd_argv[1], user_list);
+/* Free a user retired by delete_user. */
+void destroy_user(void *ptr) {
+    free_user(ptr);
+}
 
-        int friend_message_size = strlen("From : \n\r\n") + strlen(client->username) + space_needed;
-        char friend_message[friend_message_size];
-        switch (make_post(author, target, contents)) {
-            case 0:
-                snprintf(friend_message, friend_message_size, "From %s: %s\r\n", client->username, contents);
-                notify_client(target->name, friend_message, first_client);
-                break;
-            case 1:
-                error("the users are not friends", client);
-                break;
-            case 2:
-                error("at least one user you entered does not exist", client);
-                break;
+/* Return user's post number n (counting from 1, newest first) in memory, or NULL if there isn't one. */
+Post *post_at(const User *user, unsigned long n) {
+    Post *post = user->first_post;
+    for (unsigned long i = 1; i < n && post != NULL; i++) {
+        post = post->next;
+    }
+    return n == 0 ? NULL : post;
+}
+
+/*
+ * Delete user, and disconnect every client logged in as them except
+ * client (which may be NULL), which the caller closes. The user is freed
+ * once nothing can still be reading it.
+ */
+void delete_user(User *user, Client *client, Client *first_client, User **users) {
+    for (Client *curr = first_client; curr != NULL; curr = curr->next) {
+        if (curr->user_id != user->id || curr->dead) {
+            continue;
         }
-    } else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
-        User *user = find_user(cmd_argv[1], user_list);
-        buf = print_user(user);
-        if (buf == NULL) {
-            error("user not found", client);
-        } else {
-            write(client->sock_fd, buf, strlen(buf));
-            free(buf);
+        if (!curr->binary) {
+            send_text(curr, "Your account has been deleted.\r\n");
+        } else if (curr == client) {
+            end_reply(client, begin_reply(client, FRAME_OK));
+        }
+        if (curr != client) {
+            flush_client(curr);
+            curr->dead = 1;
         }
-    } else {
-        error("Incorrect syntax", client);
     }
-    return 0;
+
+    repl_log_user(REPL_DELETE_USER, user);
+    remove_user(user, users);
+    cache_forget_user(user->id);
+    channel_forget_user(user->id);
+    epoch_retire(user, destroy_user);
 }
 
-/* Parses user command. Expects a full line with null termination. Returns -1 if client sent quit command and 0 otherwise. */
-int parse_input(char *user_input, Client *first_client, Client *client, User **users) {
-    // new client, they are sending in a username instead of commands 
-    if (client->username == NULL) {
-        // decided how long the name is, truncating if necessary
-        int username_len = strlen(user_input);
-        if (username_len > MAX_NAME - 1) {
+/*
+ * Read page number page (counting from 1, newest first) of user's archived
+ * posts into a new list, to be freed with free_posts. Return NULL if the
+ * page is empty.
+ */
+Post *read_history(const User *user, unsigned long page) {
+    if (page == 0 || page > (user->num_archived + HISTORY_PAGE_SIZE - 1) / HISTORY_PAGE_SIZE) {
+        return NULL;
+    }
+
+    // Start from the nearest indexed post at or after the page's newest, so
+    // fewer than a page of posts are skipped to get to it
+    unsigned long newest = user->num_archived - 1 - (page - 1) * HISTORY_PAGE_SIZE;
+    unsigned long indexed = (newest + HISTORY_PAGE_SIZE - 1) / HISTORY_PAGE_SIZE;
+    uint64_t offset = user->archive_head;
+    unsigned long skip = user->num_archived - 1 - newest;
+    if (indexed * HISTORY_PAGE_SIZE < user->num_archived) {
+        offset = user->history_index[indexed];
+        skip = indexed * HISTORY_PAGE_SIZE - newest;
+    }
+    for (unsigned long i = 0; i < skip && offset != 0; i++) {
+        if (archive_read(offset, NULL, &offset) == -1) {
+            return NULL;
+        }
+    }
+    Post *first = NULL;
+    Post *last = NULL;
+    for (int i = 0; i < HISTORY_PAGE_SIZE && offset != 0; i++) {
+        Post *post = mem_alloc(MEM_POSTS, sizeof(Post));
+        if (archive_read(offset, post, &offset) == -1) {
+            mem_free(MEM_POSTS, post);
+            break;
+        }
+        if (last == NULL) {
+            first = post;
+        } else {
+            last->next = post;
+            post->prev = last;
+        }
+        last = post;
+    }
+    return first;
+}
+
+/* Reply to client with the list of posts starting at first. */
+void send_posts(Client *client, const Post *first) {
+    uint32_t num_posts = 0;
+    for (const Post *post = first; post != NULL; post = post->next) {
+        num_posts++;
+    }
+
+    size_t start = begin_reply(client, FRAME_POSTS);
+    frame_put_u32(&client->replies, num_posts);
+    for (const Post *post = first; post != NULL; post = post->next) {
+        frame_put_str(&client->replies, user_name(post->author));
+        frame_put_u64(&client->replies, post->date);
+        frame_put_str(&client->replies, post->contents);
+    }
+    end_reply(client, start);
+}
+
+/* Return 1 if command changes users, so can't be run on a follower, 0 otherwise. */
+int is_write_command(const char *command) {
+    // Channels live on one server, so followers can't have any
+    const char *writes[] = {"make_friends", "post", "unfriend", "delete_post", "delete_user",
+                            "join", "leave", "publish"};
+    for (size_t i = 0; i < sizeof(writes) / sizeof(writes[0]); i++) {
+        if (strcmp(command, writes[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Tell client how replication is going: how much a primary has logged and
+ * how far behind its followers are, or how much a follower has applied and
+ * how far behind it is.
+ */
+void send_replication_status(Client *client, const Client *first_client) {
+    uint8_t role = 0;      // 0 if replication is off, 1 on a primary, 2 on a follower
+    uint64_t log_bytes = 0;
+    uint64_t behind = 0;   // In bytes of log; for a primary, its furthest behind follower
+    uint64_t lag = 0;
+    int num_followers = 0;
+    if (repl_log_is_open()) {
+        role = 1;
+        log_bytes = repl_log_end();
+        for (const Client *curr = first_client; curr != NULL; curr = curr->next) {
+            if (curr->subscribed) {
+                num_followers++;
+                if (log_bytes - curr->log_offset + curr->out_bytes > behind) {
+                    behind = log_bytes - curr->log_offset + curr->out_bytes;
+                }
+            }
+        }
+    } else if (primary_path != NULL) {
+        role = 2;
+        log_bytes = applied_end;
+        behind = primary_log_end - applied_end;
+        // While cut off from the primary, we fall further behind all the time
+        lag = primary_fd == -1 ? lag_us + (capture_now_us() - primary_seen_us) : lag_us;
+    }
+
+    if (client->binary) {
+        size_t start = begin_reply(client, FRAME_REPLICATION_STATUS);
+        frame_put_u8(&client->replies, role);
+        frame_put_u64(&client->replies, log_bytes);
+        frame_put_u64(&client->replies, behind);
+        frame_put_u64(&client->replies, lag);
+        end_reply(client, start);
+        return;
+    }
+
+    char msg[256];
+    if (role == 0) {
+        snprintf(msg, sizeof(msg), "Replication is off.\r\n");
+    } else if (role == 1) {
+        snprintf(msg, sizeof(msg), "Primary: %llu bytes logged, %d followers, furthest behind by %llu bytes\r\n",
+                 (unsigned long long) log_bytes, num_followers, (unsigned long long) behind);
+    } else {
+        snprintf(msg, sizeof(msg), "Follower of %s (%s): %llu bytes applied, at least %llu behind, lag %llu ms\r\n",
+                 primary_path, primary_fd == -1 ? "disconnected" : "connected", (unsigned long long) log_bytes,
+                 (unsigned long long) behind, (unsigned long long) (lag / 1000));
+    }
+    send_text(client, msg);
+}
+
+/* Tell client how much memory each part of the server has in use (see memstats.h). */
+void send_memstats(Client *client) {
+    MemUsage usage[NUM_MEM_TAGS];
+    mem_usage(usage);
+    uint64_t heap_bytes = mem_heap_bytes();
+
+    if (client->binary) {
+        size_t start = begin_reply(client, FRAME_MEMORY);
+        frame_put_u8(&client->replies, NUM_MEM_TAGS);
+        for (int i = 0; i < NUM_MEM_TAGS; i++) {
+            frame_put_str(&client->replies, mem_tag_name(i));
+            frame_put_u64(&client->replies, usage[i].bytes);
+            frame_put_u64(&client->replies, usage[i].objects);
+        }
+        frame_put_u64(&client->replies, heap_bytes);
+        end_reply(client, start);
+        return;
+    }
+
+    char msg[1024];
+    int len = snprintf(msg, sizeof(msg), "Memory in use:\r\n");
+    for (int i = 0; i < NUM_MEM_TAGS; i++) {
+        len += snprintf(msg + len, sizeof(msg) - len, "\t%s: %lld bytes in %lld objects\r\n", mem_tag_name(i),
+                        (long long) usage[i].bytes, (long long) usage[i].objects);
+    }
+    snprintf(msg + len, sizeof(msg) - len, "\theap: %llu bytes in all\r\n", (unsigned long long) heap_bytes);
+    send_text(client, msg);
+}
+
+/* Log how much memory each part of the server has in use, and do it again in memstats_interval_us. */
+void log_memstats(Timer *timer) {
+    MemUsage usage[NUM_MEM_TAGS];
+    mem_usage(usage);
+    char line[512];
+    int len = snprintf(line, sizeof(line), "server: memory:");
+    for (int i = 0; i < NUM_MEM_TAGS; i++) {
+        len += snprintf(line + len, sizeof(line) - len, " %s %lld/%lld", mem_tag_name(i),
+                        (long long) usage[i].bytes, (long long) usage[i].objects);
+    }
+    fprintf(stderr, "%s heap %llu\n", line, (unsigned long long) mem_heap_bytes());
+    wheel_schedule(&timers, timer, capture_now_us() + memstats_interval_us);
+}
+
+/* Send client the names of their friends who are online. */
+void send_online_friends(Client *client) {
+    const User *user = user_by_id(client->user_id);
+    UserId online[MAX_FRIENDS];
+    int num_online = presence_online_friends(user, online);
+    if (client->binary) {
+        size_t start = begin_reply(client, FRAME_USERS);
+        frame_put_u32(&client->replies, num_online);
+        for (int i = 0; i < num_online; i++) {
+            frame_put_str(&client->replies, user_name(online[i]));
+        }
+        end_reply(client, start);
+        return;
+    }
+
+    char msg[MAX_FRIENDS * (MAX_NAME + 3) + 32];
+    size_t len = snprintf(msg, sizeof(msg), "Online friends:\r\n");
+    for (int i = 0; i < num_online; i++) {
+        len += snprintf(msg + len, sizeof(msg) - len, "\t%s\r\n", user_name(online[i]));
+    }
+    send_text(client, msg);
+}
+
+/* Send client each of their friends, and whether they are online. */
+void send_friends_status(Client *client) {
+    const User *user = user_by_id(client->user_id);
+    int num_friends = 0;
+    while (num_friends < MAX_FRIENDS && user->friends[num_friends] != NO_USER) {
+        num_friends++;
+    }
+    if (client->binary) {
+        size_t start = begin_reply(client, FRAME_FRIEND_STATUSES);
+        frame_put_u32(&client->replies, num_friends);
+        for (int i = 0; i < num_friends; i++) {
+            frame_put_str(&client->replies, user_name(user->friends[i]));
+            frame_put_u8(&client->replies, presence_online(user->friends[i]));
+        }
+        end_reply(client, start);
+        return;
+    }
+
+    char msg[MAX_FRIENDS * (MAX_NAME + 12) + 32];
+    size_t len = snprintf(msg, sizeof(msg), "Friends:\r\n");
+    for (int i = 0; i < num_friends; i++) {
+        len += snprintf(msg + len, sizeof(msg) - len, "\t%s %s\r\n", user_name(user->friends[i]),
+                        presence_online(user->friends[i]) ? "online" : "offline");
+    }
+    send_text(client, msg);
+}
+
+
+/* A presence change to tell recipient about. */
+typedef struct presence_note {
+    UserId recipient;
+    UserId user;
+    int online;
+} PresenceNote;
+
+typedef struct presence_notes {
+    PresenceNote *notes;
+    size_t len;
+    size_t capacity;
+} PresenceNotes;
+
+/* presence_each_change callback: note the change for each of the user's friends who is online. */
+static void collect_presence(UserId id, int online, void *arg) {
+    PresenceNotes *all = arg;
+    const User *user = user_by_id(id);
+    if (user == NULL) {
+        return;  // Deleted, and so no longer anyone's friend
+    }
+    UserId recipients[MAX_FRIENDS];
+    int num_recipients = presence_online_friends(user, recipients);
+    for (int i = 0; i < num_recipients; i++) {
+        if (all->len == all->capacity) {
+            all->capacity = all->capacity == 0 ? 64 : all->capacity * 2;
+            all->notes = mem_realloc(MEM_RESPONSES, all->notes, sizeof(PresenceNote) * all->capacity);
+        }
+        all->notes[all->len++] = (PresenceNote) {recipients[i], id, online};
+    }
+}
+
+/* Order presence notes by recipient, then by user. */
+static int compare_notes(const void *a, const void *b) {
+    const PresenceNote *first = a;
+    const PresenceNote *second = b;
+    if (first->recipient != second->recipient) {
+        return first->recipient < second->recipient ? -1 : 1;
+    }
+    return first->user < second->user ? -1 : first->user > second->user;
+}
+
+/* Return the first of the sorted notes for recipient, or NULL if there are none. */
+static const PresenceNote *find_notes(const PresenceNotes *all, UserId recipient) {
+    size_t low = 0;
+    size_t high = all->len;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (all->notes[mid].recipient < recipient) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < all->len && all->notes[low].recipient == recipient ? &all->notes[low] : NULL;
+}
+
+/*
+ * Tell everyone whose friends have come online or gone offline since the
+ * last batch, with one notification per connection listing all of them.
+ */
+void push_presence(Client *first_client) {
+    PresenceNotes all = {NULL, 0, 0};
+    presence_each_change(collect_presence, &all);
+    if (all.len == 0) {
+        return;
+    }
+    qsort(all.notes, all.len, sizeof(PresenceNote), compare_notes);
+
+    // One pass over the clients. Each notification is built for the first
+    // of a user's connections and reused if the next one is the same user's.
+    UserId built_for = NO_USER;
+    Buffer *text = NULL;
+    Buffer *frame = NULL;
+    for (Client *curr = first_client; curr != NULL; curr = curr->next) {
+        const PresenceNote *first;
+        if (curr->dead || curr->user_id == NO_USER || (first = find_notes(&all, curr->user_id)) == NULL) {
+            continue;
+        }
+        if (built_for != curr->user_id) {
+            if (text != NULL) {
+                buffer_unref(text);
+                buffer_unref(frame);
+            }
+            const PresenceNote *end = first;
+            while (end < all.notes + all.len && end->recipient == curr->user_id) {
+                end++;
+            }
+
+            FrameBuilder builder;
+            frame_init(&builder);
+            size_t start = frame_begin(&builder, FRAME_NOTIFY_PRESENCE, 0);
+            frame_put_u32(&builder, end - first);
+            char msg[MAX_FRIENDS * (MAX_NAME + 20)];
+            size_t len = 0;
+            for (const PresenceNote *note = first; note < end; note++) {
+                frame_put_str(&builder, user_name(note->user));
+                frame_put_u8(&builder, note->online);
+                len += snprintf(msg + len, sizeof(msg) - len, "%s is now %s\r\n",
+                                user_name(note->user), note->online ? "online" : "offline");
+            }
+            frame_end(&builder, start);
+            frame = frame_take(&builder);
+            text = buffer_new(msg, len);
+            built_for = curr->user_id;
+        }
+        send_buffer(curr, curr->binary ? frame : text);
+    }
+    if (text != NULL) {
+        buffer_unref(text);
+        buffer_unref(frame);
+    }
+    mem_free(MEM_RESPONSES, all.notes);
+}
+
+/* Have the next pass tell friends about presence changes. */
+void presence_batch_due(Timer *timer) {
+    presence_due = 1;
+}
+
+/*
+ * Publish contents, from client, to the channel. It's serialized once and
+ * queued to the subscribers by deliver_publishes over the following passes.
+ */
+void publish(Client *client, const Channel *channel, const char *contents) {
+    const char *author = client_name(client);
+    int text_size = strlen(channel->name) + strlen(author) + strlen(contents) + strlen("[] : \r\n") + 1;
+    char text[text_size];
+    snprintf(text, text_size, "[%s] %s: %s\r\n", channel->name, author, contents);
+
+    FrameBuilder builder;
+    frame_init(&builder);
+    size_t start = frame_begin(&builder, FRAME_NOTIFY_CHANNEL, 0);
+    frame_put_str(&builder, channel->name);
+    frame_put_str(&builder, author);
+    frame_put_str(&builder, contents);
+    frame_end(&builder, start);
+
+    Delivery *delivery = mem_alloc(MEM_RESPONSES, sizeof(Delivery));
+    delivery->text = buffer_new(text, strlen(text));
+    delivery->frame = frame_take(&builder);
+    delivery->num_recipients = channel->num_subscribers;
+    delivery->recipients = mem_alloc(MEM_RESPONSES, sizeof(UserId) * channel->num_subscribers);
+    memcpy(delivery->recipients, channel->subscribers, sizeof(UserId) * channel->num_subscribers);
+    delivery->done = 0;
+    delivery->next = NULL;
+    if (deliveries_tail == NULL) {
+        deliveries_head = delivery;
+    } else {
+        deliveries_tail->next = delivery;
+    }
+    deliveries_tail = delivery;
+}
+
+/*
+ * Queue published messages to up to CHANNEL_BATCH of their subscribers, in
+ * the order they were published, so a big channel can't hold up the loop.
+ */
+void deliver_publishes(void) {
+    int budget = CHANNEL_BATCH;
+    while (deliveries_head != NULL && budget > 0) {
+        Delivery *delivery = deliveries_head;
+        while (delivery->done < delivery->num_recipients && budget > 0) {
+            UserId id = delivery->recipients[delivery->done++];
+            budget--;
+            if (id < num_user_sessions) {
+                for (Client *curr = user_sessions[id]; curr != NULL; curr = curr->next_session) {
+                    send_buffer(curr, curr->binary ? delivery->frame : delivery->text);
+                }
+            }
+        }
+        if (delivery->done < delivery->num_recipients) {
+            return;
+        }
+        deliveries_head = delivery->next;
+        if (deliveries_head == NULL) {
+            deliveries_tail = NULL;
+        }
+        buffer_unref(delivery->text);
+        buffer_unref(delivery->frame);
+        mem_free(MEM_RESPONSES, delivery->recipients);
+        mem_free(MEM_RESPONSES, delivery);
+    }
+}
+
+/* Processes the arguments from the user and calls the appropriate functions from friends.c. Returns -1 if client quit. */
+int process_args(int cmd_argc, char **cmd_argv, Client *first_client, Client *client, User **users) {
+    User *user_list = *users;
+    Buffer *buf;
+    if (cmd_argc <= 0) {
+        return 0;
+    } else if (primary_path != NULL && is_write_command(cmd_argv[0])) {
+        error("this server is a read-only follower; make changes on the primary", client);
+    } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
+        return -1;
+    } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 1) {
+        TRACE_BEGIN("cmd:list_users");
+        if (client->binary) {
+            send_users(client, user_list);
+        } else if (!render_later(client, NULL, user_list)) {
+            buf = cached_list_users(user_list);
+            send_buffer(client, buf);
+            buffer_unref(buf);
+        }
+        TRACE_END("cmd:list_users");
+
+    } else if (strcmp(cmd_argv[0], "make_friends") == 0 && cmd_argc == 2) {
+        TRACE_BEGIN("cmd:make_friends");
+        int notif_size = strlen("You have been friended by \n\r\n") + strlen(client_name(client)) + 1; // +1 because snprintf always null terminates strings
+        char friend_message[notif_size];
+
+        int client_message_size = strlen("You are now friends with \n\r\n") + strlen(cmd_argv[1]) + 1;
+        char client_message[client_message_size];
+        User *new_friend = find_user(cmd_argv[1], user_list);
+        TRACE_BEGIN("friends:make_friends");
+        int result = make_friends_users(new_friend, user_by_id(client->user_id));
+        TRACE_END("friends:make_friends");
+        switch (result) {
+            case 0:
+                repl_log_pair(REPL_MAKE_FRIENDS, new_friend, user_by_id(client->user_id));
+                snprintf(friend_message, notif_size, "You have been friended by %s\n\r\n", client_name(client));
+                buf = buffer_new(friend_message, strlen(friend_message));
+                Buffer *frame = notification_frame(FRAME_NOTIFY_FRIENDED, client_name(client), NULL);
+                notify_client(new_friend->id, buf, frame, first_client);
+                buffer_unref(buf);
+                buffer_unref(frame);
+                if (client->binary) {
+                    size_t start = begin_reply(client, FRAME_FRIENDED);
+                    frame_put_str(&client->replies, new_friend->name);
+                    end_reply(client, start);
+                } else {
+                    snprintf(client_message, client_message_size, "You are now friends with %s\n\r\n", cmd_argv[1]);
+                    send_text(client, client_message);
+                }
+                break;
+            case 1:
+                error("users are already friends", client);
+                break;
+            case 2:
+                error("at least one user you entered has the max number of friends", client);
+                break;
+            case 3:
+                error("you must enter two different users", client);
+                break;
+            case 4:
+                error("User you entered does not exist", client);
+                break;
+        }
+        TRACE_END("cmd:make_friends");
+    } else if (strcmp(cmd_argv[0], "unfriend") == 0 && cmd_argc == 2) {
+        TRACE_BEGIN("cmd:unfriend");
+        User *former_friend = find_user(cmd_argv[1], user_list);
+        switch (unfriend(former_friend, user_by_id(client->user_id))) {
+            case 0: {
+                repl_log_pair(REPL_UNFRIEND, former_friend, user_by_id(client->user_id));
+                char message[128];
+                snprintf(message, sizeof(message), "You have been unfriended by %s\n\r\n", client_name(client));
+                buf = buffer_new(message, strlen(message));
+                Buffer *frame = notification_frame(FRAME_NOTIFY_UNFRIENDED, client_name(client), NULL);
+                notify_client(former_friend->id, buf, frame, first_client);
+                buffer_unref(buf);
+                buffer_unref(frame);
+                if (client->binary) {
+                    end_reply(client, begin_reply(client, FRAME_OK));
+                } else {
+                    snprintf(message, sizeof(message), "You are no longer friends with %s\n\r\n", former_friend->name);
+                    send_text(client, message);
+                }
+                break;
+            }
+            case 1:
+                error("users are not friends", client);
+                break;
+            case 3:
+                error("you must enter two different users", client);
+                break;
+            case 4:
+                error("User you entered does not exist", client);
+                break;
+        }
+        TRACE_END("cmd:unfriend");
+    } else if (strcmp(cmd_argv[0], "delete_post") == 0 && cmd_argc == 3) {
+        TRACE_BEGIN("cmd:delete_post");
+        User *user = find_user(cmd_argv[1], user_list);
+        char *end;
+        unsigned long number = strtoul(cmd_argv[2], &end, 10);
+        Post *post = NULL;
+        if (user == NULL) {
+            error("user not found", client);
+        } else if (*end != '\0' || (post = post_at(user, number)) == NULL) {
+            error("no such post", client);
+        } else if (post->author != client->user_id && user->id != client->user_id) {
+            error("you can only delete your own posts, or posts on your profile", client);
+        } else {
+            repl_log_delete_post(user, number);
+            remove_post(user, post);
+            epoch_retire(post, free_post);
+            if (client->binary) {
+                end_reply(client, begin_reply(client, FRAME_OK));
+            }
+        }
+        TRACE_END("cmd:delete_post");
+    } else if (strcmp(cmd_argv[0], "delete_user") == 0 && cmd_argc == 1) {
+        TRACE_BEGIN("cmd:delete_user");
+        delete_user(user_by_id(client->user_id), client, first_client, users);
+        TRACE_END("cmd:delete_user");
+        return -1;
+    } else if (strcmp(cmd_argv[0], "post") == 0 && cmd_argc >= 3) {
+        TRACE_BEGIN("cmd:post");
+        // first determine how long a string we need
+        int space_needed = 0;
+        for (int i = 2; i < cmd_argc; i++) {
+            space_needed += strlen(cmd_argv[i]) + 1;
+        }
+
+        // allocate the space
+        char *contents = mem_alloc(MEM_POSTS, space_needed);
+
+        // copy in the bits to make a single string
+        strcpy(contents, cmd_argv[2]);
+        for (int i = 3; i < cmd_argc; i++) {
+            strcat(contents, " ");
+            strcat(contents, cmd_argv[i]);
+        }
+
+        User *author = user_by_id(client->user_id);
+        User *target = find_user(cmd_argv[1], user_list);
+
+        int friend_message_size = strlen("From : \n\r\n") + strlen(author->name) + space_needed;
+        char friend_message[friend_message_size];
+        TRACE_BEGIN("friends:make_post");
+        int result = make_post(author, target, contents);
+        TRACE_END("friends:make_post");
+        switch (result) {
+            case 0:
+                repl_log_post(target, target->first_post);
+                snprintf(friend_message, friend_message_size, "From %s: %s\r\n", author->name, contents);
+                buf = buffer_new(friend_message, strlen(friend_message));
+                Buffer *frame = notification_frame(FRAME_NOTIFY_POST, author->name, contents);
+                notify_client(target->id, buf, frame, first_client);
+                buffer_unref(buf);
+                buffer_unref(frame);
+                store_pack(target->first_post);  // Only now that contents has been sent on
+                retention_note(target);
+                if (client->binary) {
+                    end_reply(client, begin_reply(client, FRAME_OK));
+                }
+                break;
+            case 1:
+                error("the users are not friends", client);
+                mem_free(MEM_POSTS, contents);
+                break;
+            case 2:
+                error("at least one user you entered does not exist", client);
+                mem_free(MEM_POSTS, contents);
+                break;
+        }
+        TRACE_END("cmd:post");
+    } else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
+        TRACE_BEGIN("cmd:profile");
+        User *user = find_user(cmd_argv[1], user_list);
+        if (user == NULL) {
+            error("user not found", client);
+        } else if (client->binary) {
+            send_profile(client, user);
+        } else if (!render_later(client, user, user_list)) {
+            buf = cached_print_user(user);
+            send_buffer(client, buf);
+            buffer_unref(buf);
+        }
+        TRACE_END("cmd:profile");
+    } else if (strcmp(cmd_argv[0], "history") == 0 && (cmd_argc == 2 || cmd_argc == 3)) {
+        TRACE_BEGIN("cmd:history");
+        User *user = find_user(cmd_argv[1], user_list);
+        char *end = "";
+        unsigned long page = cmd_argc == 3 ? strtoul(cmd_argv[2], &end, 10) : 1;
+        Post *posts = NULL;
+        if (user == NULL) {
+            error("user not found", client);
+        } else if (*end != '\0') {
+            error("page must be a number", client);
+        } else if ((posts = read_history(user, page)) == NULL) {
+            error("no archived posts on that page", client);
+        } else if (client->binary) {
+            send_posts(client, posts);
+        } else {
+            char title[128];
+            snprintf(title, sizeof(title), "Archived posts of %s, page %lu of %lu:", user->name,
+                     page, (user->num_archived + HISTORY_PAGE_SIZE - 1) / HISTORY_PAGE_SIZE);
+            char *history = print_posts(title, posts);
+            buf = buffer_adopt(history, strlen(history));
+            send_buffer(client, buf);
+            buffer_unref(buf);
+        }
+        free_posts(posts);
+        TRACE_END("cmd:history");
+    } else if (strcmp(cmd_argv[0], "replication") == 0 && cmd_argc == 1) {
+        send_replication_status(client, first_client);
+    } else if (strcmp(cmd_argv[0], "join") == 0 && cmd_argc == 2) {
+        switch (channel_join(cmd_argv[1], client->user_id)) {
+            case 0:
+                if (client->binary) {
+                    end_reply(client, begin_reply(client, FRAME_OK));
+                } else {
+                    char message[MAX_CHANNEL_NAME + 32];
+                    snprintf(message, sizeof(message), "You joined %s\r\n", cmd_argv[1]);
+                    send_text(client, message);
+                }
+                break;
+            case 1:
+                error("you are already in that channel", client);
+                break;
+            case 2:
+                error("channel name too long", client);
+                break;
+        }
+    } else if (strcmp(cmd_argv[0], "leave") == 0 && cmd_argc == 2) {
+        if (channel_leave(cmd_argv[1], client->user_id) == 1) {
+            error("you are not in that channel", client);
+        } else if (client->binary) {
+            end_reply(client, begin_reply(client, FRAME_OK));
+        } else {
+            char message[MAX_CHANNEL_NAME + 32];
+            snprintf(message, sizeof(message), "You left %s\r\n", cmd_argv[1]);
+            send_text(client, message);
+        }
+    } else if (strcmp(cmd_argv[0], "publish") == 0 && cmd_argc >= 3) {
+        TRACE_BEGIN("cmd:publish");
+        Channel *channel = channel_find(cmd_argv[1]);
+        if (channel == NULL || !channel_subscribed(channel, client->user_id)) {
+            error("join the channel before publishing to it", client);
+        } else {
+            // The words of the message, separated by single spaces as for post
+            size_t space_needed = 0;
+            for (int i = 2; i < cmd_argc; i++) {
+                space_needed += strlen(cmd_argv[i]) + 1;
+            }
+            char contents[space_needed];
+            strcpy(contents, cmd_argv[2]);
+            for (int i = 3; i < cmd_argc; i++) {
+                strcat(contents, " ");
+                strcat(contents, cmd_argv[i]);
+            }
+            publish(client, channel, contents);
+            if (client->binary) {
+                end_reply(client, begin_reply(client, FRAME_OK));
+            }
+        }
+        TRACE_END("cmd:publish");
+    } else if (strcmp(cmd_argv[0], "online_friends") == 0 && cmd_argc == 1) {
+        send_online_friends(client);
+    } else if (strcmp(cmd_argv[0], "friends_status") == 0 && cmd_argc == 1) {
+        send_friends_status(client);
+    } else if (strcmp(cmd_argv[0], "memstats") == 0 && cmd_argc == 1) {
+        send_memstats(client);
+    } else if (strcmp(cmd_argv[0], "trace_dump") == 0 && cmd_argc == 1) {
+#ifdef TRACE
+        dump_trace(client);
+#else
+        error("tracing is not compiled in; rebuild with make TRACE=1", client);
+#endif
+    } else {
+        error("Incorrect syntax", client);
+    }
+    return 0;
+}
+
+/*
+ * Log client in as the user called name, creating them if needed. Return 1
+ * if they already existed, 0 if they were created, and -1 if they don't
+ * exist and this server is a follower, so can't create them.
+ */
+int login(Client *client, const char *name, User **users) {
+    if (primary_path != NULL) {
+        User *user = find_user(name, *users);
+        if (user == NULL) {
+            return -1;
+        }
+        log_in_as(client, user->id);
+        return 1;
+    }
+
+    int returning = create_user(name, users) == 1;
+    User *user = find_user(name, *users);
+    if (!returning) {
+        repl_log_create_user(user);
+    }
+    log_in_as(client, user->id);
+    return returning;
+}
+
+/* Parses user command. Expects a full line with null termination. Returns -1 if client sent quit command and 0 otherwise. */
+int parse_input(char *user_input, Client *first_client, Client *client, User **users) {
+    // new client, they are sending in a username instead of commands 
+    if (client->user_id == NO_USER) {
+        // decided how long the name is, truncating if necessary
+        int username_len = strlen(user_input);
+        if (username_len > MAX_NAME - 1) {
             username_len = MAX_NAME - 1;
-            write(client->sock_fd, "Username too long. Username truncated to %d characters", MAX_NAME - 1);
+            char msg[80];
+            snprintf(msg, sizeof(msg), "Username too long. Username truncated to %d characters\r\n", MAX_NAME - 1);
+            send_text(client, msg);
         }
 
-        // Allocate appropriate amount space
-        char *username = Malloc(sizeof(char) * (username_len + 1)); 
+        char username[MAX_NAME];
         strncpy(username, user_input, username_len);
         username[username_len] = '\0'; // should be null terminated anyway but just to make sure
 
-        if (create_user(username, users) == 1) {
-            // means username is in users list
-            write(client->sock_fd, "Welcome back.\r\n", strlen("Welcome back.\r\n"));
-        } 
-        client->username = username;
-        client->user = find_user(username, *users);
+        int result = login(client, username, users);
+        if (result == 1) {
+            send_text(client, "Welcome back.\r\n");
+        } else if (result == -1) {
+            error(NO_SUCH_USER, client);
+        }
+
+        return 0;
+    }
+
+    // Run the other
+    int num_inputs = find_num_args(user_input);
+    char **args = create_args_array(user_input, num_inputs);
+    int result = process_args(num_inputs, args, first_client, client, users);
+    for (int i = 0; i < num_inputs; i++) {
+        mem_free(MEM_PARSE, args[i]);
+    }
+    mem_free(MEM_PARSE, args);
+    return result == -1 ? -1 : 0;
+}
+
+
+/* Return the rate limit bucket of the user with this ID, creating it if needed. */
+TokenBucket *user_bucket(UserId user_id, uint64_t now_us) {
+    if (user_id >= num_user_buckets) {
+        UserId new_size = num_user_buckets == 0 ? 64 : num_user_buckets;
+        while (new_size <= user_id) {
+            new_size *= 2;
+        }
+        user_buckets = mem_realloc(MEM_SESSIONS, user_buckets, sizeof(TokenBucket) * new_size);
+        for (UserId id = num_user_buckets; id < new_size; id++) {
+            bucket_init(&user_buckets[id], USER_RATE, USER_BURST, now_us);
+        }
+        num_user_buckets = new_size;
+    }
+    return &user_buckets[user_id];
+}
+
+/* Return 1 if the command in line fans out to other users, 0 otherwise. */
+int is_mutation(const char *line) {
+    return strncmp(line, "post ", strlen("post ")) == 0 ||
+           strncmp(line, "make_friends ", strlen("make_friends ")) == 0 ||
+           strncmp(line, "unfriend ", strlen("unfriend ")) == 0 ||
+           strncmp(line, "publish ", strlen("publish ")) == 0;
+}
+
+/* Return 1 if the request frame with this opcode fans out to other users, 0 otherwise. */
+int is_mutation_frame(uint8_t opcode) {
+    return opcode == FRAME_POST || opcode == FRAME_MAKE_FRIENDS || opcode == FRAME_UNFRIEND ||
+           opcode == FRAME_PUBLISH;
+}
+
+/*
+ * Take the tokens client needs to run num_commands commands, num_mutations
+ * of which are mutations. If there aren't enough, return how many
+ * microseconds until there will be and take nothing.
+ */
+uint64_t admit(Client *client, int num_commands, int num_mutations, uint64_t now_us) {
+    uint64_t wait_us = bucket_wait_us(&client->bucket, now_us, num_commands);
+    TokenBucket *user = NULL;
+    if (client->user_id != NO_USER && num_mutations > 0) {
+        user = user_bucket(client->user_id, now_us);
+        uint64_t user_wait_us = bucket_wait_us(user, now_us, num_mutations);
+        if (user_wait_us > wait_us) {
+            wait_us = user_wait_us;
+        }
+    }
+    if (wait_us == 0) {
+        bucket_take(&client->bucket, num_commands);
+        if (user != NULL) {
+            bucket_take(user, num_mutations);
+        }
+    }
+    return wait_us;
+}
+
+/* Return the number of complete lines in the first n characters of buf. */
+int count_lines(const char *buf, int n) {
+    int count = 0;
+    int where;
+    while ((where = find_network_newline(buf, n)) > 0) {
+        count++;
+        buf += where;
+        n -= where;
+    }
+    return count;
+}
+
+/* Return the number of complete request frames in the first n bytes of buf. */
+int count_frames(const char *buf, size_t n) {
+    int count = 0;
+    uint8_t opcode;
+    uint32_t tag;
+    long frame_len;
+    while ((frame_len = frame_parse_header(buf, n, FRAME_MAX_REQUEST, &opcode, &tag)) > 0) {
+        count++;
+        buf += frame_len;
+        n -= frame_len;
+    }
+    return count;
+}
+
+/* Count the requests, and the mutations among them, in the body of a batch frame. */
+void count_batch(const char *body, size_t len, int *num_commands, int *num_mutations) {
+    *num_commands = 0;
+    *num_mutations = 0;
+    uint8_t opcode;
+    uint32_t tag;
+    long frame_len;
+    while ((frame_len = frame_parse_header(body, len, len, &opcode, &tag)) > 0) {
+        (*num_commands)++;
+        *num_mutations += is_mutation_frame(opcode);
+        body += frame_len;
+        len -= frame_len;
+    }
+}
+
+/* Record the num_args arguments of a binary request as the line a text client would have sent. */
+void capture_args(Client *client, char **args, int num_args, uint64_t arrival_us, uint32_t service_us) {
+    size_t len = 0;
+    for (int i = 0; i < num_args; i++) {
+        len += strlen(args[i]) + 1;
+    }
+    char *line = mem_alloc(MEM_PARSE, len + 1);
+    char *end = line;
+    for (int i = 0; i < num_args; i++) {
+        if (i > 0) {
+            *end++ = ' ';
+        }
+        strcpy(end, args[i]);
+        end += strlen(args[i]);
+    }
+    capture_line(client->session_id, line, end - line, arrival_us, service_us);
+    mem_free(MEM_PARSE, line);
+}
+
+/*
+ * Run the request frame (other than a batch) with this opcode and body for
+ * client. Requests are turned into the arguments of the matching text
+ * command, so both protocols share process_args.
+ * Returns -1 if the client quit, 0 otherwise.
+ */
+int run_command(Client *client, uint8_t opcode, const char *body, size_t len,
+                Client *first_client, User **users, uint64_t arrival_us) {
+    char *command = NULL;  // NULL for a login, which takes just the name
+    int num_fields = 0;    // How many strings follow the header
+    switch (opcode) {
+        case FRAME_LOGIN:
+            num_fields = 1;
+            break;
+        case FRAME_QUIT:
+            command = "quit";
+            break;
+        case FRAME_LIST_USERS:
+            command = "list_users";
+            break;
+        case FRAME_MAKE_FRIENDS:
+            command = "make_friends";
+            num_fields = 1;
+            break;
+        case FRAME_POST:
+            command = "post";
+            num_fields = 2;
+            break;
+        case FRAME_PROFILE:
+            command = "profile";
+            num_fields = 1;
+            break;
+        case FRAME_TRACE_DUMP:
+            command = "trace_dump";
+            break;
+        case FRAME_HISTORY:
+            command = "history";
+            num_fields = 1;  // Followed by the page number, taken below
+            break;
+        case FRAME_UNFRIEND:
+            command = "unfriend";
+            num_fields = 1;
+            break;
+        case FRAME_DELETE_POST:
+            command = "delete_post";
+            num_fields = 1;  // Followed by the post number, taken below
+            break;
+        case FRAME_DELETE_USER:
+            command = "delete_user";
+            break;
+        case FRAME_REPLICATION:
+            command = "replication";
+            break;
+        case FRAME_ONLINE_FRIENDS:
+            command = "online_friends";
+            break;
+        case FRAME_FRIENDS_STATUS:
+            command = "friends_status";
+            break;
+        case FRAME_MEMSTATS:
+            command = "memstats";
+            break;
+        case FRAME_JOIN:
+            command = "join";
+            num_fields = 1;
+            break;
+        case FRAME_LEAVE:
+            command = "leave";
+            num_fields = 1;
+            break;
+        case FRAME_PUBLISH:
+            command = "publish";
+            num_fields = 2;
+            break;
+        default:
+            error("unknown request", client);
+            return 0;
+    }
+
+    char *args[3];
+    int num_args = 0;
+    if (command != NULL) {
+        args[num_args++] = command;
+    }
+    FrameReader reader = {body, len};
+    int malformed = 0;
+    for (int i = 0; i < num_fields && !malformed; i++) {
+        if ((args[num_args] = frame_get_str(&reader, MEM_PARSE)) == NULL) {
+            malformed = 1;
+        } else {
+            num_args++;
+        }
+    }
+
+    // The page or post number ending a history or delete_post request
+    // becomes its last argument
+    char number[16];
+    uint32_t number_field;
+    if ((opcode == FRAME_HISTORY || opcode == FRAME_DELETE_POST) && !malformed) {
+        if (frame_get_u32(&reader, &number_field) == -1) {
+            malformed = 1;
+        } else {
+            snprintf(number, sizeof(number), "%u", number_field);
+            args[num_args++] = number;
+        }
+    }
+
+    int result = 0;
+    uint64_t start_us = capture_now_us();
+    if (malformed) {
+        error("malformed request", client);
+    } else if (opcode == FRAME_LOGIN) {
+        if (client->user_id != NO_USER) {
+            error("already logged in", client);
+        } else if (strlen(args[0]) > MAX_NAME - 1) {
+            error("name too long", client);
+        } else {
+            int returning = login(client, args[0], users);
+            if (returning == -1) {
+                error(NO_SUCH_USER, client);
+            } else {
+                size_t start = begin_reply(client, FRAME_LOGGED_IN);
+                frame_put_u32(&client->replies, client->user_id);
+                frame_put_u8(&client->replies, returning);
+                end_reply(client, start);
+            }
+        }
+    } else if (client->user_id == NO_USER) {
+        error("log in first", client);
+    } else {
+        result = process_args(num_args, args, first_client, client, users);
+    }
+    if (!malformed) {
+        capture_args(client, args, num_args, arrival_us, capture_now_us() - start_us);
+    }
+
+    for (int i = command != NULL; i < num_args; i++) {
+        if (args[i] != number) {
+            mem_free(MEM_PARSE, args[i]);
+        }
+    }
+    return result;
+}
+
+/*
+ * Run each request frame in the body of a batch frame, collecting their
+ * replies into one batch reply. Returns -1 if the client quit, 0 otherwise.
+ */
+int run_batch(Client *client, const char *body, size_t len,
+              Client *first_client, User **users, uint64_t arrival_us) {
+    size_t start = begin_reply(client, FRAME_BATCH_REPLY);
+    client->in_batch = 1;
+    int result = 0;
+    while (len > 0 && result == 0) {
+        uint8_t opcode;
+        uint32_t tag;
+        long frame_len = frame_parse_header(body, len, len, &opcode, &tag);
+        if (frame_len <= 0) {
+            error("malformed batch", client);
+            break;
+        }
+        client->tag = tag;
+        if (opcode == FRAME_BATCH) {
+            error("batches can't be nested", client);
+        } else {
+            result = run_command(client, opcode, body + FRAME_HEADER_LEN, frame_len - FRAME_HEADER_LEN,
+                                 first_client, users, arrival_us);
+        }
+        body += frame_len;
+        len -= frame_len;
+    }
+    client->in_batch = 0;
+    end_reply(client, start);
+    return result;
+}
+
+/*
+ * The binary protocol's run_lines: run the complete request frames in
+ * client's buffer, in order, until client runs out of tokens.
+ * Returns client_fd if the client quit or sent a frame that's too long,
+ * 0 otherwise.
+ */
+int run_frames(Client *client, Client *first_client, User **users, uint64_t arrival_us) {
+    int client_fd = client->sock_fd;
+    command_backlog -= client->deferred_lines;
+    client->deferred_lines = 0;
+    client->throttled_until = 0;
+    client->resume_due = 0;
+
+    while (1) {
+        uint8_t opcode;
+        uint32_t tag;
+        long frame_len = frame_parse_header(client->buf, client->inbuf, FRAME_MAX_REQUEST, &opcode, &tag);
+        if (frame_len < 0) {
+            return client_fd;
+        } else if (frame_len == 0) {
+            break;
+        }
+        const char *body = client->buf + FRAME_HEADER_LEN;
+        size_t body_len = frame_len - FRAME_HEADER_LEN;
+
+        // A batch takes a token for every request in it
+        int num_commands = 1;
+        int num_mutations = is_mutation_frame(opcode);
+        if (opcode == FRAME_BATCH) {
+            count_batch(body, body_len, &num_commands, &num_mutations);
+        }
+        uint64_t now_us = capture_now_us();
+        uint64_t wait_us = admit(client, num_commands, num_mutations, now_us);
+        if (wait_us > 0) {
+            client->throttled_until = now_us + wait_us;
+            client->deferred_lines = count_frames(client->buf, client->inbuf);
+            command_backlog += client->deferred_lines;
+            break;
+        }
+
+        client->tag = tag;
+        int result;
+        TRACE_BEGIN("run_frame");
+        if (opcode == FRAME_BATCH) {
+            result = run_batch(client, body, body_len, first_client, users, arrival_us);
+        } else {
+            result = run_command(client, opcode, body, body_len, first_client, users, arrival_us);
+        }
+        TRACE_END("run_frame");
+        if (result == -1) {
+            return client_fd;
+        }
+        client->inbuf -= frame_len;
+        memmove(client->buf, client->buf + frame_len, client->inbuf);
+    }
+
+    client->room = FRAME_BUF_SIZE - client->inbuf;
+    client->after = client->buf + client->inbuf;
+    return 0;
+}
+
+/* Switch client, which has just sent FRAME_MAGIC, to the binary protocol. */
+void start_binary(Client *client) {
+    client->binary = 1;
+    client->buf = mem_realloc(MEM_SESSIONS, client->buf, FRAME_BUF_SIZE);
+    client->inbuf -= FRAME_MAGIC_LEN;
+    memmove(client->buf, client->buf + FRAME_MAGIC_LEN, client->inbuf);
+}
+
+/* Return 1 if client should be prompted for its next command, 0 otherwise. */
+int wants_prompt(const Client *client) {
+    // Only once a line has run: reads that just fill the buffer, or whose
+    // lines are all held back, aren't answered. Binary clients and followers
+    // never are, nor are clients part way through sending FRAME_MAGIC.
+    // Clients waiting on a worker are prompted once its reply has gone.
+    return client->prompt_due && !client->binary && !client->follower &&
+        !(client->inbuf > 0 && client->buf[0] == '\0') && !client->awaiting_render;
+}
+
+/*
+ * Run the complete lines in client's buffer, in order, until client runs
+ * out of tokens. Lines that aren't admitted stay in the buffer and the
+ * client is throttled until enough tokens have built up.
+ * Returns client_fd if the client quit, 0 otherwise.
+ */
+int run_lines(Client *client, Client *first_client, User **users, uint64_t arrival_us) {
+    int client_fd = client->sock_fd;
+    command_backlog -= client->deferred_lines;
+    client->deferred_lines = 0;
+    client->throttled_until = 0;
+    client->resume_due = 0;
+
+    int where;
+    while (1) {
+        // A name can't start with a 0 byte, so this client wants the binary protocol
+        if (client->user_id == NO_USER && client->inbuf > 0 && client->buf[0] == '\0') {
+            if (client->inbuf < FRAME_MAGIC_LEN) {
+                break;
+            }
+            if (memcmp(client->buf, FRAME_MAGIC, FRAME_MAGIC_LEN) != 0) {
+                return client_fd;
+            }
+            start_binary(client);
+            return run_frames(client, first_client, users, arrival_us);
+        }
+
+        TRACE_BEGIN("find_network_newline");
+        where = find_network_newline(client->buf, client->inbuf);
+        TRACE_END("find_network_newline");
+        if (where <= 0) {
+            break;
+        }
+
+        uint64_t now_us = capture_now_us();
+        uint64_t wait_us = admit(client, 1, is_mutation(client->buf), now_us);
+        if (wait_us > 0) {
+            client->throttled_until = now_us + wait_us;
+            client->deferred_lines = count_lines(client->buf, client->inbuf);
+            command_backlog += client->deferred_lines;
+            break;
+        }
+
+        (client->buf)[where - 2] = '\0'; // replace network newline with null character
+        uint64_t start_us = capture_now_us();
+        TRACE_BEGIN("parse_input");
+        int result = parse_input(client->buf, first_client, client, users);
+        TRACE_END("parse_input");
+        client->prompt_due = 1;
+        capture_line(client->session_id, client->buf, where - 2, arrival_us, capture_now_us() - start_us);
+        if (result == -1) {
+            return client_fd;
+        }
+        client->inbuf = client->inbuf - where;
+        memmove(client->buf, client->buf + where, client->inbuf);
+        if (client->awaiting_render) {
+            break;  // The rest wait for its reply; see finish_render
+        }
+    }
+
+    client->room = BUF_SIZE - client->inbuf;
+    client->after = client->buf + client->inbuf;
+    return 0;
+}
+
+/*
+ * Read a message from client_index and add it to the client's buffer.
+ * Returns client_fd if the fd has been closed, 0 otherwise.
+ */
+int read_from(Client *client, Client *first_client, User **users) {
+    int client_fd = client->sock_fd;
+    int num_read = read(client_fd, client->after, client->room);
+    if (num_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    // nothing was read so writing end has been closed
+    if (num_read <= 0) {
+        return client_fd;
+    }
+    client->inbuf += num_read;
+    client->last_read_us = capture_now_us();
+
+    if (client->binary) {
+        return run_frames(client, first_client, users, capture_now_us());
+    }
+    return run_lines(client, first_client, users, capture_now_us());
+}
+
+/*
+ * Read a follower's REPL_SUBSCRIBE, and start sending it the log from
+ * where it asks. Returns client_fd if the follower has gone or can't be
+ * served, 0 otherwise.
+ */
+int read_subscription(Client *follower) {
+    int client_fd = follower->sock_fd;
+    int num_read = read(client_fd, follower->after, follower->room);
+    if (num_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (num_read <= 0 || follower->subscribed) {
+        return client_fd;
+    }
+    follower->inbuf += num_read;
+    follower->room -= num_read;
+    follower->after += num_read;
 
+    ReplRecord record = {.str = NULL};
+    long len = repl_parse(follower->buf, follower->inbuf, &record);
+    if (len == 0 && follower->room > 0) {
         return 0;
     }
+    if (len <= 0 || record.opcode != REPL_SUBSCRIBE) {
+        mem_free(MEM_PARSE, record.str);
+        return client_fd;
+    }
+    Buffer *hello = repl_hello();
+    send_buffer(follower, hello);
+    buffer_unref(hello);
 
-    // Run the other
-    int num_inputs = find_num_args(user_input);
-    char **args = create_args_array(user_input, num_inputs);
-    if (process_args(num_inputs, args, first_client, client, users) == -1) {
-        return -1;
+    // A follower of an earlier run of this server has users we never had.
+    // Tell it so (with our log ID, or how much of the log we have) before
+    // hanging up, so it can tell that from the connection just dropping.
+    if ((record.offset > 0 && record.value != repl_log_id()) || record.offset > repl_log_end()) {
+        Buffer *heartbeat = repl_heartbeat();
+        send_buffer(follower, heartbeat);
+        buffer_unref(heartbeat);
+        flush_client(follower);
+        return client_fd;
     }
+
+    follower->subscribed = 1;
+    follower->log_offset = record.offset;
     return 0;
 }
 
+/*
+ * Queue as much of the log to follower as it hasn't been sent, keeping at
+ * most REPL_WINDOW bytes queued, and a heartbeat if one is due and it has
+ * everything.
+ */
+void ship_log(Client *follower) {
+    while (follower->log_offset < repl_log_end() && follower->out_bytes < REPL_WINDOW) {
+        Buffer *chunk = repl_log_read(follower->log_offset, REPL_CHUNK);
+        if (chunk == NULL) {
+            follower->dead = 1;
+            return;
+        }
+        follower->log_offset += chunk->len;
+        send_buffer(follower, chunk);
+        buffer_unref(chunk);
+    }
+    if (heartbeat_due && follower->log_offset == repl_log_end()) {
+        Buffer *heartbeat = repl_heartbeat();
+        send_buffer(follower, heartbeat);
+        buffer_unref(heartbeat);
+    }
+}
+
+/* Have the next pass send heartbeats, and do it again in REPL_HEARTBEAT_US. */
+void heartbeat(Timer *timer) {
+    heartbeat_due = 1;
+    wheel_schedule(&timers, timer, capture_now_us() + REPL_HEARTBEAT_US);
+}
+
+/* retention_archived callback for primaries. */
+void log_archived(const User *user) {
+    repl_log_user(REPL_ARCHIVE, user);
+}
 
 /*
- * Read a message from client_index and add it to the client's buffer.
- * Returns client_fd if the fd has been closed, 0 otherwise.
+ * Apply a record of the primary's log to our users, just as the primary
+ * did. Frees record->str.
  */
-int read_from(Client *client, Client *first_client, User **users) {
-    int client_fd = client->sock_fd;
-    int num_read = read(client_fd, client->after, client->room);
-    // nothing was read so writing end has been closed
-    if (num_read == 0) {
-        return client_fd;
+void apply_record(ReplRecord *record, Client *first_client, User **users) {
+    User *user1 = user_by_id(record->user1);
+    User *user2 = user_by_id(record->user2);
+    Post *post = NULL;
+    int result = 0;
+    switch (record->opcode) {
+        case REPL_CREATE_USER:
+            result = create_user(record->str, users);
+            break;
+        case REPL_MAKE_FRIENDS:
+            result = make_friends_users(user1, user2);
+            break;
+        case REPL_UNFRIEND:
+            result = unfriend(user1, user2);
+            break;
+        case REPL_POST:
+            result = make_post(user1, user2, record->str);
+            if (result == 0) {
+                mem_move(MEM_PARSE, MEM_POSTS, record->str);  // Now the post's
+                record->str = NULL;
+                user2->first_post->date = record->value;
+                store_pack(user2->first_post);
+            }
+            break;
+        case REPL_DELETE_POST:
+            if (user1 == NULL || (post = post_at(user1, record->value)) == NULL) {
+                result = -1;
+            } else {
+                remove_post(user1, post);
+                epoch_retire(post, free_post);
+            }
+            break;
+        case REPL_DELETE_USER:
+            if (user1 == NULL) {
+                result = -1;
+            } else {
+                delete_user(user1, NULL, first_client, users);
+            }
+            break;
+        case REPL_ARCHIVE:
+            if (user1 == NULL || user1->last_post == NULL) {
+                result = -1;
+            } else if (!archive_is_open() || archive_oldest_post(user1) == -1) {
+                // Without an archive the post is just dropped, so the
+                // profile still reads the same as on the primary
+                post = remove_oldest_post(user1);
+                note_archived(user1, 0);
+                epoch_retire(post, free_post);
+            }
+            break;
     }
-    client->inbuf += num_read;
+    mem_free(MEM_PARSE, record->str);
 
-    int where;
-    while ((where = find_network_newline(client->buf, client->inbuf)) > 0) {
-        (client->buf)[where - 2] = '\0'; // replace network newline with null character
-        if (parse_input(client->buf, first_client, client, users) == -1) {
-            return client_fd;
+    // Our users no longer match the primary's, so we can't serve anything
+    if (result != 0) {
+        fprintf(stderr, "server: replication record at offset %llu doesn't apply\n",
+                (unsigned long long) applied_end);
+        exit(1);
+    }
+}
+
+/*
+ * Read what the primary has sent and apply every complete record.
+ * Returns -1 if the connection has gone, 0 otherwise.
+ */
+int read_primary(Client *first_client, User **users) {
+    ssize_t num_read = read(primary_fd, primary_buf + primary_inbuf, PRIMARY_BUF_SIZE - primary_inbuf);
+    if (num_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (num_read <= 0) {
+        return -1;
+    }
+    primary_inbuf += num_read;
+    primary_seen_us = capture_now_us();
+
+    size_t used = 0;
+    ReplRecord record;
+    long len;
+    while ((len = repl_parse(primary_buf + used, primary_inbuf - used, &record)) > 0) {
+        used += len;
+        lag_us = primary_seen_us > record.time_us ? primary_seen_us - record.time_us : 0;
+        if (record.opcode == REPL_HELLO) {
+            // Another log can't carry on from what we have of this one
+            if (applied_end > 0 && record.value != primary_log_id) {
+                fprintf(stderr, "server: the primary has restarted since we started following it\n");
+                exit(1);
+            }
+            primary_log_id = record.value;
+        } else if (record.opcode == REPL_HEARTBEAT) {
+            if (record.value < applied_end) {
+                fprintf(stderr, "server: the primary has less of its log than we do\n");
+                exit(1);
+            }
+            primary_log_end = record.value;
+        } else {
+            TRACE_BEGIN("apply_record");
+            apply_record(&record, first_client, users);
+            TRACE_END("apply_record");
+            applied_end += len;
+            if (applied_end > primary_log_end) {
+                primary_log_end = applied_end;
+            }
         }
-        client->inbuf = client->inbuf - where;
-        memmove(client->buf, client->buf + where, client->inbuf);
     }
+    if (len == -1) {
+        fprintf(stderr, "server: malformed replication record at offset %llu\n",
+                (unsigned long long) applied_end);
+        exit(1);
+    }
+    primary_inbuf -= used;
+    memmove(primary_buf, primary_buf + used, primary_inbuf);
+    return 0;
+}
 
-    client->room = BUF_SIZE - client->inbuf;
-    client->after = client->buf + client->inbuf;
+/*
+ * Connect to the primary and subscribe to its log from where we've got to.
+ * Return 0 on success and -1 on error.
+ */
+int connect_primary(void) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("server: socket");
+        exit(1);
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, primary_path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    Buffer *subscribe = repl_subscribe(primary_log_id, applied_end);
+    ssize_t num_written = write(fd, subscribe->data, subscribe->len);
+    buffer_unref(subscribe);
+    if (num_written != FRAME_HEADER_LEN + 16 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+        close(fd);
+        return -1;
+    }
+    primary_fd = fd;
+    primary_inbuf = 0;
     return 0;
 }
 
+/* Try to connect to the primary, and keep trying every REPL_RETRY_US until it works. */
+void reconnect_primary(Timer *timer) {
+    if (connect_primary() == -1) {
+        wheel_schedule(&timers, timer, capture_now_us() + REPL_RETRY_US);
+    }
+}
+
+/* Return a socket listening for followers at the Unix socket path. */
+int listen_followers(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("server: socket");
+        exit(1);
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);  // Left behind by an earlier run
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, MAX_BACKLOG) < 0) {
+        perror("server: replication socket");
+        exit(1);
+    }
+    return fd;
+}
 
-int main() {
+/* Return a socket listening for clients on port. */
+int listen_clients(int port) {
     // Create the socket FD.
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd < 0) {
@@ -370,7 +2384,7 @@ int main() {
     // Set information about the port (and IP) we want to be connected to.
     struct sockaddr_in server;
     server.sin_family = AF_INET;
-    server.sin_port = htons(PORT);
+    server.sin_port = htons(port);
     server.sin_addr.s_addr = INADDR_ANY;
 
     // This sets an option on the socket so that its port can be reused right
@@ -400,47 +2414,711 @@ int main() {
         close(sock_fd);
         exit(1);
     }
+    return sock_fd;
+}
+
+
+/*
+ * Descriptors being handed over, referred to in the state by their index
+ * here. NO_FD stands for a descriptor we don't have.
+ */
+#define NO_FD UINT32_MAX
+static int *passed_fds = NULL;
+static int num_passed_fds = 0;
+
+/* Add fd to the descriptors being handed over, and return its index. */
+static uint32_t pass_fd(int fd) {
+    if (fd == -1) {
+        return NO_FD;
+    }
+    passed_fds = mem_realloc(MEM_SESSIONS, passed_fds, sizeof(int) * (num_passed_fds + 1));
+    passed_fds[num_passed_fds] = fd;
+    return num_passed_fds++;
+}
+
+/* Append a token bucket's state to builder. */
+static void put_bucket(FrameBuilder *builder, const TokenBucket *bucket) {
+    uint64_t tokens;
+    memcpy(&tokens, &bucket->tokens, sizeof(tokens));
+    frame_put_u64(builder, tokens);
+    frame_put_u64(builder, bucket->last_us);
+}
+
+/* Take a token bucket's state from reader into bucket. Return 0 on success and -1 on error. */
+static int get_bucket(FrameReader *reader, TokenBucket *bucket) {
+    uint64_t tokens;
+    if (frame_get_u64(reader, &tokens) == -1 || frame_get_u64(reader, &bucket->last_us) == -1) {
+        return -1;
+    }
+    memcpy(&bucket->tokens, &tokens, sizeof(tokens));
+    return 0;
+}
+
+/* channel_each callback: count the channels. */
+static void count_channel(const Channel *channel, void *arg) {
+    (*(uint32_t *) arg)++;
+}
+
+/* channel_each callback: append channel to the builder at arg. */
+static void save_channel(const Channel *channel, void *arg) {
+    FrameBuilder *builder = arg;
+    frame_put_str(builder, channel->name);
+    frame_put_u32(builder, channel->num_subscribers);
+    for (size_t i = 0; i < channel->num_subscribers; i++) {
+        frame_put_u32(builder, channel->subscribers[i]);
+    }
+}
+
+/*
+ * Hand everything over to the replacement process connected on conn (see
+ * handoff.h), and exit once it has accepted. If it doesn't, close conn and
+ * return, to carry on serving. The state sent (after handoff.h's magic and
+ * version, bumping HANDOFF_VERSION with any change) is, with fields encoded
+ * as in frame.h and descriptors as indexes into those passed:
+ *
+ *   client socket (4), replication socket (4), handoff socket (4)
+ *   archive (4), archive length (8)
+ *   replication log (4), log ID (8), log length (8)
+ *   primary's replication socket path, or "" if we're not a follower
+ *   connection to the primary (4), primary_log_id, applied_end,
+ *     primary_log_end, lag_us, primary_seen_us (8 each),
+ *     primary_inbuf (4) and that many bytes of primary_buf
+ *   next_session_id (4), number of user buckets (4), then each bucket
+ *   users and cache, as in snapshot.h
+ *   client count (4), then per client:
+ *     connection (4), session ID (4), user ID (4), binary, follower,
+ *     subscribed (1 each), log_offset, connected_us, last_read_us (8 each),
+ *     bucket, throttled_until (8),
+ *     input length (4) and bytes, unsent output length (4) and bytes
+ *   channel count (4), then per channel:
+ *     name, subscriber count (4), subscriber IDs (4 each)
+ *
+ * where a bucket is its tokens (8, the bits of the double) and last_us (8).
+ */
+void hand_off(int conn, int sock_fd, int followers_fd, int handoff_fd,
+              Client *first_client, const User *user_list) {
+    // Send whatever the sockets take now, so less has to be carried over
+    worker_drain();
+    while (deliveries_head != NULL) {
+        deliver_publishes();
+    }
+    archive_flush();
+    capture_flush();
+    for (Client *curr = first_client; curr != NULL; curr = curr->next) {
+        if (!curr->dead && curr->out_head != NULL) {
+            flush_client(curr);
+        }
+    }
+
+    FrameBuilder state;
+    frame_init(&state);
+    num_passed_fds = 0;
+    frame_put_u32(&state, pass_fd(sock_fd));
+    frame_put_u32(&state, pass_fd(followers_fd));
+    frame_put_u32(&state, pass_fd(handoff_fd));
+    frame_put_u32(&state, pass_fd(archive_fd()));
+    frame_put_u64(&state, archive_length());
+    frame_put_u32(&state, pass_fd(repl_log_fd()));
+    frame_put_u64(&state, repl_log_id());
+    frame_put_u64(&state, repl_log_end());
+
+    frame_put_str(&state, primary_path == NULL ? "" : primary_path);
+    frame_put_u32(&state, pass_fd(primary_fd));
+    frame_put_u64(&state, primary_log_id);
+    frame_put_u64(&state, applied_end);
+    frame_put_u64(&state, primary_log_end);
+    frame_put_u64(&state, lag_us);
+    frame_put_u64(&state, primary_seen_us);
+    frame_put_u32(&state, primary_inbuf);
+    frame_put_bytes(&state, primary_buf, primary_inbuf);
+
+    frame_put_u32(&state, next_session_id);
+    frame_put_u32(&state, num_user_buckets);
+    for (UserId id = 0; id < num_user_buckets; id++) {
+        put_bucket(&state, &user_buckets[id]);
+    }
+    snapshot_save(&state, user_list);
+
+    uint32_t num_clients = 0;
+    for (Client *curr = first_client; curr != NULL; curr = curr->next) {
+        num_clients += !curr->dead;
+    }
+    frame_put_u32(&state, num_clients);
+    for (Client *curr = first_client; curr != NULL; curr = curr->next) {
+        if (curr->dead) {
+            continue;
+        }
+        frame_put_u32(&state, pass_fd(curr->sock_fd));
+        frame_put_u32(&state, curr->session_id);
+        frame_put_u32(&state, curr->user_id);
+        frame_put_u8(&state, curr->binary);
+        frame_put_u8(&state, curr->follower);
+        frame_put_u8(&state, curr->subscribed);
+        frame_put_u64(&state, curr->log_offset);
+        frame_put_u64(&state, curr->connected_us);
+        frame_put_u64(&state, curr->last_read_us);
+        put_bucket(&state, &curr->bucket);
+        frame_put_u64(&state, curr->throttled_until);
+        frame_put_u32(&state, curr->inbuf);
+        frame_put_bytes(&state, curr->buf, curr->inbuf);
+        frame_put_u32(&state, curr->out_bytes);
+        for (OutChunk *chunk = curr->out_head; chunk != NULL; chunk = chunk->next) {
+            frame_put_bytes(&state, chunk->buf->data + chunk->offset, chunk->buf->len - chunk->offset);
+        }
+    }
+
+    uint32_t num_channels = 0;
+    channel_each(count_channel, &num_channels);
+    frame_put_u32(&state, num_channels);
+    channel_each(save_channel, &state);
+
+    int result = handoff_send(conn, state.data, state.len, passed_fds, num_passed_fds);
+    frame_free(&state);
+    if (result == 0 && handoff_commit(conn) == 0) {
+        // Everything we had is the new process's now
+        exit(0);
+    }
+    fprintf(stderr, "server: handoff failed, carrying on\n");
+    close(conn);
+}
+
+/* Return the descriptor at index in fds, or -1 for NO_FD; exit if the index is out of range. */
+static int passed_fd(uint32_t index, const int *fds, int num_fds) {
+    if (index == NO_FD) {
+        return -1;
+    } else if (index >= num_fds) {
+        fprintf(stderr, "server: malformed handoff\n");
+        exit(1);
+    }
+    return fds[index];
+}
+
+/*
+ * Take over from the server we're connected to on conn (see hand_off),
+ * restoring its sockets, users, cache and clients. Exit if that fails.
+ */
+void take_over(int conn, int *sock_fd, int *followers_fd, int *handoff_fd,
+               Client **first_client, User **user_list) {
+    const char *data;
+    size_t len;
+    int *fds;
+    int num_fds;
+    if (handoff_receive(conn, &data, &len, &fds, &num_fds) == -1) {
+        fprintf(stderr, "server: nothing handed over\n");
+        exit(1);
+    }
+    // Nothing we've been sent is ours until the old server has gone
+    if (handoff_accept(conn) == -1) {
+        fprintf(stderr, "server: the old server gave up on the handoff\n");
+        exit(1);
+    }
+    FrameReader state = {data, len};
+    int malformed = 0;
+
+    uint32_t sock_index, followers_index, handoff_index, archive_index, log_index, primary_index;
+    uint64_t archive_len, log_id, log_end;
+    malformed |= frame_get_u32(&state, &sock_index) == -1 ||
+                 frame_get_u32(&state, &followers_index) == -1 ||
+                 frame_get_u32(&state, &handoff_index) == -1 ||
+                 frame_get_u32(&state, &archive_index) == -1 ||
+                 frame_get_u64(&state, &archive_len) == -1 ||
+                 frame_get_u32(&state, &log_index) == -1 ||
+                 frame_get_u64(&state, &log_id) == -1 ||
+                 frame_get_u64(&state, &log_end) == -1;
+    char *path = malformed ? NULL : frame_get_str(&state, MEM_SESSIONS);
+    uint32_t inbuf = 0;
+    const char *bytes = NULL;
+    malformed |= path == NULL ||
+                 frame_get_u32(&state, &primary_index) == -1 ||
+                 frame_get_u64(&state, &primary_log_id) == -1 ||
+                 frame_get_u64(&state, &applied_end) == -1 ||
+                 frame_get_u64(&state, &primary_log_end) == -1 ||
+                 frame_get_u64(&state, &lag_us) == -1 ||
+                 frame_get_u64(&state, &primary_seen_us) == -1 ||
+                 frame_get_u32(&state, &inbuf) == -1 || inbuf > PRIMARY_BUF_SIZE ||
+                 (bytes = frame_get_bytes(&state, inbuf)) == NULL;
+    if (malformed) {
+        fprintf(stderr, "server: malformed handoff\n");
+        exit(1);
+    }
+
+    *sock_fd = passed_fd(sock_index, fds, num_fds);
+    *followers_fd = passed_fd(followers_index, fds, num_fds);
+    *handoff_fd = passed_fd(handoff_index, fds, num_fds);
+    if (archive_index != NO_FD && archive_adopt(passed_fd(archive_index, fds, num_fds), archive_len) == -1) {
+        perror("server: archive");
+        exit(1);
+    }
+    if (log_index != NO_FD && repl_log_adopt(passed_fd(log_index, fds, num_fds), log_id, log_end) == -1) {
+        perror("server: replication log");
+        exit(1);
+    }
+    if (path[0] != '\0') {
+        primary_path = path;
+    } else {
+        primary_path = NULL;
+        mem_free(MEM_SESSIONS, path);
+    }
+    primary_fd = passed_fd(primary_index, fds, num_fds);
+    primary_inbuf = inbuf;
+    memcpy(primary_buf, bytes, inbuf);
+
+    uint32_t num_buckets;
+    if (frame_get_u32(&state, &next_session_id) == -1 || frame_get_u32(&state, &num_buckets) == -1) {
+        fprintf(stderr, "server: malformed handoff\n");
+        exit(1);
+    }
+    if (num_buckets > 0) {
+        user_bucket(num_buckets - 1, capture_now_us());
+    }
+    for (UserId id = 0; id < num_buckets; id++) {
+        if (get_bucket(&state, &user_buckets[id]) == -1) {
+            fprintf(stderr, "server: malformed handoff\n");
+            exit(1);
+        }
+    }
+    if (snapshot_load(&state, user_list) == -1) {
+        fprintf(stderr, "server: malformed handoff\n");
+        exit(1);
+    }
+    for (const User *user = *user_list; user != NULL; user = user->next) {
+        retention_note(user);  // The old process's list of users over the cap is lost
+    }
+
+    uint32_t num_clients;
+    malformed = frame_get_u32(&state, &num_clients) == -1;
+    Client *tail = NULL;
+    for (uint32_t i = 0; i < num_clients && !malformed; i++) {
+        uint32_t index, session_id, user_id, out_len;
+        uint8_t binary, follower, subscribed;
+        TokenBucket bucket;
+        uint64_t log_offset, connected_us, last_read_us, throttled_until;
+        const char *out = NULL;
+        malformed = frame_get_u32(&state, &index) == -1 ||
+                    frame_get_u32(&state, &session_id) == -1 ||
+                    frame_get_u32(&state, &user_id) == -1 ||
+                    frame_get_u8(&state, &binary) == -1 ||
+                    frame_get_u8(&state, &follower) == -1 ||
+                    frame_get_u8(&state, &subscribed) == -1 ||
+                    frame_get_u64(&state, &log_offset) == -1 ||
+                    frame_get_u64(&state, &connected_us) == -1 ||
+                    frame_get_u64(&state, &last_read_us) == -1 ||
+                    get_bucket(&state, &bucket) == -1 ||
+                    frame_get_u64(&state, &throttled_until) == -1 ||
+                    frame_get_u32(&state, &inbuf) == -1 ||
+                    inbuf > (binary ? FRAME_BUF_SIZE : BUF_SIZE) ||
+                    (bytes = frame_get_bytes(&state, inbuf)) == NULL ||
+                    frame_get_u32(&state, &out_len) == -1 ||
+                    (out = frame_get_bytes(&state, out_len)) == NULL ||
+                    index == NO_FD;
+        if (malformed) {
+            break;
+        }
+
+        Client *client = init_client(passed_fd(index, fds, num_fds));
+        client->session_id = session_id;
+        client->follower = follower;
+        client->subscribed = subscribed;
+        client->log_offset = log_offset;
+        client->connected_us = connected_us;
+        client->last_read_us = last_read_us;
+        client->bucket.tokens = bucket.tokens;
+        client->bucket.last_us = bucket.last_us;
+        client->throttled_until = throttled_until;  // Its held back lines are run then
+        client->resume_due = throttled_until == 0 && inbuf > 0;  // As they may have waited on a render
+        if (binary) {
+            client->binary = 1;
+            client->buf = mem_realloc(MEM_SESSIONS, client->buf, FRAME_BUF_SIZE);
+        }
+        memcpy(client->buf, bytes, inbuf);
+        client->inbuf = inbuf;
+        client->room = (binary ? FRAME_BUF_SIZE : BUF_SIZE) - inbuf;
+        client->after = client->buf + inbuf;
+
+        Buffer *unsent = buffer_new(out, out_len);
+        send_buffer(client, unsent);
+        buffer_unref(unsent);
+        capture_connect(client->session_id);
+        update_timer(client);
+        if (user_id != NO_USER) {
+            log_in_as(client, user_id);
+        }
+
+        if (tail == NULL) {
+            *first_client = client;
+        } else {
+            tail->next = client;
+        }
+        tail = client;
+    }
+
+    uint32_t num_channels = 0;
+    malformed |= frame_get_u32(&state, &num_channels) == -1;
+    for (uint32_t i = 0; i < num_channels && !malformed; i++) {
+        char *name = frame_get_str(&state, MEM_PARSE);
+        uint32_t num_subscribers;
+        malformed = name == NULL || frame_get_u32(&state, &num_subscribers) == -1;
+        for (uint32_t j = 0; j < num_subscribers && !malformed; j++) {
+            uint32_t id;
+            malformed = frame_get_u32(&state, &id) == -1 || channel_join(name, id) == 2;
+        }
+        mem_free(MEM_PARSE, name);
+    }
+    if (malformed) {
+        fprintf(stderr, "server: malformed handoff\n");
+        exit(1);
+    }
+    presence_each_change(NULL, NULL);  // Their friends already know they're online
+
+    handoff_release(data, len);
+    free(fds);
+}
+
+
+int main(int argc, char *argv[]) {
+#ifdef TRACE
+    // SIGUSR1 asks for the trace to be written out
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_trace;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR1, &action, NULL) == -1) {
+        perror("server: sigaction");
+        exit(1);
+    }
+#endif
 
-    int max_fd = sock_fd;
-    fd_set all_fds;
-    FD_ZERO(&all_fds);
-    FD_SET(sock_fd, &all_fds);
+    int port = PORT;
+    const char *archive_path = NULL;
+    const char *followers_path = NULL;
+    const char *handoff_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:c:f:H:m:p:r:z")) != -1) {
+        switch (opt) {
+            case 'c':
+                // Record every session's input so it can be replayed by friend_replay
+                if (capture_open(optarg) == -1) {
+                    perror("server: capture");
+                    exit(1);
+                }
+                break;
+            case 'a':
+                // Move old posts out of memory into this file (see retention.h)
+                archive_path = optarg;
+                break;
+            case 'p': {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || value < 1 || value > 65535) {
+                    fprintf(stderr, "%s: the port must be a number from 1 to 65535\n", argv[0]);
+                    exit(1);
+                }
+                port = value;
+                break;
+            }
+            case 'r':
+                // Be a primary: log changes for followers, which connect here (see repl.h)
+                followers_path = optarg;
+                break;
+            case 'f':
+                // Be a read-only follower of the primary whose replication socket this is
+                primary_path = optarg;
+                break;
+            case 'H':
+                // Take over from the server listening here, if any, and listen
+                // here for a server to hand over to (see handoff.h)
+                handoff_path = optarg;
+                break;
+            case 'm':
+                // Log memory use every this many seconds, or never if 0
+                memstats_interval_us = strtoull(optarg, NULL, 10) * 1000000;
+                break;
+            case 'z':
+                // Compress posts' text (see poststore.h)
+                store_enable();
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-a archive_file] [-c capture_file] [-p port] "
+                        "[-r replication_socket | -f primary_replication_socket] "
+                        "[-H handoff_socket] [-m memstats_seconds] [-z]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (followers_path != NULL && primary_path != NULL) {
+        fprintf(stderr, "%s: a server can't be both a primary and a follower\n", argv[0]);
+        exit(1);
+    }
 
     Client *first_client = NULL; // serves as a constant head to the head of the linked list of clients
     User *user_list = NULL;
+    int reads_paused = 0;
+    wheel_init(&timers, capture_now_us());
+
+    // When taking over, everything the other options would set up comes from the old server
+    int sock_fd = -1;
+    int followers_fd = -1;
+    int handoff_fd = -1;
+    int handoff_conn = handoff_path == NULL ? -1 : handoff_connect(handoff_path);
+    if (handoff_conn != -1) {
+        take_over(handoff_conn, &sock_fd, &followers_fd, &handoff_fd, &first_client, &user_list);
+    } else {
+        sock_fd = listen_clients(port);
+        if (archive_path != NULL && archive_open(archive_path) == -1) {
+            perror("server: archive");
+            exit(1);
+        }
+        if (followers_path != NULL) {
+            if (repl_log_open() == -1) {
+                perror("server: replication log");
+                exit(1);
+            }
+            followers_fd = listen_followers(followers_path);
+        }
+        if (handoff_path != NULL) {
+            handoff_fd = handoff_listen(handoff_path);
+        }
+    }
+    if (repl_log_is_open()) {
+        retention_archived = log_archived;
+    }
+
+    int max_fd = sock_fd > followers_fd ? sock_fd : followers_fd;
+    if (handoff_fd > max_fd) {
+        max_fd = handoff_fd;
+    }
+    for (Client *curr = first_client; curr != NULL; curr = curr->next) {
+        if (curr->sock_fd > max_fd) {
+            max_fd = curr->sock_fd;
+        }
+    }
+
+    if (archive_is_open() && primary_path == NULL) {
+        // Followers archive posts when the primary does
+        timer_init(&retention_timer, run_retention);
+        wheel_schedule(&timers, &retention_timer, capture_now_us() + RETENTION_INTERVAL_US);
+    }
+    if (repl_log_is_open()) {
+        timer_init(&heartbeat_timer, heartbeat);
+        wheel_schedule(&timers, &heartbeat_timer, capture_now_us() + REPL_HEARTBEAT_US);
+    }
+    timer_init(&presence_timer, presence_batch_due);
+    if (memstats_interval_us > 0) {
+        timer_init(&memstats_timer, log_memstats);
+        wheel_schedule(&timers, &memstats_timer, capture_now_us() + memstats_interval_us);
+    }
+    worker_start();
+    if (worker_fd() > max_fd) {
+        max_fd = worker_fd();
+    }
+    if (primary_path != NULL) {
+        timer_init(&reconnect_timer, reconnect_primary);
+        if (primary_fd == -1) {
+            reconnect_primary(&reconnect_timer);
+        }
+    }
     while (1) {
-        // select updates the fd_set it receives, so we always use a copy and retain the original.
-        fd_set listen_fds = all_fds;
-        if (select(max_fd + 1, &listen_fds, NULL, NULL, NULL) == -1) {
+        // Admission control, with hysteresis so reads don't flap on and off
+        if (total_out_bytes > OUTPUT_HIGH_WATER || command_backlog > BACKLOG_HIGH_WATER) {
+            reads_paused = 1;
+        } else if (total_out_bytes < OUTPUT_HIGH_WATER / 2 && command_backlog < BACKLOG_HIGH_WATER / 2) {
+            reads_paused = 0;
+        }
+
+        // Only read from clients that may run commands right now; everyone
+        // else's input backs up in the kernel until TCP pushes back on them.
+        // Only ask about writability for clients with queued output.
+        uint64_t now_us = capture_now_us();
+        uint64_t wake_us = 0;  // Earliest time a throttled client can continue
+        fd_set listen_fds, write_fds;
+        FD_ZERO(&listen_fds);
+        FD_ZERO(&write_fds);
+        FD_SET(sock_fd, &listen_fds);
+        if (followers_fd != -1) {
+            FD_SET(followers_fd, &listen_fds);
+        }
+        if (handoff_fd != -1) {
+            FD_SET(handoff_fd, &listen_fds);
+        }
+        FD_SET(worker_fd(), &listen_fds);
+        if (primary_fd != -1) {
+            FD_SET(primary_fd, &listen_fds);
+            if (primary_fd > max_fd) {
+                max_fd = primary_fd;
+            }
+        }
+        for (Client *curr = first_client; curr != NULL; curr = curr->next) {
+            if (curr->awaiting_render) {
+                // Nothing more is read until the worker's reply has gone
+            } else if (curr->resume_due) {
+                wake_us = now_us;  // Its lines are run before anything more is read
+            } else if (curr->throttled_until != 0) {
+                if (wake_us == 0 || curr->throttled_until < wake_us) {
+                    wake_us = curr->throttled_until;
+                }
+            } else if (!reads_paused && curr->out_bytes < CLIENT_OUTPUT_LIMIT) {
+                FD_SET(curr->sock_fd, &listen_fds);
+            }
+            if (!FD_ISSET(curr->sock_fd, &listen_fds)) {
+                // We aren't reading from it, so it can't be idle: its idle
+                // timeout only counts time we've been listening to it
+                curr->last_read_us = now_us;
+            }
+            if (curr->out_head != NULL) {
+                FD_SET(curr->sock_fd, &write_fds);
+            }
+        }
+
+        // Wake up for whichever comes first: a throttled client, or a timer,
+        // unless there are publishes still to queue
+        uint64_t wait_us = deliveries_head != NULL ? 0 : wheel_timeout_us(&timers, now_us);
+        if (wake_us != 0 && (wake_us <= now_us || wake_us - now_us < wait_us)) {
+            wait_us = wake_us > now_us ? wake_us - now_us : 0;
+        }
+        struct timeval timeout;
+        struct timeval *timeout_ptr = NULL;
+        if (wait_us != UINT64_MAX) {
+            timeout.tv_sec = wait_us / 1000000;
+            timeout.tv_usec = wait_us % 1000000;
+            timeout_ptr = &timeout;
+        }
+
+#ifdef TRACE
+        if (trace_requested) {
+            trace_requested = 0;
+            dump_trace(NULL);
+        }
+#endif
+
+        TRACE_BEGIN("select");
+        int ready = select(max_fd + 1, &listen_fds, &write_fds, NULL, timeout_ptr);
+        TRACE_END("select");
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("server: select");
             exit(1);
         }
 
+        // A replacement has started: hand it everything, and exit
+        if (handoff_fd != -1 && FD_ISSET(handoff_fd, &listen_fds)) {
+            int conn = accept(handoff_fd, NULL, NULL);
+            if (conn != -1) {
+                hand_off(conn, sock_fd, followers_fd, handoff_fd, first_client, user_list);
+            }
+            continue;  // What select reported may be out of date by now
+        }
+
+        // Clients that time out are marked dead, and removed with the rest below
+        wheel_advance(&timers, capture_now_us());
+
+        // Send what the workers have rendered
+        if (FD_ISSET(worker_fd(), &listen_fds)) {
+            worker_collect();
+        }
+
         // Is it the original socket? Create a new connection ...
         if (FD_ISSET(sock_fd, &listen_fds)) {
             int client_fd = accept_connection(sock_fd, &first_client);
             if (client_fd > max_fd) {
                 max_fd = client_fd;
             }
-            FD_SET(client_fd, &all_fds);
-            write(client_fd, WELCOME_MSG, strlen(WELCOME_MSG));
+
+            Client *new_client = first_client;
+            while (new_client->sock_fd != client_fd) {
+                new_client = new_client->next;
+            }
+            send_text(new_client, WELCOME_MSG);
+        }
+
+        // ... or a new follower
+        if (followers_fd != -1 && FD_ISSET(followers_fd, &listen_fds)) {
+            int client_fd = accept_connection(followers_fd, &first_client);
+            if (client_fd > max_fd) {
+                max_fd = client_fd;
+            }
+            for (Client *curr = first_client; curr != NULL; curr = curr->next) {
+                if (curr->sock_fd == client_fd) {
+                    curr->follower = 1;
+                }
+            }
+        }
+
+        // Followers apply the primary's changes before running commands
+        if (primary_fd != -1 && FD_ISSET(primary_fd, &listen_fds) &&
+            read_primary(first_client, &user_list) == -1) {
+            close(primary_fd);
+            primary_fd = -1;
+            reconnect_primary(&reconnect_timer);
         }
 
         Client *curr_client = first_client;
         while (curr_client != NULL) {
-            // Check whether or not socket is ready for reading + writing
-            if (FD_ISSET(curr_client->sock_fd, &listen_fds)) {
-                int client_fd = read_from(curr_client, first_client, &user_list);
-                if (client_fd > 0) {
-                    remove_client(curr_client, &first_client);
-                    FD_CLR(client_fd, &all_fds);
-                }
-                else {
-                    write(curr_client->sock_fd, "Go ahead and type in commands>\r\n", strlen("Go ahead and type in commands>\r\n"));
+            Client *next_client = curr_client->next; // curr_client may be freed below
+
+            int client_fd = -1;
+            if (curr_client->dead || curr_client->awaiting_render) {
+                // nothing to do until it is swept up below, or the worker is done
+            } else if (curr_client->resume_due && curr_client->binary) {
+                client_fd = run_frames(curr_client, first_client, &user_list, capture_now_us());
+            } else if (curr_client->resume_due) {
+                client_fd = run_lines(curr_client, first_client, &user_list, capture_now_us());
+            } else if (curr_client->throttled_until != 0) {
+                // Run lines held back by rate limiting once enough tokens have built up
+                uint64_t now_us = capture_now_us();
+                if (now_us >= curr_client->throttled_until && curr_client->binary) {
+                    client_fd = run_frames(curr_client, first_client, &user_list, now_us);
+                } else if (now_us >= curr_client->throttled_until) {
+                    client_fd = run_lines(curr_client, first_client, &user_list, now_us);
                 }
+            } else if (FD_ISSET(curr_client->sock_fd, &listen_fds) && curr_client->follower) {
+                client_fd = read_subscription(curr_client);
+            } else if (FD_ISSET(curr_client->sock_fd, &listen_fds)) {
+                // Check whether or not socket is ready for reading
+                client_fd = read_from(curr_client, first_client, &user_list);
             }
-            curr_client = curr_client->next;
+
+            if (client_fd > 0) {
+                flush_client(curr_client);  // Anything said before it quit, e.g. by delete_user
+                curr_client->dead = 1;
+            } else if (client_fd == 0 && wants_prompt(curr_client)) {
+                send_text(curr_client, "Go ahead and type in commands>\r\n");
+                curr_client->prompt_due = 0;
+            }
+            curr_client = next_client;
+        }
+
+        deliver_publishes();
+        if (presence_due) {
+            presence_due = 0;
+            push_presence(first_client);
+        }
+
+        // Write out everything queued this pass. Clients can be marked dead by
+        // any write, so sweep them up once per iteration.
+        curr_client = first_client;
+        while (curr_client != NULL) {
+            Client *next_client = curr_client->next;
+            if (!curr_client->dead && curr_client->subscribed) {
+                ship_log(curr_client);
+            }
+            if (!curr_client->dead && curr_client->out_head != NULL) {
+                TRACE_BEGIN("write");
+                flush_client(curr_client);
+                TRACE_END("write");
+            }
+            if (curr_client->dead) {
+                remove_client(curr_client, &first_client);
+            }
+            curr_client = next_client;
+        }
+        heartbeat_due = 0;
+        if (presence_changed() && !timer_pending(&presence_timer)) {
+            // Logins and logouts from now until it fires go out together
+            wheel_schedule(&timers, &presence_timer, capture_now_us() + PRESENCE_BATCH_US);
         }
+        capture_flush();
+        epoch_reclaim();
     }
 
     // Should never get here
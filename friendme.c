@@ -1,11 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "friends.h"
+#include "memstats.h"
 
 #define INPUT_BUFFER_SIZE 256
 #define INPUT_ARG_MAX_NUM 12
-#define DELIM " \n"
+#define DELIM " \r\n"
+#define OUTPUT_BUFFER_SIZE (1 << 20)  // stdout buffer size in batch mode
+
+static int bulk_load = 0;        // Trust the input to have no duplicate users
+static User *last_user = NULL;   // Tail of the user list, for bulk loading
 
 
 /* 
@@ -23,13 +32,16 @@ void error(char *msg) {
 
 int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
     User *user_list = *user_list_ptr;
+    char *buf;
 
     if (cmd_argc <= 0) {
         return 0;
     } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
         return -1;
     } else if (strcmp(cmd_argv[0], "add_user") == 0 && cmd_argc == 2) {
-        switch (create_user(cmd_argv[1], user_list_ptr)) {
+        int result = bulk_load ? create_user_bulk(cmd_argv[1], user_list_ptr, &last_user)
+                               : create_user(cmd_argv[1], user_list_ptr);
+        switch (result) {
             case 1:
                 error("user by this name already exists");
                 break;
@@ -41,7 +53,7 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
     } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 1) {
         buf = list_users(user_list);
         printf("%s",buf);
-        free(buf);
+        mem_free(MEM_RESPONSES, buf);
 
     } else if (strcmp(cmd_argv[0], "make_friends") == 0 && cmd_argc == 3) {
         switch (make_friends(cmd_argv[1], cmd_argv[2], user_list)) {
@@ -66,11 +78,7 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
         }
 
         // allocate the space
-        char *contents = malloc(space_needed);
-        if (contents == NULL) {
-            perror("malloc");
-            exit(1);
-        }
+        char *contents = mem_alloc(MEM_POSTS, space_needed);
 
         // copy in the bits to make a single string
         strcpy(contents, cmd_argv[3]);
@@ -84,9 +92,11 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
         switch (make_post(author, target, contents)) {
             case 1:
                 error("the users are not friends");
+                mem_free(MEM_POSTS, contents);
                 break;
             case 2:
                 error("at least one user you entered does not exist");
+                mem_free(MEM_POSTS, contents);
                 break;
         }
     } else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
@@ -96,7 +106,7 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
             error("user not found");
         } else {
             printf("%s\n", buf);
-            free(buf);
+            mem_free(MEM_RESPONSES, buf);
         }
     } else {
         error("Incorrect syntax");
@@ -106,14 +116,14 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
 
 
 /*
- * Tokenize the string stored in cmd.
+ * Tokenize the string stored in cmd into at most max_args - 1 tokens.
  * Return the number of tokens, and store the tokens in cmd_argv.
  */
-int tokenize(char *cmd, char **cmd_argv) {
+int tokenize(char *cmd, char **cmd_argv, int max_args) {
     int cmd_argc = 0;
     char *next_token = strtok(cmd, DELIM);    
     while (next_token != NULL) {
-        if (cmd_argc >= INPUT_ARG_MAX_NUM - 1) {
+        if (cmd_argc >= max_args - 1) {
             error("Too many arguments!");
             cmd_argc = 0;
             break;
@@ -127,46 +137,166 @@ int tokenize(char *cmd, char **cmd_argv) {
 }
 
 
-int main(int argc, char* argv[]) {
-    // int size = 25;
-    // char *buf = malloc(size);
-    // // int ret = snprintf(buf, size, "hello");
-    // strncat(buf, "hello", strlen("hello") + 1);
-    // printf("%s\nReturn value is \n", buf);
-    // strncat(buf, "the", strlen("the") + 1);
-    // // int ret2 = snprintf(buf + strlen("hello"), size, "the");
-    // printf("%s\nReturn value is \n", buf);
+/*
+ * Load the whole file at path into memory, mapping it if possible and
+ * falling back to large buffered reads (e.g. for a pipe). Set *size to its
+ * size and *mapped to whether it was mapped. Return NULL on error.
+ */
+char *load_input(const char *path, size_t *size, int *mapped) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        return NULL;
+    }
 
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        char *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            *size = info.st_size;
+            *mapped = 1;
+            return data;
+        }
+    }
+
+    size_t capacity = OUTPUT_BUFFER_SIZE;
+    char *data = Malloc(capacity);
+    *size = 0;
+    ssize_t num_read;
+    while ((num_read = read(fd, data + *size, capacity - *size)) > 0) {
+        *size += num_read;
+        if (*size == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+            if (data == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+    }
+    close(fd);
+    if (num_read < 0) {
+        perror("read");
+        free(data);
+        return NULL;
+    }
+    *mapped = 0;
+    return data;
+}
 
-    int batch_mode = (argc == 2);
-    char input[INPUT_BUFFER_SIZE];
-    FILE *input_stream;
+
+/*
+ * Run every command in the first size bytes of data, echoing each line
+ * unless quiet is set. Lines are copied into a buffer that grows as needed,
+ * so unlike interactive input they have no length or argument limit.
+ * Return -1 if a quit command was run, 0 otherwise.
+ */
+int run_batch(const char *data, size_t size, int quiet, User **user_list_ptr) {
+    size_t line_capacity = INPUT_BUFFER_SIZE;
+    char *line = Malloc(line_capacity);
+    int argv_capacity = INPUT_ARG_MAX_NUM;
+    char **cmd_argv = Malloc(sizeof(char *) * argv_capacity);
+    int result = 0;
+
+    const char *curr = data;
+    const char *end = data + size;
+    while (curr < end && result == 0) {
+        const char *newline = memchr(curr, '\n', end - curr);
+        size_t len = (newline == NULL ? end : newline) - curr;
+
+        if (len + 1 > line_capacity) {
+            line_capacity = 2 * (len + 1);
+            free(line);
+            line = Malloc(line_capacity);
+        }
+        memcpy(line, curr, len);
+        curr += len + 1;
+        if (len > 0 && line[len - 1] == '\r') {
+            len--;  // A CRLF line ending; the \r isn't part of the command
+        }
+        line[len] = '\0';
+
+        if (!quiet) {
+            printf("%s\n", line);
+        }
+
+        // A line can't have more tokens than one plus its number of spaces
+        int max_args = 2;
+        for (size_t i = 0; i < len; i++) {
+            max_args += (line[i] == ' ');
+        }
+        if (max_args > argv_capacity) {
+            argv_capacity = 2 * max_args;
+            free(cmd_argv);
+            cmd_argv = Malloc(sizeof(char *) * argv_capacity);
+        }
+
+        int cmd_argc = tokenize(line, cmd_argv, max_args);
+        if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, user_list_ptr) == -1) {
+            result = -1; // can only reach if quit command was entered
+        } else if (!quiet) {
+            printf("> ");
+        }
+    }
+
+    free(line);
+    free(cmd_argv);
+    return result;
+}
+
+
+int main(int argc, char* argv[]) {
+    int quiet = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "qb")) != -1) {
+        switch (opt) {
+            case 'q':
+                quiet = 1;
+                break;
+            case 'b':
+                bulk_load = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-q] [-b] [command_file]\n", argv[0]);
+                exit(1);
+        }
+    }
 
     // Create the heads of the empty data structure
     User *user_list = NULL;
 
-    if (batch_mode) {
-        input_stream = fopen(argv[1], "r");
-        if (input_stream == NULL) {
-            perror("Error opening file");
+    if (optind < argc) {
+        // batch mode: load the whole file and buffer all output
+        size_t size;
+        int mapped;
+        char *data = load_input(argv[optind], &size, &mapped);
+        if (data == NULL) {
             exit(1);
         }
-    } else {
-        // interactive mode 
-        input_stream = stdin;
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+        if (!quiet) {
+            printf("Welcome to FriendMe! (Local version)\nPlease type a command:\n> ");
+        }
+        run_batch(data, size, quiet, &user_list);
+
+        if (mapped) {
+            munmap(data, size);
+        } else {
+            free(data);
+        }
+        return 0;
     }
 
+    // interactive mode
+    char input[INPUT_BUFFER_SIZE];
     printf("Welcome to FriendMe! (Local version)\nPlease type a command:\n> ");
     
-    while (fgets(input, INPUT_BUFFER_SIZE, input_stream) != NULL) {
-        // only echo the line in batch mode since in interactive mode the user
-        // just typed the line
-        if (batch_mode) {
-            printf("%s", input);
-        }
-
+    while (fgets(input, INPUT_BUFFER_SIZE, stdin) != NULL) {
         char *cmd_argv[INPUT_ARG_MAX_NUM];
-        int cmd_argc = tokenize(input, cmd_argv);
+        int cmd_argc = tokenize(input, cmd_argv, INPUT_ARG_MAX_NUM);
 
         if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, &user_list) == -1) {
             break; // can only reach if quit command was entered
@@ -175,9 +305,5 @@ int main(int argc, char* argv[]) {
         printf("> ");
     }
 
-    if (batch_mode) {
-        fclose(input_stream);
-    }
-
     return 0;
  }
@@ -1,10 +1,32 @@
 #include "friends.h"
+#include "timefmt.h"
+#include "poststore.h"
+#include "memstats.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define TEXT_SEPR "------------------------------------------\r\n"
 #define NEWLINE_CHAR "\r\n" // can be changed to \n if we want
+#define DELETED_NAME "(deleted user)"  // Shown as the author of a removed user's posts
+#define SEPARATOR_LENGTH (strlen("===") + 3 * strlen(NEWLINE_CHAR))  // Between two posts
+
+unsigned long users_version = 0;
+
+// user_table[id] is the user with that ID. Slot 0 (NO_USER) is never used.
+static User **user_table = NULL;
+static UserId table_size = 1;
+static UserId table_capacity = 0;
+
+// The last user of the list whose head is at tail_head, so users can be
+// appended to it without walking it
+static User **tail_head = NULL;
+static User *tail_user = NULL;
+
+// Open addressing (linear probing) hash table of every user, keyed by name.
+static User **name_index = NULL;
+static size_t index_capacity = 0;  // Always a power of two
+static size_t index_count = 0;
 
 void *Malloc(size_t num_bytes){
 	void *ret = malloc(num_bytes);
@@ -15,6 +37,155 @@ void *Malloc(size_t num_bytes){
 	return ret;
 }
 
+/* FNV-1a hash of a user name. */
+static size_t hash_name(const char *name) {
+    size_t hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Return the user called name, or NULL if there is none. */
+static User *index_lookup(const char *name) {
+    if (index_capacity == 0) {
+        return NULL;
+    }
+    size_t slot = hash_name(name) & (index_capacity - 1);
+    while (name_index[slot] != NULL) {
+        if (strcmp(name_index[slot]->name, name) == 0) {
+            return name_index[slot];
+        }
+        slot = (slot + 1) & (index_capacity - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Take user out of the name index. Later entries of the same probe run are
+ * shifted back into the gap, so lookups never have to step over tombstones.
+ */
+static void index_remove(const User *user) {
+    size_t mask = index_capacity - 1;
+    size_t gap = hash_name(user->name) & mask;
+    while (name_index[gap] != user) {
+        gap = (gap + 1) & mask;
+    }
+
+    for (size_t slot = (gap + 1) & mask; name_index[slot] != NULL; slot = (slot + 1) & mask) {
+        // An entry can fill the gap if the gap lies between its home slot and
+        // where it is now (cyclically), so it stays reachable from its home
+        size_t home = hash_name(name_index[slot]->name) & mask;
+        if (((slot - home) & mask) >= ((slot - gap) & mask)) {
+            name_index[gap] = name_index[slot];
+            gap = slot;
+        }
+    }
+    name_index[gap] = NULL;
+    index_count--;
+}
+
+/* Add user to the name index, growing it to keep the load factor under 1/2. */
+static void index_insert(User *user) {
+    if (2 * (index_count + 1) > index_capacity) {
+        size_t old_capacity = index_capacity;
+        User **old_index = name_index;
+
+        index_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+        name_index = mem_alloc(MEM_USERS, sizeof(User *) * index_capacity);
+        memset(name_index, 0, sizeof(User *) * index_capacity);
+        index_count = 0;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_index[i] != NULL) {
+                index_insert(old_index[i]);
+            }
+        }
+        mem_free(MEM_USERS, old_index);
+    }
+
+    size_t slot = hash_name(user->name) & (index_capacity - 1);
+    while (name_index[slot] != NULL) {
+        slot = (slot + 1) & (index_capacity - 1);
+    }
+    name_index[slot] = user;
+    index_count++;
+}
+
+
+/* Make room in user_table for IDs below limit, leaving any new slots empty. */
+static void grow_table(UserId limit) {
+    if (limit > table_capacity) {
+        UserId new_capacity = table_capacity == 0 ? 64 : table_capacity;
+        while (new_capacity < limit) {
+            new_capacity *= 2;
+        }
+        user_table = mem_realloc(MEM_USERS, user_table, sizeof(User *) * new_capacity);
+        user_table[NO_USER] = NULL;
+        table_capacity = new_capacity;
+    }
+    while (table_size < limit) {
+        user_table[table_size++] = NULL;
+    }
+}
+
+/*
+ * Allocate a user called name, give it ID id (no lower than any ID handed
+ * out before) and add it to the name index. The caller links it into the
+ * user list.
+ */
+static User *new_user_with_id(const char *name, UserId id) {
+    User *new_user = mem_alloc(MEM_USERS, sizeof(User));
+    // The friend list is counted as friendships' rather than the user's
+    mem_charge(MEM_USERS, -(long) sizeof(new_user->friends), 0);
+    mem_charge(MEM_FRIENDSHIPS, sizeof(new_user->friends), 0);
+    strncpy(new_user->name, name, MAX_NAME); // name has max length MAX_NAME - 1
+
+    for (int i = 0; i < MAX_NAME; i++) {
+        new_user->profile_pic[i] = '\0';
+    }
+
+    new_user->first_post = NULL;
+    new_user->last_post = NULL;
+    new_user->num_posts = 0;
+    new_user->archive_head = 0;
+    new_user->num_archived = 0;
+    new_user->history_index = NULL;
+    new_user->next = NULL;
+    new_user->version = 0;
+    for (int i = 0; i < MAX_FRIENDS; i++) {
+        new_user->friends[i] = NO_USER;
+    }
+
+    grow_table(id + 1);
+    new_user->id = id;
+    user_table[id] = new_user;
+
+    index_insert(new_user);
+    users_version++;
+    return new_user;
+}
+
+
+/* Append new_user to the list whose head is at user_ptr_add. */
+static void append_user(User **user_ptr_add, User *new_user) {
+    if (tail_head != user_ptr_add) {
+        // A list not appended to before: find its end, just this once
+        tail_head = user_ptr_add;
+        tail_user = *user_ptr_add;
+        while (tail_user != NULL && tail_user->next != NULL) {
+            tail_user = tail_user->next;
+        }
+    }
+    if (tail_user == NULL) {
+        *user_ptr_add = new_user;
+    } else {
+        tail_user->next = new_user;
+    }
+    tail_user = new_user;
+}
+
+
 /*
  * Create a new user with the given name.  Insert it at the tail of the list
  * of users whose head is pointed to by *user_ptr_add.
@@ -29,42 +200,65 @@ int create_user(const char *name, User **user_ptr_add) {
     if (strlen(name) >= MAX_NAME) {
         return 2;
     }
-
-    User *new_user = malloc(sizeof(User));
-    if (new_user == NULL) {
-        perror("malloc");
-        exit(1);
+    if (index_lookup(name) != NULL) {
+        return 1;
     }
-    strncpy(new_user->name, name, MAX_NAME); // name has max length MAX_NAME - 1
 
-    for (int i = 0; i < MAX_NAME; i++) {
-        new_user->profile_pic[i] = '\0';
-    }
+    append_user(user_ptr_add, new_user_with_id(name, table_size));
+    return 0;
+}
 
-    new_user->first_post = NULL;
-    new_user->next = NULL;
-    for (int i = 0; i < MAX_FRIENDS; i++) {
-        new_user->friends[i] = NULL;
-    }
 
-    // Add user to list
-    User *prev = NULL;
-    User *curr = *user_ptr_add;
-    while (curr != NULL && strcmp(curr->name, name) != 0) {
-        prev = curr;
-        curr = curr->next;
+/*
+ * Bulk-load version of create_user for input known to hold no duplicates.
+ */
+int create_user_bulk(const char *name, User **user_ptr_add, User **tail) {
+    if (strlen(name) >= MAX_NAME) {
+        return 2;
     }
 
-    if (*user_ptr_add == NULL) {
-        *user_ptr_add = new_user;
-        return 0;
-    } else if (curr != NULL) {
-        free(new_user);
-        return 1;
-    } else {
-        prev->next = new_user;
-        return 0;
+    *tail = new_user_with_id(name, table_size);
+    append_user(user_ptr_add, *tail);
+    return 0;
+}
+
+
+User *restore_user(UserId id, const char *name, User **user_ptr_add, User **tail) {
+    *tail = new_user_with_id(name, id);
+    append_user(user_ptr_add, *tail);
+    return *tail;
+}
+
+
+void reserve_user_ids(UserId limit) {
+    grow_table(limit);
+}
+
+
+/*
+ * Return a pointer to the user with this ID, or NULL if no such user exists.
+ */
+User *user_by_id(UserId id) {
+    if (id == NO_USER || id >= table_size) {
+        return NULL;
     }
+    return user_table[id];
+}
+
+
+UserId user_id_limit(void) {
+    return table_size;
+}
+
+
+size_t user_count(void) {
+    return index_count;  // Every user is in the index, until removed
+}
+
+
+const char *user_name(UserId id) {
+    User *user = user_by_id(id);
+    return user == NULL ? DELETED_NAME : user->name;
 }
 
 
@@ -76,11 +270,10 @@ int create_user(const char *name, User **user_ptr_add) {
  * to satisfy the prototype without warnings.
  */
 User *find_user(const char *name, const User *head) {
-    while (head != NULL && strcmp(name, head->name) != 0) {
-        head = head->next;
+    if (head == NULL) {
+        return NULL;
     }
-
-    return (User *)head;
+    return index_lookup(name);
 }
 
 
@@ -89,28 +282,10 @@ User *find_user(const char *name, const User *head) {
  * Names should be printed to standard output, one per line.
  */
 char *list_users(const User *curr) {
-    char *header = "User List";
-    int num_chars = strlen(header) + strlen(NEWLINE_CHAR);
-
-    User *curr_user = (User *) curr;
-    while (curr_user != NULL){
-        num_chars += strlen(curr_user->name) + strlen(NEWLINE_CHAR) + 1; // +1 for tab
-        curr_user = curr_user->next;
-    }
-
-    char *user_list = Malloc(sizeof(char) * (num_chars + 1)); // extra character for null character
-    memset(user_list, '\0', num_chars + 1); // fill array with null characters
-
-    strncat(user_list, header, strlen(header) + 1);
-    strncat(user_list, NEWLINE_CHAR, strlen(NEWLINE_CHAR) + 1);
-    curr_user = (User *) curr;
-    while (curr_user != NULL){
-        strncat(user_list, "\t", 2);
-        strncat(user_list, curr_user->name, strlen(curr_user->name));
-        strncat(user_list, NEWLINE_CHAR, strlen(NEWLINE_CHAR) + 1);
-        curr_user = curr_user->next;
-    }
-
+    UserListView view;
+    view_users(curr, &view);
+    char *user_list = print_user_list_view(&view);
+    free_user_list_view(&view);
     return user_list;
 }
 
@@ -133,9 +308,14 @@ char *list_users(const User *curr) {
  * NOTE: If multiple errors apply, return the *largest* error code that applies.
  */
 int make_friends(const char *name1, const char *name2, User *head) {
-    User *user1 = find_user(name1, head);
-    User *user2 = find_user(name2, head);
+    return make_friends_users(find_user(name1, head), find_user(name2, head));
+}
+
 
+/*
+ * Same as make_friends, but for users that have already been looked up.
+ */
+int make_friends_users(User *user1, User *user2) {
     if (user1 == NULL || user2 == NULL) {
         return 4;
     } else if (user1 == user2) { // Same user
@@ -144,15 +324,15 @@ int make_friends(const char *name1, const char *name2, User *head) {
 
     int i, j;
     for (i = 0; i < MAX_FRIENDS; i++) {
-        if (user1->friends[i] == NULL) { // Empty spot
+        if (user1->friends[i] == NO_USER) { // Empty spot
             break;
-        } else if (user1->friends[i] == user2) { // Already friends.
+        } else if (user1->friends[i] == user2->id) { // Already friends.
             return 1;
         }
     }
 
     for (j = 0; j < MAX_FRIENDS; j++) {
-        if (user2->friends[j] == NULL) { // Empty spot
+        if (user2->friends[j] == NO_USER) { // Empty spot
             break;
         }
     }
@@ -161,12 +341,152 @@ int make_friends(const char *name1, const char *name2, User *head) {
         return 2;
     }
 
-    user1->friends[i] = user2;
-    user2->friends[j] = user1;
+    user1->friends[i] = user2->id;
+    user2->friends[j] = user1->id;
+    mem_charge(MEM_FRIENDSHIPS, 0, 1);
+    user1->version++;
+    user2->version++;
+    return 0;
+}
+
+
+/* Remove the ID friend_id from user's friends, keeping the rest packed at the front in order. */
+static void remove_friend(User *user, UserId friend_id) {
+    int i = 0;
+    while (i < MAX_FRIENDS && user->friends[i] != friend_id) {
+        i++;
+    }
+    for (; i < MAX_FRIENDS; i++) {
+        user->friends[i] = i + 1 < MAX_FRIENDS ? user->friends[i + 1] : NO_USER;
+    }
+    user->version++;
+}
+
+
+/*
+ * End the friendship between two users.
+ *
+ * Return:
+ *   - 0 on success.
+ *   - 1 if the two users are not friends.
+ *   - 3 if the same user is passed in twice.
+ *   - 4 if at least one user does not exist.
+ */
+int unfriend(User *user1, User *user2) {
+    if (user1 == NULL || user2 == NULL) {
+        return 4;
+    } else if (user1 == user2) {
+        return 3;
+    }
+
+    int friends = 0;
+    for (int i = 0; i < MAX_FRIENDS && user1->friends[i] != NO_USER; i++) {
+        if (user1->friends[i] == user2->id) {
+            friends = 1;
+            break;
+        }
+    }
+    if (friends == 0) {
+        return 1;
+    }
+
+    remove_friend(user1, user2->id);
+    remove_friend(user2, user1->id);
+    mem_charge(MEM_FRIENDSHIPS, 0, -1);
     return 0;
 }
 
 
+/*
+ * Return the number of characters print_post produces for post, shown as
+ * being by the user called author, not counting the null character.
+ */
+static int post_length_as(const char *author, const Post *post) {
+    size_t contents_len = post->packed ? store_length(post->contents) : strlen(post->contents);
+    return strlen("From: ") + strlen(author) + strlen(NEWLINE_CHAR) +
+        strlen("Date: ") + DATE_STR_LEN + strlen(NEWLINE_CHAR) +
+        contents_len + strlen(NEWLINE_CHAR);
+}
+
+/* Return the number of characters print_post produces for post, not counting the null character. */
+static int post_length(const Post *post) {
+    return post_length_as(user_name(post->author), post);
+}
+
+/* Copy the null-terminated string src to dest and return the end of the copy. */
+static char *append(char *dest, const char *src) {
+    size_t len = strlen(src);
+    memcpy(dest, src, len);
+    return dest + len;
+}
+
+/*
+ * Write post, shown as being by the user called author, to dest, which
+ * must have room for post_length_as(author, post) + 1 characters. Packed
+ * text is unpacked straight into dest. Return a pointer to the null
+ * character at the end.
+ */
+static char *write_post_as(const char *author, const Post *post, char *dest) {
+    dest = append(dest, "From: ");
+    dest = append(dest, author);
+    dest = append(dest, NEWLINE_CHAR);
+    dest = append(dest, "Date: ");
+    dest += format_date(post->date, dest);
+    dest = append(dest, NEWLINE_CHAR);
+    dest = post->packed ? store_unpack(post->contents, dest) : append(dest, post->contents);
+    dest = append(dest, NEWLINE_CHAR);
+    *dest = '\0';
+    return dest;
+}
+
+/*
+ * Write post to dest, which must have room for post_length(post) + 1
+ * characters. Return a pointer to the null character at the end.
+ */
+static char *write_post(const Post *post, char *dest) {
+    return write_post_as(user_name(post->author), post, dest);
+}
+
+/* Write the separator that goes between two posts to dest, and return the end of it. */
+static char *write_separator(char *dest) {
+    dest = append(dest, NEWLINE_CHAR);
+    dest = append(dest, "===");
+    dest = append(dest, NEWLINE_CHAR);
+    return append(dest, NEWLINE_CHAR);
+}
+
+/*
+ * Return the number of characters write_posts produces for the list of
+ * posts starting at first, not counting the null character.
+ */
+static int posts_length(const Post *first) {
+    int num_chars = 0;
+    for (const Post *curr = first; curr != NULL; curr = curr->next) {
+        num_chars += post_length(curr);
+        if (curr->next != NULL) {
+            num_chars += SEPARATOR_LENGTH;
+        }
+    }
+    return num_chars;
+}
+
+/*
+ * Write the list of posts starting at first to dest, separated by "===".
+ * Return a pointer to the null character at the end.
+ */
+static char *write_posts(const Post *first, char *dest) {
+    *dest = '\0';
+    for (const Post *curr = first; curr != NULL; curr = curr->next) {
+        dest = write_post(curr, dest);
+        if (curr->next != NULL) {
+            dest = write_separator(dest);
+        }
+    }
+    *dest = '\0';
+    return dest;
+}
+
+
 /*
  *  Print a post.
  *  Use localtime to print the time and date.
@@ -178,21 +498,8 @@ char *print_post(const Post *post) {
         // return 1;
     }
 
-    int num_chars = strlen("From: ") + strlen(post->author) + strlen(NEWLINE_CHAR) + \
-    strlen("Date: ") + strlen(asctime(localtime(post->date))) + strlen(NEWLINE_CHAR) + \
-    strlen(post->contents) + strlen(NEWLINE_CHAR) + 1; // + 1 for null character at the end
-
-    char *post_str = Malloc(sizeof(char) * num_chars);
-    memset(post_str, '\0', num_chars);
-
-    snprintf(post_str, num_chars, "From: %s%sDate: %s%s%s%s", 
-        post->author, 
-        NEWLINE_CHAR,
-        asctime(localtime(post->date)), 
-        NEWLINE_CHAR,
-        post->contents,
-        NEWLINE_CHAR
-    );
+    char *post_str = mem_alloc(MEM_RESPONSES, sizeof(char) * (post_length(post) + 1)); // + 1 for null character at the end
+    write_post(post, post_str);
 
     return post_str;
 
@@ -209,6 +516,118 @@ char *print_post(const Post *post) {
 }
 
 
+void view_user(const User *user, UserView *view) {
+    view->name = user->name;
+    view->num_friends = 0;
+    while (view->num_friends < MAX_FRIENDS && user->friends[view->num_friends] != NO_USER) {
+        view->friends[view->num_friends] = user_name(user->friends[view->num_friends]);
+        view->num_friends++;
+    }
+
+    view->posts = mem_alloc(MEM_RESPONSES, sizeof(PostView) * (user->num_posts + 1));  // + 1 so it's never mem_alloc(0)
+    view->num_posts = 0;
+    for (const Post *post = user->first_post; post != NULL && view->num_posts < user->num_posts; post = post->next) {
+        PostView *post_view = &view->posts[view->num_posts++];
+        post_view->author = user_name(post->author);
+        post_view->post = post;
+    }
+    view->num_archived = user->num_archived;
+}
+
+
+char *print_user_view(const UserView *view) {
+    // Say how many older posts are in the archive, if any
+    char archived[64] = "";
+    if (view->num_archived > 0) {
+        snprintf(archived, sizeof(archived), "(%lu older posts archived)%s", view->num_archived, NEWLINE_CHAR);
+    }
+
+    // Name: name\n\n------\nFriends:\n<friends>------\nPosts:\n<posts><archived>------\n
+    size_t num_chars = strlen("Name: ") + strlen("Friends:") + strlen("Posts:") + 3 * strlen(TEXT_SEPR) +
+        4 * strlen(NEWLINE_CHAR) + strlen(view->name) + strlen(archived) + 1;  // + 1 for null character
+    for (int i = 0; i < view->num_friends; i++) {
+        num_chars += strlen(view->friends[i]) + strlen(NEWLINE_CHAR);
+    }
+    for (unsigned int i = 0; i < view->num_posts; i++) {
+        num_chars += post_length_as(view->posts[i].author, view->posts[i].post);
+        if (i + 1 < view->num_posts) {
+            num_chars += SEPARATOR_LENGTH;
+        }
+    }
+
+    char *user_str = mem_alloc(MEM_RESPONSES, num_chars);
+    char *end = append(user_str, "Name: ");
+    end = append(end, view->name);
+    end = append(end, NEWLINE_CHAR);
+    end = append(end, NEWLINE_CHAR);
+    end = append(end, TEXT_SEPR);
+    end = append(end, "Friends:");
+    end = append(end, NEWLINE_CHAR);
+    for (int i = 0; i < view->num_friends; i++) {
+        end = append(end, view->friends[i]);
+        end = append(end, NEWLINE_CHAR);
+    }
+    end = append(end, TEXT_SEPR);
+    end = append(end, "Posts:");
+    end = append(end, NEWLINE_CHAR);
+    for (unsigned int i = 0; i < view->num_posts; i++) {
+        end = write_post_as(view->posts[i].author, view->posts[i].post, end);
+        if (i + 1 < view->num_posts) {
+            end = write_separator(end);
+        }
+    }
+    end = append(end, archived);
+    strcpy(end, TEXT_SEPR);
+    return user_str;
+}
+
+
+void free_user_view(UserView *view) {
+    mem_free(MEM_RESPONSES, view->posts);
+    view->posts = NULL;
+}
+
+
+void view_users(const User *head, UserListView *view) {
+    size_t capacity = 64;
+    view->names = mem_alloc(MEM_RESPONSES, sizeof(const char *) * capacity);
+    view->num_users = 0;
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        if (view->num_users == capacity) {
+            capacity *= 2;
+            view->names = mem_realloc(MEM_RESPONSES, view->names, sizeof(const char *) * capacity);
+        }
+        view->names[view->num_users++] = curr->name;
+    }
+}
+
+
+char *print_user_list_view(const UserListView *view) {
+    const char *header = "User List";
+    size_t num_chars = strlen(header) + strlen(NEWLINE_CHAR) + 1;  // + 1 for null character
+    for (size_t i = 0; i < view->num_users; i++) {
+        num_chars += strlen(view->names[i]) + strlen(NEWLINE_CHAR) + 1;  // + 1 for tab
+    }
+
+    char *user_list = mem_alloc(MEM_RESPONSES, num_chars);
+    char *end = append(user_list, header);
+    end = append(end, NEWLINE_CHAR);
+    for (size_t i = 0; i < view->num_users; i++) {
+        end = append(end, "\t");
+        end = append(end, view->names[i]);
+        end = append(end, NEWLINE_CHAR);
+    }
+    *end = '\0';
+    return user_list;
+}
+
+
+void free_user_list_view(UserListView *view) {
+    mem_free(MEM_RESPONSES, view->names);
+    view->names = NULL;
+}
+
+
 /*
  * Print a user profile.
  * For an example of the required output format, see the example output
@@ -222,64 +641,10 @@ char *print_user(const User *user) {
         return NULL;
     }
 
-    // definitely have to print at least these characters
-    // Name:name\n\nFriends:<friends_list>\nPosts:<posts>\n
-    int num_chars = strlen("Name:") + strlen("Friends:") + strlen("Posts:") + 3 * strlen(TEXT_SEPR) + 4 * strlen(NEWLINE_CHAR);
-    num_chars += strlen(user->name);
-
-    int i = 0;
-    while ((user->friends)[i] != NULL) {
-        num_chars += strlen((user->friends)[i]->name) + 1; // + 1 for newline character
-        i++;
-    }
-
-    Post *curr_post = user->first_post;
-    while (curr_post != NULL) {
-        char *post_str = print_post(curr_post);
-        num_chars += strlen(post_str);
-        free(post_str);
-        curr_post = curr_post->next;
-
-        if (curr_post != NULL) {
-            num_chars += strlen("===");
-            num_chars += 3 * strlen(NEWLINE_CHAR);
-        }
-    }
-
-    char *user_str = malloc(sizeof(char) * num_chars);
-    memset(user_str, '\0', num_chars);  // \n\n          \n
-    snprintf(user_str, num_chars, "Name: %s%s%s%sFriends:%s", 
-        user->name, 
-        NEWLINE_CHAR,
-        NEWLINE_CHAR,
-        TEXT_SEPR,
-        NEWLINE_CHAR
-    );
-
-    i = 0;
-    while ((user->friends)[i] != NULL) {
-        strncat(user_str, ((user->friends)[i])->name, strlen(((user->friends)[i])->name) + 1);
-        strncat(user_str, NEWLINE_CHAR, strlen(NEWLINE_CHAR) + 1);
-        i++;
-    }
-    strncat(user_str, TEXT_SEPR, strlen(TEXT_SEPR) + 1);
-    strncat(user_str, "Posts:", strlen("Posts:") + 1);
-    strncat(user_str, NEWLINE_CHAR, strlen(NEWLINE_CHAR) + 1);
-    curr_post = user->first_post;
-    while (curr_post != NULL) {
-        char *post_str2 = print_post(curr_post);
-        strncat(user_str, post_str2, strlen(post_str2) + 1);
-        free(post_str2); // don't need it after copying things over
-        curr_post = curr_post->next;
-        if (curr_post != NULL) {
-            strncat(user_str, NEWLINE_CHAR, strlen(NEWLINE_CHAR) + 1);
-            strncat(user_str, "===", 4);
-            strncat(user_str, NEWLINE_CHAR, strlen(NEWLINE_CHAR) + 1);
-            strncat(user_str, NEWLINE_CHAR, strlen(NEWLINE_CHAR) + 1);
-        }
-    }
-    strncat(user_str, TEXT_SEPR, strlen(TEXT_SEPR) + 1);
-
+    UserView view;
+    view_user(user, &view);
+    char *user_str = print_user_view(&view);
+    free_user_view(&view);
     return user_str;
 
 
@@ -310,6 +675,22 @@ char *print_user(const User *user) {
 }
 
 
+/*
+ * Print the list of posts starting at first under the heading title, in
+ * the same format as the posts in a profile.
+ */
+char *print_posts(const char *title, const Post *first) {
+    int num_chars = strlen(title) + strlen(NEWLINE_CHAR) + 2 * strlen(TEXT_SEPR) + posts_length(first) + 1;
+    char *posts_str = mem_alloc(MEM_RESPONSES, sizeof(char) * num_chars);
+    char *end = append(posts_str, title);
+    end = append(end, NEWLINE_CHAR);
+    end = append(end, TEXT_SEPR);
+    end = write_posts(first, end);
+    strcpy(end, TEXT_SEPR);
+    return posts_str;
+}
+
+
 /*
  * Make a new post from 'author' to the 'target' user,
  * containing the given contents, IF the users are friends.
@@ -332,8 +713,8 @@ int make_post(const User *author, User *target, char *contents) {
     }
 
     int friends = 0;
-    for (int i = 0; i < MAX_FRIENDS && target->friends[i] != NULL; i++) {
-        if (strcmp(target->friends[i]->name, author->name) == 0) {
+    for (int i = 0; i < MAX_FRIENDS && target->friends[i] != NO_USER; i++) {
+        if (target->friends[i] == author->id) {
             friends = 1;
             break;
         }
@@ -343,23 +724,132 @@ int make_post(const User *author, User *target, char *contents) {
         return 1;
     }
 
-    // Create post
-    Post *new_post = malloc(sizeof(Post));
-    if (new_post == NULL) {
-        perror("malloc");
-        exit(1);
-    }
-    strncpy(new_post->author, author->name, MAX_NAME);
+    add_post(target, author->id, contents, time(NULL));
+    return 0;
+}
+
+
+void add_post(User *target, UserId author, char *contents, time_t date) {
+    Post *new_post = mem_alloc(MEM_POSTS, sizeof(Post));
+    new_post->author = author;
+    new_post->packed = 0;
     new_post->contents = contents;
-    new_post->date = malloc(sizeof(time_t));
-    if (new_post->date == NULL) {
-        perror("malloc");
-        exit(1);
-    }
-    time(new_post->date);
+    new_post->date = date;
     new_post->next = target->first_post;
+    new_post->prev = NULL;
+    if (target->first_post == NULL) {
+        target->last_post = new_post;
+    } else {
+        target->first_post->prev = new_post;
+    }
     target->first_post = new_post;
+    target->num_posts++;
+    target->version++;
+}
 
-    return 0;
+
+Post *remove_oldest_post(User *user) {
+    Post *oldest = user->last_post;
+    if (oldest == NULL) {
+        return NULL;
+    }
+
+    user->last_post = oldest->prev;
+    if (user->last_post == NULL) {
+        user->first_post = NULL;
+    } else {
+        user->last_post->next = NULL;
+    }
+    user->num_posts--;
+    user->version++;
+    oldest->prev = NULL;
+    return oldest;
+}
+
+
+
+void remove_post(User *user, Post *post) {
+    // post->next is left alone, so a reader standing on post can carry on
+    if (post->prev == NULL) {
+        user->first_post = post->next;
+    } else {
+        post->prev->next = post->next;
+    }
+    if (post->next == NULL) {
+        user->last_post = post->prev;
+    } else {
+        post->next->prev = post->prev;
+    }
+    user->num_posts--;
+    user->version++;
 }
 
+
+void remove_user(User *user, User **user_ptr_add) {
+    while (user->friends[0] != NO_USER) {
+        unfriend(user, user_by_id(user->friends[0]));
+    }
+
+    // As with posts, user->next is left alone for readers walking the list
+    User *prev = NULL;
+    User **link = user_ptr_add;
+    while (*link != user) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    *link = user->next;
+    if (tail_head == user_ptr_add && tail_user == user) {
+        tail_user = prev;
+    }
+
+    index_remove(user);
+    user_table[user->id] = NULL;
+    users_version++;
+
+    // Their former friends were bumped by unfriend. Their posts on other
+    // profiles now show DELETED_NAME as the author, so those profiles are
+    // rendered afresh too. Deletions are rare, so rather than tracking where
+    // someone's posts are, look for them.
+    for (UserId id = 1; id < table_size; id++) {
+        User *other = user_table[id];
+        if (other == NULL) {
+            continue;
+        }
+        for (const Post *post = other->first_post; post != NULL; post = post->next) {
+            if (post->author == user->id) {
+                other->version++;
+                break;
+            }
+        }
+    }
+}
+
+
+void free_user(User *user) {
+    Post *post = user->first_post;
+    while (post != NULL) {
+        Post *next = post->next;
+        free_post(post);
+        post = next;
+    }
+    mem_charge(MEM_FRIENDSHIPS, -(long) sizeof(user->friends), 0);
+    mem_charge(MEM_USERS, sizeof(user->friends), 0);
+    mem_free(MEM_USERS, user->history_index);
+    mem_free(MEM_USERS, user);
+}
+
+
+void free_post(void *ptr) {
+    Post *post = ptr;
+    if (post->packed) {
+        store_release(post->contents);
+    } else {
+        mem_free(MEM_POSTS, post->contents);
+    }
+    mem_free(MEM_POSTS, post);
+}
+
+
+const char *post_text(const Post *post) {
+    return post->packed ? store_text(post->contents) : post->contents;
+}
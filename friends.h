@@ -1,24 +1,50 @@
+#ifndef FRIENDS_H
+#define FRIENDS_H
+
+#include <stdint.h>
 #include <time.h>
 
 #define MAX_NAME 32     // Max username and profile_pic filename lengths
 #define MAX_FRIENDS 10  // Max number of friends a user can have
 
+/*
+ * Users are identified by dense IDs handed out by create_user, starting at 1.
+ * Names are only looked up (with user_by_id) when output is rendered.
+ */
+typedef uint32_t UserId;
+#define NO_USER 0       // Never a valid ID; marks an empty slot
+
 typedef struct user {
+    UserId id;
     char name[MAX_NAME];
     char profile_pic[MAX_NAME];  // This is a *filename*, not the file contents.
-    struct post *first_post;
-    struct user *friends[MAX_FRIENDS];
+    struct post *first_post;     // Newest post in memory
+    struct post *last_post;      // Oldest post in memory
+    unsigned int num_posts;      // Posts in memory
+    uint64_t archive_head;       // Where the newest archived post is (see archive.h), or 0
+    unsigned long num_archived;  // Older posts moved out of memory to the archive
+    uint64_t *history_index;     // Where every HISTORY_PAGE_SIZE'th archived post is (see retention.h)
+    UserId friends[MAX_FRIENDS];  // Friends' IDs, with any empty slots (NO_USER) at the end
     struct user *next;
+    unsigned long version;  // Bumped whenever the user's profile output changes
 } User;
 
 typedef struct post {
-    char author[MAX_NAME];
-    char *contents;
-    time_t *date;
-    struct post *next;
+    UserId author;
+    uint8_t packed;     // Set if contents is in the post store (see poststore.h)
+    char *contents;     // Read it with post_text
+    time_t date;
+    struct post *next;  // Next older post
+    struct post *prev;  // Next newer post
 } Post;
 
-/* Malloc wrapper */
+/*
+ * Bumped whenever a user is created or removed, i.e. whenever the output
+ * of list_users changes.
+ */
+extern unsigned long users_version;
+
+/* Malloc wrapper. What it allocates isn't counted by memstats.h. */
 void *Malloc(size_t num_bytes);
 
 /*
@@ -34,9 +60,57 @@ void *Malloc(size_t num_bytes);
 int create_user(const char *name, User **user_ptr_add);
 
 
+/*
+ * Bulk-load version of create_user for input that is known to be clean.
+ * Skips the duplicate name check. *tail is set to the new user.
+ *
+ * Return:
+ *   - 0 on success.
+ *   - 2 if the given name cannot fit in the 'name' array.
+ */
+int create_user_bulk(const char *name, User **user_ptr_add, User **tail);
+
+
+/*
+ * Recreate a user saved by another process (see snapshot.h) with the same
+ * ID, which must be higher than any handed out so far. Like
+ * create_user_bulk, appends it and sets *tail to it. Return the user.
+ */
+User *restore_user(UserId id, const char *name, User **user_ptr_add, User **tail);
+
+
+/* Never hand out IDs below limit, e.g. those of users removed before a snapshot. */
+void reserve_user_ids(UserId limit);
+
+
+/*
+ * Return a pointer to the user with this ID, or NULL if no such user exists.
+ */
+User *user_by_id(UserId id);
+
+
+/*
+ * Return the name of the user with this ID, or a placeholder if they have
+ * been removed. Their posts and archived posts outlive them.
+ */
+const char *user_name(UserId id);
+
+
+/*
+ * Return one more than the highest ID handed out so far, so every user's
+ * ID is below it.
+ */
+UserId user_id_limit(void);
+
+/* Return how many users there are, not counting removed ones. */
+size_t user_count(void);
+
+
 /*
  * Return a pointer to the user with this name in
  * the list starting with head. Return NULL if no such user exists.
+ * Users are found through a name index rather than by walking the list,
+ * so all users share one namespace, just like their IDs.
  *
  * NOTE: You'll likely need to cast a (const User *) to a (User *)
  * to satisfy the prototype without warnings.
@@ -47,6 +121,8 @@ User *find_user(const char *name, const User *head);
 /*
  * Print the usernames of all users in the list starting at curr.
  * Names should be printed to standard output, one per line.
+ * The string returned is MEM_RESPONSES's (see memstats.h), as are those of
+ * the other print functions; free it with mem_free.
  */
 char *list_users(const User *curr);
 
@@ -72,6 +148,25 @@ char *list_users(const User *curr);
 int make_friends(const char *name1, const char *name2, User *head);
 
 
+/*
+ * Same as make_friends, but for users that have already been looked up.
+ * Return values are the same as for make_friends.
+ */
+int make_friends_users(User *user1, User *user2);
+
+
+/*
+ * End the friendship between two users, keeping both friends arrays packed.
+ *
+ * Return:
+ *   - 0 on success.
+ *   - 1 if the two users are not friends.
+ *   - 3 if the same user is passed in twice.
+ *   - 4 if at least one user does not exist.
+ */
+int unfriend(User *user1, User *user2);
+
+
 /*
  * Print a user profile.
  * For an example of the required output format, see the example output
@@ -83,6 +178,59 @@ int make_friends(const char *name1, const char *name2, User *head);
 char *print_user(const User *user);
 
 
+/*
+ * What print_user shows of a user at one moment. A view points at the
+ * users' names and their posts rather than copying them, so taking one is
+ * cheap next to rendering it. Names, and posts other than which posts come
+ * before and after them, never change, so a view can be rendered later,
+ * even on another thread, as long as (see epoch.h) nothing it points to has
+ * been freed in the meantime.
+ */
+typedef struct post_view {
+    const char *author;
+    const Post *post;
+} PostView;
+
+typedef struct user_view {
+    const char *name;
+    const char *friends[MAX_FRIENDS];
+    int num_friends;
+    PostView *posts;  // Newest first
+    unsigned int num_posts;
+    unsigned long num_archived;
+} UserView;
+
+/* Fill in view with user's profile as it is now. Free it with free_user_view. */
+void view_user(const User *user, UserView *view);
+
+/* print_user, for the user as they were when view was taken. */
+char *print_user_view(const UserView *view);
+
+void free_user_view(UserView *view);
+
+
+/* The names of every user in a list, as list_users shows them. */
+typedef struct user_list_view {
+    const char **names;
+    size_t num_users;
+} UserListView;
+
+/* Fill in view with the list starting at head as it is now. Free it with free_user_list_view. */
+void view_users(const User *head, UserListView *view);
+
+/* list_users, for the list as it was when view was taken. */
+char *print_user_list_view(const UserListView *view);
+
+void free_user_list_view(UserListView *view);
+
+
+/*
+ * Print the list of posts starting at first (following next) the way
+ * print_user does, under the heading title.
+ */
+char *print_posts(const char *title, const Post *first);
+
+
 /*
  * Make a new post from 'author' to the 'target' user,
  * containing the given contents, IF the users are friends.
@@ -92,7 +240,9 @@ char *print_user(const User *user);
  * Use the 'time' function to store the current time.
  *
  * 'contents' is a pointer to heap-allocated memory - you do not need
- * to allocate more memory to store the contents of the post.
+ * to allocate more memory to store the contents of the post. It must come
+ * from mem_alloc(MEM_POSTS, ...) (see memstats.h), or be handed to MEM_POSTS
+ * with mem_adopt.
  *
  * Return:
  *   - 0 on success
@@ -102,3 +252,50 @@ char *print_user(const User *user);
 int make_post(const User *author, User *target, char *contents);
 
 
+/*
+ * Add a post to the front of target's posts, as make_post does once it has
+ * checked the users are friends, but with the given author ID and date.
+ */
+void add_post(User *target, UserId author, char *contents, time_t date);
+
+
+/*
+ * Unlink user's oldest post in memory and return it, or return NULL if
+ * they have none. The caller owns the post.
+ */
+Post *remove_oldest_post(User *user);
+
+
+/*
+ * Unlink post from user's posts in memory. The caller owns the post, but
+ * readers may still be on it, so it must be freed only once they're done
+ * (see epoch.h).
+ */
+void remove_post(User *user, Post *post);
+
+
+/*
+ * Remove user: end all their friendships and take them out of the list of
+ * users whose head is pointed to by *user_ptr_add, so neither find_user nor
+ * user_by_id finds them any more. IDs are never reused. The caller owns
+ * the user and their posts in memory, and frees them with free_user once
+ * no reader can still be using them (see epoch.h).
+ */
+void remove_user(User *user, User **user_ptr_add);
+
+
+/* Free user and their posts in memory. */
+void free_user(User *user);
+
+
+/* Free post and its contents. Takes a void pointer so it can be handed to epoch_retire. */
+void free_post(void *post);
+
+
+/*
+ * Return post's text. If it's packed in the post store it's unpacked into
+ * a buffer of the calling thread's, which the next call reuses.
+ */
+const char *post_text(const Post *post);
+
+#endif
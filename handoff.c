@@ -0,0 +1,267 @@
+#define _GNU_SOURCE  // memfd_create
+#include "handoff.h"
+#include "friends.h"
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define FDS_PER_MESSAGE 250  // The kernel takes at most 253 descriptors per message
+
+#define HEADER_LEN (HANDOFF_MAGIC_LEN + 4)
+
+/*
+ * Messages, over a SOCK_SEQPACKET socket so they arrive one at a time:
+ * first a count of the descriptors to follow (4 bytes) with the state's
+ * memory file attached, then batches of descriptors, each with a count of
+ * those attached. The new process accepts with a byte, and the old one
+ * confirms with another.
+ */
+
+
+/* Fill in addr with the Unix socket address path. */
+static void socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+}
+
+int handoff_listen(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        perror("server: socket");
+        exit(1);
+    }
+    struct sockaddr_un addr;
+    socket_address(path, &addr);
+    unlink(path);  // Left behind by a server that has gone
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("server: handoff socket");
+        exit(1);
+    }
+    return fd;
+}
+
+int handoff_connect(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        perror("server: socket");
+        exit(1);
+    }
+    struct sockaddr_un addr;
+    socket_address(path, &addr);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/* Send count with the num_fds descriptors in fds attached. Return 0 on success and -1 on error. */
+static int send_fds(int sock, uint32_t count, const int *fds, int num_fds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&count, sizeof(count)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (num_fds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(count) ? 0 : -1;
+}
+
+/*
+ * Receive a count, and up to max descriptors attached to it into fds.
+ * Return how many descriptors there were, or -1 on error, having closed
+ * any that came.
+ */
+static int receive_fds(int sock, uint32_t *count, int *fds, int max) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {count, sizeof(*count)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (received == -1) {
+        return -1;
+    }
+    int ok = received == sizeof(*count) && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+
+    // Whatever is wrong, every descriptor that came is ours to close
+    int num_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+            if (ok && num_fds < max) {
+                fds[num_fds++] = fd;
+            } else {
+                close(fd);
+                ok = 0;
+            }
+        }
+    }
+    if (!ok) {
+        for (int i = 0; i < num_fds; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return num_fds;
+}
+
+/* Wait up to timeout_ms (or forever, if negative) for a byte on sock. Return 0 if one came and -1 if not. */
+static int receive_byte(int sock, int timeout_ms) {
+    struct pollfd ready = {sock, POLLIN, 0};
+    char byte;
+    if (poll(&ready, 1, timeout_ms) != 1 || read(sock, &byte, 1) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Send a byte on sock. Return 0 on success and -1 on error. */
+static int send_byte(int sock) {
+    char byte = 1;
+    return send(sock, &byte, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+
+int handoff_send(int sock, const char *state, size_t len, const int *fds, int num_fds) {
+    int memfd = memfd_create("friend_server handoff", MFD_CLOEXEC);
+    if (memfd == -1) {
+        perror("server: handoff");
+        return -1;
+    }
+    char header[HEADER_LEN];
+    uint32_t version = HANDOFF_VERSION;
+    memcpy(header, HANDOFF_MAGIC, HANDOFF_MAGIC_LEN);
+    memcpy(header + HANDOFF_MAGIC_LEN, &version, 4);
+    if (write(memfd, header, HEADER_LEN) != HEADER_LEN) {
+        perror("server: handoff");
+        close(memfd);
+        return -1;
+    }
+    for (size_t written = 0; written < len; ) {
+        ssize_t n = write(memfd, state + written, len - written);
+        if (n <= 0) {
+            perror("server: handoff");
+            close(memfd);
+            return -1;
+        }
+        written += n;
+    }
+
+    int result = send_fds(sock, num_fds, &memfd, 1);
+    close(memfd);
+    for (int sent = 0; result == 0 && sent < num_fds; sent += FDS_PER_MESSAGE) {
+        int batch = num_fds - sent < FDS_PER_MESSAGE ? num_fds - sent : FDS_PER_MESSAGE;
+        result = send_fds(sock, batch, fds + sent, batch);
+    }
+    if (result == -1) {
+        return -1;
+    }
+
+    // Wait for the new process to accept it all
+    return receive_byte(sock, HANDOFF_TIMEOUT_MS);
+}
+
+int handoff_commit(int sock) {
+    return send_byte(sock);
+}
+
+int handoff_receive(int sock, const char **state, size_t *len, int **fds, int *num_fds) {
+    uint32_t total;
+    int memfd;
+    if (receive_fds(sock, &total, &memfd, 1) != 1) {
+        return -1;
+    }
+    struct stat info;
+    if (fstat(memfd, &info) == -1 || info.st_size < HEADER_LEN) {
+        close(memfd);
+        return -1;
+    }
+    char *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, memfd, 0);
+    close(memfd);
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+    uint32_t version;
+    memcpy(&version, mapped + HANDOFF_MAGIC_LEN, 4);
+    if (memcmp(mapped, HANDOFF_MAGIC, HANDOFF_MAGIC_LEN) != 0 || version != HANDOFF_VERSION) {
+        fprintf(stderr, "server: the running server hands over a different version of its state\n");
+        munmap(mapped, info.st_size);
+        return -1;
+    }
+
+    int *received = Malloc(sizeof(int) * (total + 1));
+    int num_received = 0;
+    while (num_received < total) {
+        uint32_t count;
+        int n = receive_fds(sock, &count, received + num_received, total - num_received);
+        if (n > 0 && n != count) {
+            num_received += n;  // To be closed with the rest
+        }
+        if (n <= 0 || n != count) {
+            for (int i = 0; i < num_received; i++) {
+                close(received[i]);
+            }
+            free(received);
+            munmap(mapped, info.st_size);
+            return -1;
+        }
+        num_received += n;
+    }
+
+    *state = mapped + HEADER_LEN;
+    *len = info.st_size - HEADER_LEN;
+    *fds = received;
+    *num_fds = num_received;
+    return 0;
+}
+
+int handoff_accept(int sock) {
+    // Once the old process confirms, it exits, and that closes the
+    // connection; until then it may still be using everything
+    int result = send_byte(sock) == -1 || receive_byte(sock, HANDOFF_TIMEOUT_MS) == -1 ? -1 : 0;
+    if (result == 0) {
+        char byte;
+        while (read(sock, &byte, 1) > 0) {
+        }
+    }
+    close(sock);
+    return result;
+}
+
+void handoff_release(const char *state, size_t len) {
+    munmap((void *) (state - HEADER_LEN), len + HEADER_LEN);
+}
@@ -0,0 +1,82 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+
+/*
+ * Handing a running server over to a new process without dropping
+ * connections. The new process connects to the old one's handoff socket
+ * (a Unix socket), and the old one sends it a description of its state and
+ * every file descriptor it needs: the listening sockets, each client's
+ * connection and so on. Descriptors are passed with SCM_RIGHTS, so the new
+ * process gets the very same sockets, with whatever the kernel has buffered
+ * for them. The state goes in an anonymous memory file, which the new
+ * process maps rather than reading through the socket.
+ *
+ * The memory file starts with HANDOFF_MAGIC and HANDOFF_VERSION, so a new
+ * process never takes over state it doesn't understand. Only one process
+ * ever uses the descriptors at a time:
+ *
+ *   1. The old process sends the state and descriptors, and stops serving.
+ *   2. The new process checks the version, and accepts with a single byte.
+ *   3. The old process confirms with a byte of its own, and exits.
+ *   4. The new process waits for the old one to be gone, then starts.
+ *
+ * If the old process hasn't heard back within HANDOFF_TIMEOUT_MS, or the
+ * connection drops, it carries on serving; a new process that doesn't get
+ * the confirmation exits without having touched anything.
+ */
+#ifndef HANDOFF_TIMEOUT_MS
+  #define HANDOFF_TIMEOUT_MS 5000
+#endif
+
+#define HANDOFF_MAGIC "FRHAND\n"
+#define HANDOFF_MAGIC_LEN 7
+#define HANDOFF_VERSION 2  // (4 bytes) Bumped whenever the state's format changes
+
+/* Return a socket listening for a replacement at the Unix socket path. */
+int handoff_listen(const char *path);
+
+/*
+ * Connect to the server listening for a replacement at path. Return the
+ * connection, or -1 if no server is listening there.
+ */
+int handoff_connect(const char *path);
+
+/*
+ * Send the len bytes of state at state and the num_fds descriptors in fds
+ * over the connection sock. Return 0 once the other end has accepted them,
+ * and -1 if it didn't. Either way, the descriptors are still ours until
+ * handoff_commit succeeds.
+ */
+int handoff_send(int sock, const char *state, size_t len, const int *fds, int num_fds);
+
+/*
+ * Tell the process that accepted our state over sock that it's theirs, so
+ * we must exit without touching any of it again. Return 0 on success, and
+ * -1 if the other process has gone (having taken nothing over).
+ */
+int handoff_commit(int sock);
+
+/*
+ * Receive state and descriptors sent with handoff_send over sock. Set
+ * *state to the state mapped into memory (after the magic and version),
+ * *len to its length, *fds to a new array of the descriptors and *num_fds
+ * to how many there are. Return 0 on success and -1 on error, including
+ * state of another version. Accept with handoff_accept before using any of
+ * it, and unmap the state with handoff_release.
+ */
+int handoff_receive(int sock, const char **state, size_t *len, int **fds, int *num_fds);
+
+/*
+ * Accept what was received over sock, wait for the sending process to
+ * confirm it and exit, and close sock. Return 0 once it has gone, and -1 if
+ * it has given up waiting and carried on serving, in which case none of
+ * what was received may be used.
+ */
+int handoff_accept(int sock);
+
+/* Unmap state received with handoff_receive. */
+void handoff_release(const char *state, size_t len);
+
+#endif
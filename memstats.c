@@ -0,0 +1,135 @@
+#include "memstats.h"
+#include "friends.h"
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * One thread's counts. Only that thread writes them, and other threads
+ * read them to sum them up. Records are never freed, so they can be read
+ * at any time.
+ */
+typedef struct counts {
+    int64_t bytes[NUM_MEM_TAGS];
+    int64_t objects[NUM_MEM_TAGS];
+    struct counts *next;
+} Counts;
+
+static __thread Counts *thread_counts = NULL;
+static Counts *all_counts = NULL;  // Every thread's record, newest first
+
+static const char *tag_names[NUM_MEM_TAGS] = {
+    [MEM_USERS] = "users",
+    [MEM_POSTS] = "posts",
+    [MEM_FRIENDSHIPS] = "friendships",
+    [MEM_SESSIONS] = "sessions",
+    [MEM_PARSE] = "parse",
+    [MEM_RESPONSES] = "responses",
+};
+
+
+/* Add bytes and objects to tag's counts for this thread. */
+static void count(MemTag tag, int64_t bytes, int64_t objects) {
+    // Each thread registers its record the first time it allocates
+    Counts *counts = thread_counts;
+    if (counts == NULL) {
+        counts = Malloc(sizeof(Counts));
+        for (int i = 0; i < NUM_MEM_TAGS; i++) {
+            counts->bytes[i] = 0;
+            counts->objects[i] = 0;
+        }
+        counts->next = __atomic_load_n(&all_counts, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&all_counts, &counts->next, counts, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        }
+        thread_counts = counts;
+    }
+    __atomic_store_n(&counts->bytes[tag], counts->bytes[tag] + bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&counts->objects[tag], counts->objects[tag] + objects, __ATOMIC_RELAXED);
+}
+
+
+void *mem_alloc(MemTag tag, size_t num_bytes) {
+    return mem_adopt(tag, Malloc(num_bytes));
+}
+
+
+void *mem_realloc(MemTag tag, void *ptr, size_t num_bytes) {
+    size_t old_bytes = ptr == NULL ? 0 : malloc_usable_size(ptr);
+    void *ret = realloc(ptr, num_bytes);
+    if (ret == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    count(tag, (int64_t) malloc_usable_size(ret) - (int64_t) old_bytes, ptr == NULL);
+    return ret;
+}
+
+
+void mem_free(MemTag tag, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    count(tag, -(int64_t) malloc_usable_size(ptr), -1);
+    free(ptr);
+}
+
+
+void *mem_adopt(MemTag tag, void *ptr) {
+    if (ptr == NULL) {
+        return NULL;
+    }
+    count(tag, malloc_usable_size(ptr), 1);
+    return ptr;
+}
+
+
+void *mem_move(MemTag from, MemTag to, void *ptr) {
+    if (ptr == NULL) {
+        return NULL;
+    }
+    size_t bytes = malloc_usable_size(ptr);
+    count(from, -(int64_t) bytes, -1);
+    count(to, bytes, 1);
+    return ptr;
+}
+
+
+void mem_charge(MemTag tag, long bytes, long objects) {
+    count(tag, bytes, objects);
+}
+
+
+void mem_usage(MemUsage usage[NUM_MEM_TAGS]) {
+    for (int i = 0; i < NUM_MEM_TAGS; i++) {
+        usage[i].bytes = 0;
+        usage[i].objects = 0;
+    }
+    for (Counts *counts = __atomic_load_n(&all_counts, __ATOMIC_ACQUIRE); counts != NULL; counts = counts->next) {
+        for (int i = 0; i < NUM_MEM_TAGS; i++) {
+            usage[i].bytes += __atomic_load_n(&counts->bytes[i], __ATOMIC_RELAXED);
+            usage[i].objects += __atomic_load_n(&counts->objects[i], __ATOMIC_RELAXED);
+        }
+    }
+    // A thread can be caught between its half of a free and another's half
+    // of the allocation, so don't let that show as less than nothing
+    for (int i = 0; i < NUM_MEM_TAGS; i++) {
+        if (usage[i].bytes < 0) {
+            usage[i].bytes = 0;
+        }
+        if (usage[i].objects < 0) {
+            usage[i].objects = 0;
+        }
+    }
+}
+
+
+const char *mem_tag_name(MemTag tag) {
+    return tag_names[tag];
+}
+
+
+uint64_t mem_heap_bytes(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
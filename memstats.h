@@ -0,0 +1,67 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Memory accounting: an allocator that tags every allocation with the part
+ * of the server it belongs to, and keeps count of the live bytes (as
+ * malloc_usable_size has them, so what the heap really spends) and objects
+ * of each.
+ *
+ * Each thread keeps its own counts, so allocating takes no locks, and the
+ * totals are the sum over every thread. Memory may be freed on a different
+ * thread than allocated it, leaving one thread's count negative and
+ * another's too high, but the sum is right.
+ *
+ * A tagged allocation must be freed (or reallocated) with mem_free (or
+ * mem_realloc) and the same tag. Memory from plain malloc, or Malloc, isn't
+ * counted unless it's handed to a tag with mem_adopt.
+ */
+typedef enum mem_tag {
+    MEM_USERS,        // Users, and the tables of them
+    MEM_POSTS,        // Posts and their text
+    MEM_FRIENDSHIPS,  // Friend lists (part of each user), and the friendships in them
+    MEM_SESSIONS,     // Clients and everything kept per connection
+    MEM_PARSE,        // Commands split into arguments
+    MEM_RESPONSES,    // Rendered output, and the views and buffers holding it
+    NUM_MEM_TAGS
+} MemTag;
+
+typedef struct mem_usage {
+    int64_t bytes;
+    int64_t objects;
+} MemUsage;
+
+/* Malloc num_bytes for tag. */
+void *mem_alloc(MemTag tag, size_t num_bytes);
+
+/* Resize ptr, tag's (or NULL, to allocate), to num_bytes. */
+void *mem_realloc(MemTag tag, void *ptr, size_t num_bytes);
+
+/* Free ptr, tag's. Does nothing if ptr is NULL. */
+void mem_free(MemTag tag, void *ptr);
+
+/* Count ptr, allocated with plain malloc (or NULL), as tag's from now on, and return it. */
+void *mem_adopt(MemTag tag, void *ptr);
+
+/* Count ptr, allocated for from (or NULL), as to's from now on, and return it. */
+void *mem_move(MemTag from, MemTag to, void *ptr);
+
+/*
+ * Count bytes and objects as tag's without allocating anything, for memory
+ * that is part of an allocation counted elsewhere. Either may be negative.
+ */
+void mem_charge(MemTag tag, long bytes, long objects);
+
+/* Fill in every tag's totals, indexed by tag. */
+void mem_usage(MemUsage usage[NUM_MEM_TAGS]);
+
+/* Return tag's name. */
+const char *mem_tag_name(MemTag tag);
+
+/* Return the bytes the whole heap has in use, counted or not. */
+uint64_t mem_heap_bytes(void);
+
+#endif
@@ -0,0 +1,442 @@
+#include "poststore.h"
+#include "memstats.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_BITS 12       // Of the tables of where each 4 byte sequence was last seen
+#define MAX_CHAIN 32       // Most earlier places a match is looked for
+#define MAX_DISTANCE 0xFFFF
+#define SAMPLE_LIMIT (4 * 1024 * 1024)  // Most text kept for building the dictionary
+
+// Building the dictionary: it's made of SEGMENT_LEN byte pieces of the
+// sample, each the one whose DMER_LEN byte sequences are most common in its
+// part of the sample (see train)
+#define SEGMENT_LEN 32
+#define DMER_LEN 6
+#define COUNT_BITS 18
+
+/*
+ * The start of every block. The packed text of posts follows, one after
+ * the other. Blocks are aligned to their size, so the block some packed
+ * text is in can be found from its address.
+ */
+typedef struct block {
+    size_t used;  // Bytes of the block in use, this included
+    size_t live;  // Posts packed into it that haven't been released
+} Block;
+
+static int enabled = 0;
+static Block *current = NULL;  // The block posts are being packed into
+
+static char *sample = NULL;    // Text of posts seen before training, each null terminated
+static size_t sample_len = 0;
+static size_t sample_capacity = 0;
+static int sample_posts = 0;
+
+static int trained = 0;        // Set once the dictionary has been built
+static char dict[STORE_DICT_SIZE];
+static size_t dict_len = 0;
+static int32_t dict_head[1 << HASH_BITS];  // Last place in dict each sequence starts, or -1
+static int32_t dict_chain[STORE_DICT_SIZE];  // The place before that, or -1
+
+// Where sequences were seen in the post being packed. An entry of head is
+// only valid if its stamp is this post's, so nothing needs clearing between posts.
+static int32_t post_head[1 << HASH_BITS];
+static uint32_t post_stamp[1 << HASH_BITS];
+static uint32_t stamp = 0;
+static int32_t *post_chain = NULL;
+static size_t post_chain_capacity = 0;
+
+static char *packed_buf = NULL;  // Compressed text of the post being packed
+static size_t packed_capacity = 0;
+
+static __thread char *text_buf = NULL;  // store_text's result
+static __thread size_t text_capacity = 0;
+
+
+/*
+ * Return buf, which has room for *capacity elements of elem_size bytes,
+ * grown if need be to hold at least size of them.
+ */
+static void *grow(void *buf, size_t *capacity, size_t size, size_t elem_size) {
+    if (size <= *capacity) {
+        return buf;
+    }
+    size_t new_capacity = *capacity == 0 ? 256 : *capacity;
+    while (new_capacity < size) {
+        new_capacity *= 2;
+    }
+    buf = realloc(buf, new_capacity * elem_size);
+    if (buf == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return buf;
+}
+
+static uint32_t hash4(const char *p) {
+    uint32_t word;
+    memcpy(&word, p, 4);
+    return (word * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Return how many bytes a and b have in common at the start, up to limit. */
+static size_t common_prefix(const char *a, const char *b, size_t limit) {
+    size_t len = 0;
+    while (len < limit && a[len] == b[len]) {
+        len++;
+    }
+    return len;
+}
+
+static char *put_varint(char *dest, size_t value) {
+    while (value >= 0x80) {
+        *dest++ = (char) (value | 0x80);
+        value >>= 7;
+    }
+    *dest++ = (char) value;
+    return dest;
+}
+
+static const char *get_varint(const char *src, size_t *value) {
+    *value = 0;
+    int shift = 0;
+    while (*(const unsigned char *) src & 0x80) {
+        *value |= (size_t) (*src++ & 0x7F) << shift;
+        shift += 7;
+    }
+    *value |= (size_t) *(const unsigned char *) src++ << shift;
+    return src;
+}
+
+/* Write the extra bytes of a length whose nibble in the token was 15. */
+static char *put_extra(char *dest, size_t extra) {
+    while (extra >= 255) {
+        *dest++ = (char) 255;
+        extra -= 255;
+    }
+    *dest++ = (char) extra;
+    return dest;
+}
+
+static const char *get_extra(const char *src, size_t *len) {
+    unsigned char byte;
+    do {
+        byte = *(const unsigned char *) src++;
+        *len += byte;
+    } while (byte == 255);
+    return src;
+}
+
+
+/* Write a sequence of num_literals bytes at literals and a match, if match_len isn't 0. */
+static char *put_sequence(char *dest, const char *literals, size_t num_literals,
+                          size_t match_len, size_t distance) {
+    size_t extra_match = match_len == 0 ? 0 : match_len - STORE_MIN_MATCH;
+    char *token = dest++;
+    *token = (char) (((num_literals < 15 ? num_literals : 15) << 4) | (extra_match < 15 ? extra_match : 15));
+    if (num_literals >= 15) {
+        dest = put_extra(dest, num_literals - 15);
+    }
+    memcpy(dest, literals, num_literals);
+    dest += num_literals;
+    if (match_len > 0) {
+        *dest++ = (char) (distance & 0xFF);
+        *dest++ = (char) (distance >> 8);
+        if (extra_match >= 15) {
+            dest = put_extra(dest, extra_match - 15);
+        }
+    }
+    return dest;
+}
+
+/* Note that the sequence at src[pos] was seen, for later matches in the same post. */
+static void remember(const char *src, size_t pos) {
+    uint32_t hash = hash4(src + pos);
+    post_chain[pos] = post_stamp[hash] == stamp ? post_head[hash] : -1;
+    post_head[hash] = pos;
+    post_stamp[hash] = stamp;
+}
+
+/* Compress the len bytes at src into packed_buf, and return how long the result is. */
+static size_t compress(const char *src, size_t len) {
+    packed_buf = grow(packed_buf, &packed_capacity, len + len / 255 + 16, 1);
+    post_chain = grow(post_chain, &post_chain_capacity, len, sizeof(int32_t));
+    stamp++;
+
+    char *out = packed_buf;
+    size_t anchor = 0;  // Start of the literals not written yet
+    size_t pos = 0;
+    while (pos + STORE_MIN_MATCH <= len) {
+        uint32_t hash = hash4(src + pos);
+        size_t best_len = 0;
+        size_t best_distance = 0;
+
+        // Earlier in the post
+        int32_t candidate = post_stamp[hash] == stamp ? post_head[hash] : -1;
+        for (int i = 0; i < MAX_CHAIN && candidate != -1 && pos - candidate <= MAX_DISTANCE; i++) {
+            size_t match_len = common_prefix(src + candidate, src + pos, len - pos);
+            if (match_len > best_len) {
+                best_len = match_len;
+                best_distance = pos - candidate;
+            }
+            candidate = post_chain[candidate];
+        }
+
+        // In the dictionary, which comes right before the post
+        candidate = dict_head[hash];
+        for (int i = 0; i < MAX_CHAIN && candidate != -1 && dict_len - candidate + pos <= MAX_DISTANCE; i++) {
+            size_t limit = dict_len - candidate < len - pos ? dict_len - candidate : len - pos;
+            size_t match_len = common_prefix(dict + candidate, src + pos, limit);
+            if (match_len > best_len) {
+                best_len = match_len;
+                best_distance = dict_len - candidate + pos;
+            }
+            candidate = dict_chain[candidate];
+        }
+
+        if (best_len < STORE_MIN_MATCH) {
+            remember(src, pos);
+            pos++;
+            continue;
+        }
+        out = put_sequence(out, src + anchor, pos - anchor, best_len, best_distance);
+        for (size_t end = pos + best_len; pos < end; pos++) {
+            if (pos + STORE_MIN_MATCH <= len) {
+                remember(src, pos);
+            }
+        }
+        anchor = pos;
+    }
+    out = put_sequence(out, src + anchor, len - anchor, 0, 0);
+    return out - packed_buf;
+}
+
+
+static uint32_t hash_dmer(const char *p) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < DMER_LEN; i++) {
+        hash = (hash ^ (unsigned char) p[i]) * 1099511628211ULL;
+    }
+    return hash >> (64 - COUNT_BITS);
+}
+
+/* Return 1 if the sequence at sample[pos] is all one post's, 0 if it runs into the end of one. */
+static int dmer_ok(size_t pos) {
+    return memchr(sample + pos, '\0', DMER_LEN) == NULL;
+}
+
+/*
+ * Build the dictionary from the sample, much as zstd's COVER algorithm
+ * does: split the sample into as many parts as the dictionary has room
+ * for segments, and from each part take the segment whose DMER_LEN byte
+ * sequences come up most often across the whole sample. A sequence only
+ * counts once it's in the dictionary, and not at all if it's only seen once.
+ */
+static void train(void) {
+    uint32_t *counts = calloc(1 << COUNT_BITS, sizeof(uint32_t));
+    if (counts == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (size_t pos = 0; pos + DMER_LEN <= sample_len; pos++) {
+        if (dmer_ok(pos)) {
+            counts[hash_dmer(sample + pos)]++;
+        }
+    }
+
+    uint32_t *values = NULL;  // What each sequence in the part is worth
+    size_t values_capacity = 0;
+    size_t window = SEGMENT_LEN - DMER_LEN + 1;  // Sequences in a segment
+    size_t part_len = sample_len / (STORE_DICT_SIZE / SEGMENT_LEN);
+    if (part_len < SEGMENT_LEN) {
+        part_len = SEGMENT_LEN;
+    }
+    for (size_t start = 0; start + SEGMENT_LEN <= sample_len && dict_len + SEGMENT_LEN <= STORE_DICT_SIZE;
+         start += part_len) {
+        size_t end = start + part_len < sample_len ? start + part_len : sample_len;
+        size_t num_dmers = end - start - DMER_LEN + 1;
+        values = grow(values, &values_capacity, num_dmers, sizeof(uint32_t));
+        for (size_t i = 0; i < num_dmers; i++) {
+            uint32_t count = dmer_ok(start + i) ? counts[hash_dmer(sample + start + i)] : 0;
+            values[i] = count > 1 ? count - 1 : 0;
+        }
+
+        // Slide a segment across the part, keeping the best place for it
+        uint64_t sum = 0;
+        uint64_t best_sum = 0;
+        size_t best = start;
+        for (size_t i = 0; i < num_dmers; i++) {
+            sum += values[i];
+            if (i >= window) {
+                sum -= values[i - window];
+            }
+            if (i + 1 >= window && sum > best_sum) {
+                best_sum = sum;
+                best = start + i + 1 - window;
+            }
+        }
+        if (best_sum == 0) {
+            continue;
+        }
+
+        memcpy(dict + dict_len, sample + best, SEGMENT_LEN);
+        dict_len += SEGMENT_LEN;
+        for (size_t pos = best; pos < best + window; pos++) {
+            if (dmer_ok(pos)) {
+                counts[hash_dmer(sample + pos)] = 0;
+            }
+        }
+    }
+    free(values);
+    free(counts);
+
+    for (int i = 0; i < 1 << HASH_BITS; i++) {
+        dict_head[i] = -1;
+    }
+    for (size_t pos = 0; pos + STORE_MIN_MATCH <= dict_len; pos++) {
+        uint32_t hash = hash4(dict + pos);
+        dict_chain[pos] = dict_head[hash];
+        dict_head[hash] = pos;
+    }
+    trained = 1;
+}
+
+
+void store_enable(void) {
+    enabled = 1;
+}
+
+
+/* Start a new block for posts to be packed into, freeing the last one if nothing's in it. */
+static void new_block(void) {
+    if (current != NULL && current->live == 0) {
+        mem_free(MEM_POSTS, current);
+    }
+    void *block;
+    if (posix_memalign(&block, STORE_BLOCK_SIZE, STORE_BLOCK_SIZE) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    current = mem_adopt(MEM_POSTS, block);
+    current->used = sizeof(Block);
+    current->live = 0;
+}
+
+
+void store_pack(Post *post) {
+    if (!enabled || post->packed) {
+        return;
+    }
+
+    size_t len = strlen(post->contents);
+    if (!trained) {
+        if (sample_len + len + 1 <= SAMPLE_LIMIT) {
+            sample = grow(sample, &sample_capacity, sample_len + len + 1, 1);
+            memcpy(sample + sample_len, post->contents, len + 1);
+            sample_len += len + 1;
+        }
+        if (++sample_posts == STORE_TRAIN_POSTS) {
+            train();
+            free(sample);
+            sample = NULL;
+        }
+        return;
+    }
+
+    size_t packed_len = compress(post->contents, len);
+    char header[20];
+    char *header_end = put_varint(put_varint(header, len), packed_len);
+    size_t record_len = (header_end - header) + packed_len;
+    if (record_len > STORE_BLOCK_SIZE - sizeof(Block)) {
+        return;  // Too long to pack; it keeps its plain text
+    }
+    if (current == NULL || current->used + record_len > STORE_BLOCK_SIZE) {
+        new_block();
+    }
+
+    char *record = (char *) current + current->used;
+    memcpy(record, header, header_end - header);
+    memcpy(record + (header_end - header), packed_buf, packed_len);
+    current->used += record_len;
+    current->live++;
+
+    mem_free(MEM_POSTS, post->contents);
+    post->contents = record;
+    post->packed = 1;
+}
+
+
+size_t store_length(const char *packed) {
+    size_t len;
+    get_varint(packed, &len);
+    return len;
+}
+
+
+char *store_unpack(const char *packed, char *dest) {
+    size_t packed_len;
+    packed = get_varint(packed, &packed_len);  // The text's length isn't needed
+    packed = get_varint(packed, &packed_len);
+    const char *end = packed + packed_len;
+    char *start = dest;
+
+    while (1) {
+        unsigned char token = *(const unsigned char *) packed++;
+        size_t num_literals = token >> 4;
+        if (num_literals == 15) {
+            packed = get_extra(packed, &num_literals);
+        }
+        memcpy(dest, packed, num_literals);
+        dest += num_literals;
+        packed += num_literals;
+        if (packed == end) {
+            return dest;
+        }
+
+        size_t distance = (unsigned char) packed[0] | ((unsigned char) packed[1] << 8);
+        packed += 2;
+        size_t match_len = token & 0x0F;
+        if (match_len == 15) {
+            packed = get_extra(packed, &match_len);
+        }
+        match_len += STORE_MIN_MATCH;
+
+        size_t pos = dest - start;
+        if (distance > pos) {
+            // Matches in the dictionary never run past its end
+            memcpy(dest, dict + dict_len - (distance - pos), match_len);
+            dest += match_len;
+        } else {
+            // The match may overlap what it's copying, so go a byte at a time
+            const char *from = dest - distance;
+            for (size_t i = 0; i < match_len; i++) {
+                *dest++ = from[i];
+            }
+        }
+    }
+}
+
+
+const char *store_text(const char *packed) {
+    size_t len = store_length(packed);
+    text_buf = grow(text_buf, &text_capacity, len + 1, 1);
+    *store_unpack(packed, text_buf) = '\0';
+    return text_buf;
+}
+
+
+void store_release(const char *packed) {
+    Block *block = (Block *) ((uintptr_t) packed & ~(uintptr_t) (STORE_BLOCK_SIZE - 1));
+    if (--block->live > 0) {
+        return;
+    }
+    if (block == current) {
+        current->used = sizeof(Block);  // Nothing in it can still be read
+    } else {
+        mem_free(MEM_POSTS, block);
+    }
+}
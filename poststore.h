@@ -0,0 +1,76 @@
+#ifndef POSTSTORE_H
+#define POSTSTORE_H
+
+#include <stddef.h>
+
+#include "friends.h"
+
+/*
+ * The post store: an optional, compressed home for the text of posts.
+ *
+ * Posts are short and say much the same things, so once STORE_TRAIN_POSTS
+ * posts have been seen, a dictionary of the pieces of them that come up
+ * most is built from their text. From then on, each new post is compressed
+ * against the dictionary (and itself) with a small LZ77 codec and packed
+ * into a STORE_BLOCK_SIZE block, instead of keeping its own allocation. A
+ * block is freed once every post in it has been. Posts seen before the
+ * dictionary was built keep their plain text.
+ *
+ * Each post is compressed on its own, so it can be unpacked on its own,
+ * which is only done to render it. The dictionary never changes once
+ * built and packed text never moves, so any thread can unpack a post
+ * that it could see when it was packed.
+ *
+ * The packed form of a post's text: its length and the length of the
+ * compressed text (varints), then the compressed text, a series of
+ * sequences, each:
+ *   a token byte, whose top four bits are how many literal bytes follow
+ *     and bottom four bits how much longer than STORE_MIN_MATCH the match
+ *     is, with 15 in either meaning more bytes follow, each added on, up to
+ *     and including the first that isn't 255
+ *   the literal bytes
+ *   the match: how far back (2 bytes, little endian) to copy from, where
+ *     the dictionary comes right before the post
+ * The last sequence stops after its literals.
+ */
+#ifndef STORE_BLOCK_SIZE
+  #define STORE_BLOCK_SIZE (64 * 1024)  // A power of two
+#endif
+#ifndef STORE_DICT_SIZE
+  #define STORE_DICT_SIZE (16 * 1024)   // Below 64K, so every distance fits in 2 bytes
+#endif
+#ifndef STORE_TRAIN_POSTS
+  #define STORE_TRAIN_POSTS 2000
+#endif
+#define STORE_MIN_MATCH 4
+
+/* Start packing posts handed to store_pack, which until now does nothing. */
+void store_enable(void);
+
+/*
+ * Pack post's text into the store, freeing its plain text, if the store is
+ * enabled and the dictionary has been built. Before then, learn from it
+ * for the dictionary. No other thread may be able to see post yet.
+ */
+void store_pack(Post *post);
+
+/* Return the length of the packed text at packed. */
+size_t store_length(const char *packed);
+
+/*
+ * Write the text packed at packed to dest, which must have room for
+ * store_length(packed) characters, without a null terminator. Return the
+ * end of it.
+ */
+char *store_unpack(const char *packed, char *dest);
+
+/*
+ * Return the text packed at packed, null terminated, in a buffer of the
+ * calling thread's that is reused by its next call.
+ */
+const char *store_text(const char *packed);
+
+/* Let go of the text packed at packed, once its post is freed. */
+void store_release(const char *packed);
+
+#endif
@@ -0,0 +1,133 @@
+#include "friends.h"
+#include "memstats.h"
+#include "poststore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Tests for the post store's codec: texts of every awkward shape are packed
+ * against a dictionary trained on ordinary posts, and must come back out
+ * exactly as they went in.
+ */
+#define WINDOW_TEXT_LEN (3 * 64 * 1024)  // Longer than any match can reach back
+
+static int failures = 0;
+static uint32_t seed = 12345;
+
+
+/* Return the next number from a fixed pseudo-random sequence. */
+static uint32_t next_random(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/* Fill text with len random non-zero bytes, and null terminate it. */
+static void random_text(char *text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        text[i] = 1 + next_random() % 255;
+    }
+    text[len] = '\0';
+}
+
+/* Fill text with len bytes of words like those in posts, and null terminate it. */
+static void wordy_text(char *text, size_t len) {
+    static const char *words[] = {
+        "hello", "there", "friend", "how", "are", "you", "doing", "today", "see", "you",
+        "at", "the", "party", "tonight", "thanks", "for", "the", "invite", "lol", "great",
+    };
+    size_t pos = 0;
+    while (pos < len) {
+        const char *word = words[next_random() % (sizeof(words) / sizeof(words[0]))];
+        for (size_t i = 0; word[i] != '\0' && pos < len; i++) {
+            text[pos++] = word[i];
+        }
+        if (pos < len) {
+            text[pos++] = ' ';
+        }
+    }
+    text[len] = '\0';
+}
+
+
+/*
+ * Pack a post holding text, and check it reads back the same every way it
+ * can be, and that it was packed or not as expected.
+ */
+static void check_round_trip(const char *what, const char *text, int expect_packed) {
+    size_t len = strlen(text);
+    Post *post = mem_alloc(MEM_POSTS, sizeof(Post));
+    post->packed = 0;
+    post->contents = mem_alloc(MEM_POSTS, len + 1);
+    memcpy(post->contents, text, len + 1);
+    store_pack(post);
+
+    if (post->packed != expect_packed) {
+        fprintf(stderr, "FAIL: %s was %s\n", what, post->packed ? "packed" : "not packed");
+        failures++;
+    }
+    if (strcmp(post_text(post), text) != 0) {
+        fprintf(stderr, "FAIL: %s came back different\n", what);
+        failures++;
+    }
+    if (post->packed) {
+        char *unpacked = Malloc(len + 1);
+        if (store_length(post->contents) != len ||
+            store_unpack(post->contents, unpacked) != unpacked + len ||
+            memcmp(unpacked, text, len) != 0) {
+            fprintf(stderr, "FAIL: %s unpacked to the wrong length or text\n", what);
+            failures++;
+        }
+        free(unpacked);
+    }
+    free_post(post);
+}
+
+
+int main(void) {
+    store_enable();
+
+    // Train the dictionary on ordinary posts, which are left unpacked
+    char text[256];
+    for (int i = 0; i < STORE_TRAIN_POSTS; i++) {
+        wordy_text(text, 20 + next_random() % 200);
+        check_round_trip("a post before training", text, 0);
+    }
+
+    check_round_trip("an empty post", "", 1);
+    check_round_trip("a 1 byte post", "x", 1);
+    check_round_trip("a 4 byte post", "lol!", 1);
+    for (int i = 0; i < 1000; i++) {
+        wordy_text(text, next_random() % 250);
+        check_round_trip("an ordinary post", text, 1);
+    }
+
+    char *big = Malloc(WINDOW_TEXT_LEN + 1);
+    random_text(big, 4000);
+    check_round_trip("an incompressible post", big, 1);
+    random_text(big, 255);
+    check_round_trip("a short incompressible post", big, 1);
+
+    // The same random stretch twice, too far apart to match, with
+    // compressible text between
+    size_t chunk = 20000;
+    random_text(big, chunk);
+    memset(big + chunk, 'a', 70000);
+    memcpy(big + chunk + 70000, big, chunk);
+    big[2 * chunk + 70000] = '\0';
+    check_round_trip("a post with repeats beyond the window", big, 1);
+
+    // Runs that match themselves, and far more text than the dictionary
+    wordy_text(big, WINDOW_TEXT_LEN);
+    check_round_trip("a post longer than the window", big, 1);
+    memset(big, 'z', WINDOW_TEXT_LEN);
+    check_round_trip("a long run of one byte", big, 1);
+
+    // Too big to fit a block, so left as it is
+    random_text(big, WINDOW_TEXT_LEN);
+    check_round_trip("an incompressible post bigger than a block", big, 0);
+    free(big);
+
+    printf("poststore_test: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
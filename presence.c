@@ -0,0 +1,122 @@
+#include "presence.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WORD_BITS 64
+
+static uint64_t *online_bits = NULL;    // Bit id is set while user id is online
+static uint64_t *reported_bits = NULL;  // What the last presence_each_change said
+static uint64_t *dirty_bits = NULL;     // Set for users in changed
+static uint32_t *sessions = NULL;       // Connections logged in as each user
+static UserId capacity = 0;             // IDs every array has room for
+
+static UserId *changed = NULL;          // Users who went online or offline, once each
+static size_t num_changed = 0;
+static size_t changed_capacity = 0;
+
+
+/* Grow the bitmap bits from old_capacity IDs to new_capacity, clearing the new bits, and return it. */
+static uint64_t *grow_bits(uint64_t *bits, UserId old_capacity, UserId new_capacity) {
+    bits = realloc(bits, sizeof(uint64_t) * (new_capacity / WORD_BITS));
+    if (bits == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    memset(bits + old_capacity / WORD_BITS, 0, sizeof(uint64_t) * ((new_capacity - old_capacity) / WORD_BITS));
+    return bits;
+}
+
+/* Make room for user ID id. */
+static void reserve(UserId id) {
+    if (id < capacity) {
+        return;
+    }
+    UserId new_capacity = capacity == 0 ? 1024 : capacity;
+    while (new_capacity <= id) {
+        new_capacity *= 2;
+    }
+    online_bits = grow_bits(online_bits, capacity, new_capacity);
+    reported_bits = grow_bits(reported_bits, capacity, new_capacity);
+    dirty_bits = grow_bits(dirty_bits, capacity, new_capacity);
+    sessions = realloc(sessions, sizeof(uint32_t) * new_capacity);
+    if (sessions == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    memset(sessions + capacity, 0, sizeof(uint32_t) * (new_capacity - capacity));
+    capacity = new_capacity;
+}
+
+static int test_bit(const uint64_t *bits, UserId id) {
+    return (bits[id / WORD_BITS] >> (id % WORD_BITS)) & 1;
+}
+
+static void flip_bit(uint64_t *bits, UserId id) {
+    bits[id / WORD_BITS] ^= (uint64_t) 1 << (id % WORD_BITS);
+}
+
+/* Flip user id's online bit, and remember that they may have changed. */
+static void toggle(UserId id) {
+    flip_bit(online_bits, id);
+    if (test_bit(dirty_bits, id)) {
+        return;
+    }
+    flip_bit(dirty_bits, id);
+    if (num_changed == changed_capacity) {
+        changed_capacity = changed_capacity == 0 ? 64 : changed_capacity * 2;
+        changed = realloc(changed, sizeof(UserId) * changed_capacity);
+        if (changed == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    changed[num_changed++] = id;
+}
+
+
+void presence_login(UserId id) {
+    reserve(id);
+    if (sessions[id]++ == 0) {
+        toggle(id);
+    }
+}
+
+void presence_logout(UserId id) {
+    if (id < capacity && sessions[id] > 0 && --sessions[id] == 0) {
+        toggle(id);
+    }
+}
+
+int presence_online(UserId id) {
+    return id < capacity && test_bit(online_bits, id);
+}
+
+int presence_online_friends(const User *user, UserId *online) {
+    int num_online = 0;
+    for (int i = 0; i < MAX_FRIENDS && user->friends[i] != NO_USER; i++) {
+        if (presence_online(user->friends[i])) {
+            online[num_online++] = user->friends[i];
+        }
+    }
+    return num_online;
+}
+
+int presence_changed(void) {
+    return num_changed > 0;
+}
+
+void presence_each_change(void (*fn)(UserId id, int online, void *arg), void *arg) {
+    for (size_t i = 0; i < num_changed; i++) {
+        UserId id = changed[i];
+        flip_bit(dirty_bits, id);
+        if (test_bit(online_bits, id) != test_bit(reported_bits, id)) {
+            flip_bit(reported_bits, id);
+            if (fn != NULL) {
+                fn(id, test_bit(online_bits, id), arg);
+            }
+        }
+    }
+    num_changed = 0;
+}
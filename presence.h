@@ -0,0 +1,42 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "friends.h"
+
+/*
+ * Presence: which users have at least one connection logged in. A bitmap
+ * indexed by user ID says who is online, so a user's friends can be checked
+ * against it without looking at any clients; a count of sessions per user
+ * keeps a user online until their last connection goes.
+ *
+ * Changes are also remembered until presence_each_change hands them out,
+ * so they can be sent to friends in batches. A user who goes offline and
+ * back online (or the reverse) in between hasn't changed.
+ */
+
+/* Note that a connection has logged in as the user with this ID. */
+void presence_login(UserId id);
+
+/* Note that a connection logged in as the user with this ID has gone. */
+void presence_logout(UserId id);
+
+/* Return 1 if the user with this ID is online, 0 otherwise. */
+int presence_online(UserId id);
+
+/*
+ * Put the IDs of user's friends who are online into online (which has room
+ * for MAX_FRIENDS), in the order of user->friends, and return how many.
+ */
+int presence_online_friends(const User *user, UserId *online);
+
+/* Return 1 if any user's presence may have changed since it was last handed out, 0 otherwise. */
+int presence_changed(void);
+
+/*
+ * Call fn with the ID of every user whose presence has changed since the
+ * last call, and whether they are now online, then forget the changes.
+ * fn may be NULL to just forget them.
+ */
+void presence_each_change(void (*fn)(UserId id, int online, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,38 @@
+#include "ratelimit.h"
+
+/* Start bucket off full at now_us. */
+void bucket_init(TokenBucket *bucket, double rate, double burst, uint64_t now_us) {
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    bucket->last_us = now_us;
+}
+
+/* Add the tokens earned since the bucket was last updated. */
+static void refill(TokenBucket *bucket, uint64_t now_us) {
+    if (now_us > bucket->last_us) {
+        bucket->tokens += (now_us - bucket->last_us) * bucket->rate / 1e6;
+        if (bucket->tokens > bucket->burst) {
+            bucket->tokens = bucket->burst;
+        }
+        bucket->last_us = now_us;
+    }
+}
+
+/*
+ * Return how many microseconds from now_us until bucket holds n tokens
+ * (or is full, if n is more than it can hold).
+ */
+uint64_t bucket_wait_us(TokenBucket *bucket, uint64_t now_us, int n) {
+    refill(bucket, now_us);
+    double needed = n < bucket->burst ? n : bucket->burst;
+    if (bucket->tokens >= needed) {
+        return 0;
+    }
+    return (uint64_t) ((needed - bucket->tokens) * 1e6 / bucket->rate) + 1;
+}
+
+/* Take n tokens from bucket. */
+void bucket_take(TokenBucket *bucket, int n) {
+    bucket->tokens -= n;
+}
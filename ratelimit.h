@@ -0,0 +1,30 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+/*
+ * A token bucket: holds up to burst tokens and refills at rate tokens per
+ * second. Each admitted command takes one token.
+ */
+typedef struct token_bucket {
+    double tokens;
+    double rate;
+    double burst;
+    uint64_t last_us;  // When tokens was last brought up to date
+} TokenBucket;
+
+/* Start bucket off full at now_us. */
+void bucket_init(TokenBucket *bucket, double rate, double burst, uint64_t now_us);
+
+/*
+ * Return how many microseconds from now_us until bucket holds n tokens, or
+ * 0 if it already does. Taking more than burst tokens only waits for a full
+ * bucket, and leaves the bucket in debt for the rest.
+ */
+uint64_t bucket_wait_us(TokenBucket *bucket, uint64_t now_us, int n);
+
+/* Take n tokens from bucket. Only call this once bucket_wait_us has returned 0. */
+void bucket_take(TokenBucket *bucket, int n);
+
+#endif
@@ -0,0 +1,237 @@
+#include "repl.h"
+#include "capture.h"
+#include "memstats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static FILE *log_file = NULL;
+static uint64_t log_id = 0;
+static uint64_t log_end = 0;      // Offset the next record is written at
+static uint64_t flushed_end = 0;  // Everything before this has reached the file
+static FrameBuilder record;       // The record being built
+
+
+int repl_log_open(void) {
+    log_file = tmpfile();
+    if (log_file == NULL) {
+        return -1;
+    }
+    // Different for every run of the primary, and never 0
+    log_id = ((uint64_t) getpid() << 32) ^ capture_now_us() ^ 1;
+    frame_init(&record);
+    return 0;
+}
+
+int repl_log_adopt(int fd, uint64_t id, uint64_t end) {
+    log_file = fdopen(fd, "r+");
+    if (log_file == NULL) {
+        return -1;
+    }
+    // The file offset is shared with the process that handed fd over
+    if (fseek(log_file, end, SEEK_SET) == -1) {
+        fclose(log_file);
+        log_file = NULL;
+        return -1;
+    }
+    log_id = id;
+    log_end = end;
+    flushed_end = end;
+    frame_init(&record);
+    return 0;
+}
+
+int repl_log_fd(void) {
+    if (log_file == NULL) {
+        return -1;
+    }
+    fflush(log_file);
+    flushed_end = log_end;
+    return fileno(log_file);
+}
+
+int repl_log_is_open(void) {
+    return log_file != NULL;
+}
+
+uint64_t repl_log_id(void) {
+    return log_id;
+}
+
+uint64_t repl_log_end(void) {
+    return log_end;
+}
+
+/* Start a record (or other message) with this opcode, and return its offset in record. */
+static size_t begin_record(uint8_t opcode) {
+    size_t start = frame_begin(&record, opcode, 0);
+    frame_put_u64(&record, capture_now_us());
+    return start;
+}
+
+/* Finish the record begun at start and append it to the log. */
+static void end_record(size_t start) {
+    frame_end(&record, start);
+    if (fwrite(record.data, 1, record.len, log_file) != record.len) {
+        perror("replication log");
+        exit(1);
+    }
+    log_end += record.len;
+    record.len = 0;
+}
+
+void repl_log_create_user(const User *user) {
+    if (log_file == NULL) {
+        return;
+    }
+    size_t start = begin_record(REPL_CREATE_USER);
+    frame_put_str(&record, user->name);
+    end_record(start);
+}
+
+void repl_log_pair(uint8_t opcode, const User *user1, const User *user2) {
+    if (log_file == NULL) {
+        return;
+    }
+    size_t start = begin_record(opcode);
+    frame_put_u32(&record, user1->id);
+    frame_put_u32(&record, user2->id);
+    end_record(start);
+}
+
+void repl_log_post(const User *target, const Post *post) {
+    if (log_file == NULL) {
+        return;
+    }
+    size_t start = begin_record(REPL_POST);
+    frame_put_u32(&record, post->author);
+    frame_put_u32(&record, target->id);
+    frame_put_u64(&record, post->date);
+    frame_put_str(&record, post_text(post));
+    end_record(start);
+}
+
+void repl_log_delete_post(const User *user, uint32_t number) {
+    if (log_file == NULL) {
+        return;
+    }
+    size_t start = begin_record(REPL_DELETE_POST);
+    frame_put_u32(&record, user->id);
+    frame_put_u32(&record, number);
+    end_record(start);
+}
+
+void repl_log_user(uint8_t opcode, const User *user) {
+    if (log_file == NULL) {
+        return;
+    }
+    size_t start = begin_record(opcode);
+    frame_put_u32(&record, user->id);
+    end_record(start);
+}
+
+Buffer *repl_log_read(uint64_t offset, size_t max_len) {
+    if (flushed_end != log_end) {
+        fflush(log_file);
+        flushed_end = log_end;
+    }
+    if (max_len > log_end - offset) {
+        max_len = log_end - offset;
+    }
+
+    char *data = mem_alloc(MEM_RESPONSES, max_len);
+    if (pread(fileno(log_file), data, max_len, offset) != max_len) {
+        mem_free(MEM_RESPONSES, data);
+        return NULL;
+    }
+    return buffer_adopt(data, max_len);
+}
+
+/* Take the message built in record as a new buffer. */
+static Buffer *take_message(size_t start) {
+    frame_end(&record, start);
+    return frame_take(&record);
+}
+
+Buffer *repl_hello(void) {
+    size_t start = begin_record(REPL_HELLO);
+    frame_put_u64(&record, log_id);
+    return take_message(start);
+}
+
+Buffer *repl_heartbeat(void) {
+    size_t start = begin_record(REPL_HEARTBEAT);
+    frame_put_u64(&record, log_end);
+    return take_message(start);
+}
+
+Buffer *repl_subscribe(uint64_t id, uint64_t offset) {
+    size_t start = frame_begin(&record, REPL_SUBSCRIBE, 0);
+    frame_put_u64(&record, id);
+    frame_put_u64(&record, offset);
+    return take_message(start);
+}
+
+
+long repl_parse(const char *buf, size_t n, ReplRecord *out) {
+    uint32_t tag;
+    long len = frame_parse_header(buf, n, REPL_MAX_RECORD, &out->opcode, &tag);
+    if (len <= 0) {
+        return len;
+    }
+    out->time_us = 0;
+    out->user1 = NO_USER;
+    out->user2 = NO_USER;
+    out->value = 0;
+    out->offset = 0;
+    out->str = NULL;
+
+    FrameReader reader = {buf + FRAME_HEADER_LEN, len - FRAME_HEADER_LEN};
+    if (out->opcode == REPL_SUBSCRIBE) {
+        return frame_get_u64(&reader, &out->value) == -1 ||
+               frame_get_u64(&reader, &out->offset) == -1 ? -1 : len;
+    }
+    if (frame_get_u64(&reader, &out->time_us) == -1) {
+        return -1;
+    }
+
+    uint32_t number;
+    int malformed = 0;
+    switch (out->opcode) {
+        case REPL_CREATE_USER:
+            malformed = (out->str = frame_get_str(&reader, MEM_PARSE)) == NULL;
+            break;
+        case REPL_MAKE_FRIENDS:
+        case REPL_UNFRIEND:
+            malformed = frame_get_u32(&reader, &out->user1) == -1 ||
+                        frame_get_u32(&reader, &out->user2) == -1;
+            break;
+        case REPL_POST:
+            malformed = frame_get_u32(&reader, &out->user1) == -1 ||
+                        frame_get_u32(&reader, &out->user2) == -1 ||
+                        frame_get_u64(&reader, &out->value) == -1 ||
+                        (out->str = frame_get_str(&reader, MEM_PARSE)) == NULL;
+            break;
+        case REPL_DELETE_POST:
+            malformed = frame_get_u32(&reader, &out->user1) == -1 ||
+                        frame_get_u32(&reader, &number) == -1;
+            out->value = number;
+            break;
+        case REPL_DELETE_USER:
+        case REPL_ARCHIVE:
+            malformed = frame_get_u32(&reader, &out->user1) == -1;
+            break;
+        case REPL_HELLO:
+        case REPL_HEARTBEAT:
+            malformed = frame_get_u64(&reader, &out->value) == -1;
+            break;
+        default:
+            malformed = 1;
+    }
+    if (malformed) {
+        mem_free(MEM_PARSE, out->str);
+        out->str = NULL;
+        return -1;
+    }
+    return len;
+}
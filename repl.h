@@ -0,0 +1,121 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "frame.h"
+#include "friends.h"
+
+/*
+ * Replication. A primary server logs every change to its users as an
+ * ordered sequence of records, in the frame format of frame.h with a tag of
+ * 0. Followers connect to the primary's replication socket, send
+ * REPL_SUBSCRIBE with how much of the log they already have, and are sent
+ * the rest of it followed by each new record as it is logged. Applying the
+ * same records in the same order gives a follower the same users (IDs
+ * included), so it can serve the read-only commands.
+ *
+ * The log is kept in an unlinked temporary file for as long as the
+ * primary runs, so followers can always start from nothing.
+ *
+ * Everything the primary sends starts with the time it was logged or sent
+ * (8 bytes, capture_now_us). Followers compare that with their own clock to
+ * work out how far behind they are, which only makes sense when primary
+ * and followers run on one machine.
+ */
+#define REPL_SUBSCRIBE 0x01      // Follower's first and only message: log ID (8, 0 if it
+                                 // has nothing yet), log offset to start from (8)
+
+// Log records: time (8), then
+#define REPL_CREATE_USER 0x10    // name
+#define REPL_MAKE_FRIENDS 0x11   // user ID (4), user ID (4)
+#define REPL_UNFRIEND 0x12       // user ID (4), user ID (4)
+#define REPL_POST 0x13           // author ID (4), target ID (4), date (8), contents
+#define REPL_DELETE_POST 0x14    // user ID (4), post number (4, newest is 1)
+#define REPL_DELETE_USER 0x15    // user ID (4)
+#define REPL_ARCHIVE 0x16        // user ID (4), whose oldest post in memory was archived
+
+// Sent outside the log, only between records: time (8), then
+#define REPL_HELLO 0x20          // log ID (8). The reply to REPL_SUBSCRIBE. If the primary
+                                 // can't serve from where the follower asked, it follows
+                                 // this with REPL_HEARTBEAT and hangs up.
+#define REPL_HEARTBEAT 0x21      // log length (8). Sent to followers that have the whole log.
+
+#define REPL_MAX_RECORD (FRAME_MAX_REQUEST + 64)  // Longest record, header excluded
+
+
+/*
+ * Start logging changes. Return 0 on success and -1 (with errno set) on
+ * error. Until then, the repl_log functions do nothing.
+ */
+int repl_log_open(void);
+
+/*
+ * Carry on the log in file fd, with this ID and length, as handed over by
+ * another process (see handoff.h). Followers see no restart. Return 0 on
+ * success and -1 (with errno set) on error.
+ */
+int repl_log_adopt(int fd, uint64_t id, uint64_t end);
+
+/* Write out the whole log and return its file descriptor, or -1 if it isn't open. */
+int repl_log_fd(void);
+
+/* Return 1 if changes are being logged, 0 otherwise. */
+int repl_log_is_open(void);
+
+/* Return this run's log ID, which followers use to tell if the primary has restarted. */
+uint64_t repl_log_id(void);
+
+/* Return the length of the log in bytes. */
+uint64_t repl_log_end(void);
+
+/* Log the creation of user. */
+void repl_log_create_user(const User *user);
+
+/* Log a change to two users, REPL_MAKE_FRIENDS or REPL_UNFRIEND. */
+void repl_log_pair(uint8_t opcode, const User *user1, const User *user2);
+
+/* Log post, just made to target. */
+void repl_log_post(const User *target, const Post *post);
+
+/* Log the deletion of user's post number number. */
+void repl_log_delete_post(const User *user, uint32_t number);
+
+/* Log a change to one user, REPL_DELETE_USER or REPL_ARCHIVE. */
+void repl_log_user(uint8_t opcode, const User *user);
+
+/*
+ * Return a new buffer holding up to max_len bytes of the log from offset
+ * on, or NULL if it can't be read.
+ */
+Buffer *repl_log_read(uint64_t offset, size_t max_len);
+
+/* Return a new buffer holding a REPL_HELLO or REPL_HEARTBEAT message. */
+Buffer *repl_hello(void);
+Buffer *repl_heartbeat(void);
+
+/* Return a new buffer holding a REPL_SUBSCRIBE message. */
+Buffer *repl_subscribe(uint64_t log_id, uint64_t offset);
+
+
+/* A decoded message. Fields an opcode doesn't have are 0 or NULL. */
+typedef struct repl_record {
+    uint8_t opcode;
+    uint64_t time_us;
+    UserId user1;       // The only user, the author of a post, or the first of two users
+    UserId user2;       // The target of a post, or the second of two users
+    uint64_t value;     // A post's date or number, a log ID, or the log length
+    uint64_t offset;    // Where a REPL_SUBSCRIBE starts
+    char *str;          // A new user's name or a post's contents, MEM_PARSE's
+} ReplRecord;
+
+/*
+ * Decode the message at the start of the n bytes at buf into record.
+ * Return its total length, 0 if more bytes are needed, or -1 if it's
+ * malformed. The caller frees record->str, with mem_free(MEM_PARSE, ...).
+ */
+long repl_parse(const char *buf, size_t n, ReplRecord *record);
+
+#endif
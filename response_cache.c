@@ -0,0 +1,246 @@
+#include "response_cache.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_BUCKETS 64
+#define LIST_KEY NO_USER  // Key of the rendered user list; no user has this ID
+
+typedef struct cache_entry {
+    uintptr_t key;
+    unsigned long version;
+    Buffer *buf;
+    struct cache_entry *hash_next;  // Next entry in the same bucket
+    struct cache_entry *lru_prev;   // Towards the most recently used entry
+    struct cache_entry *lru_next;   // Towards the least recently used entry
+} CacheEntry;
+
+static CacheEntry **buckets = NULL;
+static size_t num_buckets = 0;
+static size_t num_entries = 0;
+
+static CacheEntry *lru_head = NULL;  // Most recently used
+static CacheEntry *lru_tail = NULL;  // Least recently used
+
+static size_t budget = CACHE_BUDGET;
+static size_t used = 0;
+
+
+/* Bytes charged against the budget for entry. */
+static size_t entry_cost(const CacheEntry *entry) {
+    return sizeof(CacheEntry) + sizeof(Buffer) + entry->buf->len;
+}
+
+static size_t bucket_of(uintptr_t key, size_t n) {
+    // Keys are dense user IDs; spread neighbouring IDs across the table.
+    uint64_t h = key;
+    h ^= h >> 17;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (h >> 32) & (n - 1);
+}
+
+static void lru_unlink(CacheEntry *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(CacheEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->lru_prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+/* Double the number of buckets, rehashing every entry. */
+static void grow_table(void) {
+    size_t new_size = num_buckets == 0 ? INITIAL_BUCKETS : num_buckets * 2;
+    CacheEntry **new_buckets = Malloc(sizeof(CacheEntry *) * new_size);
+    memset(new_buckets, 0, sizeof(CacheEntry *) * new_size);
+
+    for (size_t i = 0; i < num_buckets; i++) {
+        CacheEntry *curr = buckets[i];
+        while (curr != NULL) {
+            CacheEntry *next = curr->hash_next;
+            size_t b = bucket_of(curr->key, new_size);
+            curr->hash_next = new_buckets[b];
+            new_buckets[b] = curr;
+            curr = next;
+        }
+    }
+
+    free(buckets);
+    buckets = new_buckets;
+    num_buckets = new_size;
+}
+
+static CacheEntry *lookup(uintptr_t key) {
+    if (num_buckets == 0) {
+        return NULL;
+    }
+    CacheEntry *curr = buckets[bucket_of(key, num_buckets)];
+    while (curr != NULL && curr->key != key) {
+        curr = curr->hash_next;
+    }
+    return curr;
+}
+
+/* Remove entry from the table and the LRU list and free it. */
+static void evict(CacheEntry *entry) {
+    CacheEntry **link = &buckets[bucket_of(entry->key, num_buckets)];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    lru_unlink(entry);
+
+    used -= entry_cost(entry);
+    num_entries--;
+    buffer_unref(entry->buf);
+    free(entry);
+}
+
+static void enforce_budget(void) {
+    while (lru_tail != NULL && used > budget) {
+        evict(lru_tail);
+    }
+}
+
+/*
+ * Return a new reference to the cached rendering for key if it is still at
+ * version, or NULL on a miss.
+ */
+static Buffer *cache_get(uintptr_t key, unsigned long version) {
+    CacheEntry *entry = lookup(key);
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (entry->version != version) {
+        evict(entry);  // stale, it can never be valid again
+        return NULL;
+    }
+    lru_unlink(entry);
+    lru_push_front(entry);
+    return buffer_ref(entry->buf);
+}
+
+/* Cache buf as the rendering of key at version. The cache takes its own reference. */
+static void cache_put(uintptr_t key, unsigned long version, Buffer *buf) {
+    CacheEntry *entry = lookup(key);
+    if (entry != NULL) {
+        evict(entry);
+    }
+
+    if (sizeof(CacheEntry) + sizeof(Buffer) + buf->len > budget) {
+        return;  // would evict everything else and still not fit
+    }
+
+    if (num_entries >= num_buckets) {
+        grow_table();
+    }
+
+    entry = Malloc(sizeof(CacheEntry));
+    entry->key = key;
+    entry->version = version;
+    entry->buf = buffer_ref(buf);
+    size_t b = bucket_of(key, num_buckets);
+    entry->hash_next = buckets[b];
+    buckets[b] = entry;
+    lru_push_front(entry);
+
+    used += entry_cost(entry);
+    num_entries++;
+    enforce_budget();
+}
+
+
+/*
+ * Set the memory budget (in bytes) of the response cache.
+ */
+void cache_set_budget(size_t new_budget) {
+    budget = new_budget;
+    enforce_budget();
+}
+
+
+/*
+ * Return the rendered user list, re-rendering only on a version change.
+ */
+Buffer *cached_list_users(const User *head) {
+    Buffer *buf = cache_get(LIST_KEY, users_version);
+    if (buf == NULL) {
+        char *rendered = list_users(head);
+        buf = buffer_adopt(rendered, strlen(rendered));
+        cache_put(LIST_KEY, users_version, buf);
+    }
+    return buf;
+}
+
+
+/*
+ * Return the rendered profile of user, re-rendering only on a version change.
+ */
+Buffer *cached_print_user(const User *user) {
+    if (user == NULL) {
+        return NULL;
+    }
+
+    uintptr_t key = user->id;
+    Buffer *buf = cache_get(key, user->version);
+    if (buf == NULL) {
+        char *rendered = print_user(user);
+        buf = buffer_adopt(rendered, strlen(rendered));
+        cache_put(key, user->version, buf);
+    }
+    return buf;
+}
+
+
+/*
+ * Drop the cached profile of the user with this ID.
+ */
+void cache_forget_user(UserId id) {
+    CacheEntry *entry = lookup(id);
+    if (entry != NULL) {
+        evict(entry);
+    }
+}
+
+
+/*
+ * Call fn on every entry, least recently used first.
+ */
+void cache_each(void (*fn)(uintptr_t key, unsigned long version, const Buffer *buf, void *arg), void *arg) {
+    for (CacheEntry *entry = lru_tail; entry != NULL; entry = entry->lru_prev) {
+        fn(entry->key, entry->version, entry->buf, arg);
+    }
+}
+
+
+/*
+ * Return the cached rendering for key if it is still at version.
+ */
+Buffer *cache_lookup(uintptr_t key, unsigned long version) {
+    return cache_get(key, version);
+}
+
+
+/*
+ * Cache buf as the rendering for key at version, as the most recently used entry.
+ */
+void cache_store(uintptr_t key, unsigned long version, Buffer *buf) {
+    cache_put(key, version, buf);
+}
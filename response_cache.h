@@ -0,0 +1,56 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include "buffer.h"
+#include "friends.h"
+
+#ifndef CACHE_BUDGET
+  #define CACHE_BUDGET (4 * 1024 * 1024)  // Default bytes of rendered output to keep
+#endif
+
+/*
+ * Set the memory budget (in bytes) of the response cache. Entries are evicted
+ * in least recently used order until the cache fits in the new budget.
+ */
+void cache_set_budget(size_t budget);
+
+/*
+ * Return the rendered user list for the list starting at head, re-rendering
+ * it with list_users only if a user has been created since it was cached.
+ * The caller owns the returned reference and must buffer_unref it.
+ */
+Buffer *cached_list_users(const User *head);
+
+/*
+ * Return the rendered profile of user, re-rendering it with print_user only
+ * if the user's version has changed since it was cached.
+ * The caller owns the returned reference and must buffer_unref it.
+ * Return NULL if user is NULL.
+ */
+Buffer *cached_print_user(const User *user);
+
+/*
+ * Drop the cached profile of the user with this ID, if any, once the user
+ * has been removed. IDs aren't reused, so it could never be hit again.
+ */
+void cache_forget_user(UserId id);
+
+/*
+ * Call fn on every cached rendering, least recently used first: its key
+ * (a user ID, or NO_USER for the user list), version and contents. Handing
+ * each one to cache_store, in the same order, rebuilds the cache as it
+ * was, e.g. in another process.
+ */
+void cache_each(void (*fn)(uintptr_t key, unsigned long version, const Buffer *buf, void *arg), void *arg);
+
+/*
+ * Return a new reference to the cached rendering for key (a user ID, or
+ * NO_USER for the user list) if it is of version, or NULL on a miss. For
+ * renderings done elsewhere, e.g. by a worker (see worker.h).
+ */
+Buffer *cache_lookup(uintptr_t key, unsigned long version);
+
+/* Cache buf as the rendering for key at version. The cache takes its own reference. */
+void cache_store(uintptr_t key, unsigned long version, Buffer *buf);
+
+#endif
@@ -0,0 +1,118 @@
+#include "retention.h"
+#include "archive.h"
+#include "epoch.h"
+#include "memstats.h"
+#include <stdlib.h>
+
+#define PENDING_SIZE 4096  // Users over the cap waiting to be trimmed
+
+// Ring of users that may be over POST_CAP. If it fills up, later users are
+// trimmed by the TTL sweep instead, which checks the cap too.
+static UserId pending[PENDING_SIZE];
+static int pending_start = 0;
+static int pending_count = 0;
+
+static UserId sweep_next = 1;  // Next user the TTL sweep looks at
+
+void (*retention_archived)(const User *user) = NULL;
+
+
+int archive_oldest_post(User *user) {
+    if (user->last_post == NULL) {
+        return -1;
+    }
+    // Only let the post go once its record has reached the file
+    uint64_t offset = archive_append(user->last_post, user->archive_head);
+    if (offset == 0 || archive_flush() == -1) {
+        return -1;
+    }
+
+    Post *post = remove_oldest_post(user);
+    note_archived(user, offset);
+    epoch_retire(post, free_post);  // A worker may be rendering it
+    return 0;
+}
+
+void note_archived(User *user, uint64_t offset) {
+    if (user->num_archived % HISTORY_PAGE_SIZE == 0) {
+        unsigned long indexed = user->num_archived / HISTORY_PAGE_SIZE;
+        user->history_index = mem_realloc(MEM_USERS, user->history_index, sizeof(uint64_t) * (indexed + 1));
+        user->history_index[indexed] = offset;
+    }
+    if (offset != 0) {
+        user->archive_head = offset;
+    }
+    user->num_archived++;
+}
+
+void retention_note(const User *user) {
+    if (POST_CAP > 0 && user->num_posts > POST_CAP && pending_count < PENDING_SIZE) {
+        pending[(pending_start + pending_count) % PENDING_SIZE] = user->id;
+        pending_count++;
+    }
+}
+
+/* archive_oldest_post, telling retention_archived about it. */
+static int archive_and_report(User *user) {
+    if (archive_oldest_post(user) == -1) {
+        return -1;
+    }
+    if (retention_archived != NULL) {
+        retention_archived(user);
+    }
+    return 0;
+}
+
+/* Return 1 if user's oldest post in memory should be archived at time now, 0 otherwise. */
+static int should_archive(const User *user, time_t now) {
+    if (user->last_post == NULL) {
+        return 0;
+    }
+    return (POST_CAP > 0 && user->num_posts > POST_CAP) ||
+           (POST_TTL > 0 && user->last_post->date + POST_TTL <= now);
+}
+
+int retention_step(time_t now) {
+    if (!archive_is_open()) {
+        return 0;
+    }
+
+    int archived = 0;
+    while (pending_count > 0 && archived < RETENTION_POSTS_PER_STEP) {
+        User *user = user_by_id(pending[pending_start]);
+        while (user != NULL && POST_CAP > 0 && user->num_posts > POST_CAP &&
+               archived < RETENTION_POSTS_PER_STEP) {
+            if (archive_and_report(user) == -1) {
+                return archived;
+            }
+            archived++;
+        }
+        if (user != NULL && POST_CAP > 0 && user->num_posts > POST_CAP) {
+            break;  // Out of budget; carry on with this user next step
+        }
+        pending_start = (pending_start + 1) % PENDING_SIZE;
+        pending_count--;
+    }
+
+    // Posts are in date order, so only the oldest ones ever need looking at
+    for (int i = 0; i < RETENTION_USERS_PER_STEP && archived < RETENTION_POSTS_PER_STEP; i++) {
+        if (sweep_next >= user_id_limit()) {
+            sweep_next = 1;
+        }
+        User *user = user_by_id(sweep_next);
+        if (user == NULL) {
+            sweep_next++;
+            continue;
+        }
+        while (should_archive(user, now) && archived < RETENTION_POSTS_PER_STEP) {
+            if (archive_and_report(user) == -1) {
+                return archived;
+            }
+            archived++;
+        }
+        if (!should_archive(user, now)) {
+            sweep_next++;
+        }
+    }
+    return archived;
+}
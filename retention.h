@@ -0,0 +1,49 @@
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <time.h>
+
+#include "friends.h"
+
+/*
+ * Post retention: users keep at most POST_CAP posts in memory, none older
+ * than POST_TTL seconds. Older posts are moved to the archive (see
+ * archive.h) a few at a time by retention_step, so memory use follows the
+ * posts people are actually reading rather than every post ever made.
+ * Nothing is moved unless an archive is open.
+ */
+#ifndef POST_CAP
+  #define POST_CAP 100                  // 0 for no cap
+#endif
+#ifndef POST_TTL
+  #define POST_TTL (7 * 24 * 60 * 60)   // 0 for no TTL
+#endif
+#define RETENTION_USERS_PER_STEP 1024   // Users checked for expired posts per step
+#define RETENTION_POSTS_PER_STEP 256    // Posts archived per step
+#define HISTORY_PAGE_SIZE 20            // Archived posts shown per page of history
+
+/* If set, called with the user each time retention_step archives one of their posts. */
+extern void (*retention_archived)(const User *user);
+
+/* Note that user has been posted to, and may now be over POST_CAP. */
+void retention_note(const User *user);
+
+/*
+ * Do a bounded amount of retention work: archive posts of users noted as
+ * over the cap, then check the next few users (in ID order, wrapping
+ * around) for posts older than the TTL. Return the number of posts archived.
+ */
+int retention_step(time_t now);
+
+/* Move user's oldest post in memory to the archive. Return 0 on success and -1 on error. */
+int archive_oldest_post(User *user);
+
+/*
+ * Count one more of user's posts as archived, in the record at offset (0 if
+ * it was dropped instead). Every HISTORY_PAGE_SIZE'th one's offset, counting
+ * from the oldest, goes in user's history_index, so any page of history can
+ * be found without following the whole chain to it.
+ */
+void note_archived(User *user, uint64_t offset);
+
+#endif
@@ -0,0 +1,178 @@
+#include "snapshot.h"
+#include "buffer.h"
+#include "response_cache.h"
+#include "poststore.h"
+#include "memstats.h"
+#include "retention.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/* cache_each callback: append one cache entry to the builder at arg. */
+static void save_entry(uintptr_t key, unsigned long version, const Buffer *buf, void *arg) {
+    FrameBuilder *builder = arg;
+    frame_put_u32(builder, key);
+    frame_put_u64(builder, version);
+    frame_put_u32(builder, buf->len);
+    frame_put_bytes(builder, buf->data, buf->len);
+}
+
+/* cache_each callback: count the entries. */
+static void count_entry(uintptr_t key, unsigned long version, const Buffer *buf, void *arg) {
+    (*(uint32_t *) arg)++;
+}
+
+void snapshot_save(FrameBuilder *builder, const User *head) {
+    uint32_t num_users = 0;
+    for (const User *user = head; user != NULL; user = user->next) {
+        num_users++;
+    }
+    frame_put_u32(builder, user_id_limit());
+    frame_put_u64(builder, users_version);
+    frame_put_u32(builder, num_users);
+
+    for (const User *user = head; user != NULL; user = user->next) {
+        frame_put_u32(builder, user->id);
+        frame_put_str(builder, user->name);
+        frame_put_str(builder, user->profile_pic);
+        frame_put_u64(builder, user->version);
+        frame_put_u64(builder, user->archive_head);
+        frame_put_u64(builder, user->num_archived);
+        for (unsigned long i = 0; i * HISTORY_PAGE_SIZE < user->num_archived; i++) {
+            frame_put_u64(builder, user->history_index[i]);
+        }
+
+        uint8_t num_friends = 0;
+        while (num_friends < MAX_FRIENDS && user->friends[num_friends] != NO_USER) {
+            num_friends++;
+        }
+        frame_put_u8(builder, num_friends);
+        for (int i = 0; i < num_friends; i++) {
+            frame_put_u32(builder, user->friends[i]);
+        }
+
+        frame_put_u32(builder, user->num_posts);
+        for (const Post *post = user->last_post; post != NULL; post = post->prev) {
+            frame_put_u32(builder, post->author);
+            frame_put_u64(builder, post->date);
+            frame_put_str(builder, post_text(post));
+        }
+    }
+
+    uint32_t num_entries = 0;
+    cache_each(count_entry, &num_entries);
+    frame_put_u32(builder, num_entries);
+    cache_each(save_entry, builder);
+}
+
+/* Recreate the next user saved in reader, appending them after *tail. Return 0 on success and -1 on error. */
+static int load_user(FrameReader *reader, User **user_ptr_add, User **tail) {
+    uint32_t id;
+    if (frame_get_u32(reader, &id) == -1 || id == NO_USER || id < user_id_limit()) {
+        return -1;
+    }
+    char *name = frame_get_str(reader, MEM_PARSE);
+    char *profile_pic = frame_get_str(reader, MEM_PARSE);
+    if (name == NULL || profile_pic == NULL || strlen(name) >= MAX_NAME || strlen(profile_pic) >= MAX_NAME ||
+        find_user(name, *user_ptr_add) != NULL) {
+        mem_free(MEM_PARSE, name);
+        mem_free(MEM_PARSE, profile_pic);
+        return -1;
+    }
+    User *user = restore_user(id, name, user_ptr_add, tail);
+    strcpy(user->profile_pic, profile_pic);
+    mem_free(MEM_PARSE, name);
+    mem_free(MEM_PARSE, profile_pic);
+
+    uint64_t version;
+    uint64_t num_archived;
+    uint8_t num_friends;
+    if (frame_get_u64(reader, &version) == -1 ||
+        frame_get_u64(reader, &user->archive_head) == -1 ||
+        frame_get_u64(reader, &num_archived) == -1) {
+        return -1;
+    }
+    // Checked against what's left, so a bad count can't ask for too much
+    uint64_t num_indexed = num_archived / HISTORY_PAGE_SIZE + (num_archived % HISTORY_PAGE_SIZE != 0);
+    if (num_indexed > reader->left / 8) {
+        return -1;
+    }
+    user->num_archived = num_archived;
+    if (num_indexed > 0) {
+        user->history_index = mem_alloc(MEM_USERS, sizeof(uint64_t) * num_indexed);
+        for (uint64_t i = 0; i < num_indexed; i++) {
+            frame_get_u64(reader, &user->history_index[i]);
+        }
+    }
+    if (frame_get_u8(reader, &num_friends) == -1 || num_friends > MAX_FRIENDS) {
+        return -1;
+    }
+    for (int i = 0; i < num_friends; i++) {
+        if (frame_get_u32(reader, &user->friends[i]) == -1) {
+            return -1;
+        }
+        if (user->friends[i] < user->id) {
+            mem_charge(MEM_FRIENDSHIPS, 0, 1);  // Both lists have it; count it in the higher ID's
+        }
+    }
+
+    uint32_t num_posts;
+    if (frame_get_u32(reader, &num_posts) == -1) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < num_posts; i++) {
+        uint32_t author;
+        uint64_t date;
+        char *contents;
+        if (frame_get_u32(reader, &author) == -1 || frame_get_u64(reader, &date) == -1 ||
+            (contents = frame_get_str(reader, MEM_POSTS)) == NULL) {
+            return -1;
+        }
+        add_post(user, author, contents, date);
+        store_pack(user->first_post);
+    }
+    user->version = version;  // add_post bumped it
+    return 0;
+}
+
+int snapshot_load(FrameReader *reader, User **user_ptr_add) {
+    uint32_t id_limit;
+    uint64_t saved_users_version;
+    uint32_t num_users;
+    if (frame_get_u32(reader, &id_limit) == -1 ||
+        frame_get_u64(reader, &saved_users_version) == -1 ||
+        frame_get_u32(reader, &num_users) == -1) {
+        return -1;
+    }
+
+    User *tail = NULL;
+    for (uint32_t i = 0; i < num_users; i++) {
+        if (load_user(reader, user_ptr_add, &tail) == -1) {
+            return -1;
+        }
+    }
+    if (id_limit < user_id_limit()) {
+        return -1;
+    }
+    reserve_user_ids(id_limit);
+    users_version = saved_users_version;
+
+    uint32_t num_entries;
+    if (frame_get_u32(reader, &num_entries) == -1) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < num_entries; i++) {
+        uint32_t key;
+        uint64_t version;
+        uint32_t len;
+        const char *data;
+        if (frame_get_u32(reader, &key) == -1 || frame_get_u64(reader, &version) == -1 ||
+            frame_get_u32(reader, &len) == -1 || (data = frame_get_bytes(reader, len)) == NULL) {
+            return -1;
+        }
+        Buffer *buf = buffer_new(data, len);
+        cache_store(key, version, buf);
+        buffer_unref(buf);
+    }
+    return 0;
+}
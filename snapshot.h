@@ -0,0 +1,36 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "frame.h"
+#include "friends.h"
+
+/*
+ * A snapshot of every user with their posts in memory, and of the response
+ * cache, for handing a running server's state to the process replacing it
+ * (see handoff.h). Fields are encoded as in frame.h:
+ *
+ *   one more than the highest ID handed out (4), users_version (8),
+ *   user count (4), then per user in list order:
+ *     ID (4), name, profile_pic, version (8), archive_head (8),
+ *     num_archived (8), history index (8 per HISTORY_PAGE_SIZE archived
+ *     posts, rounded up), friend count (1), friend IDs (4 each),
+ *     post count (4), then per post, oldest first:
+ *       author ID (4), date (8), contents
+ *   cache entry count (4), then per entry, least recently used first:
+ *     key (4), version (8), length (4), that many bytes
+ *
+ * Versions are kept, so cached renderings are still valid afterwards.
+ */
+
+/* Append a snapshot of the users in the list starting at head, and of the cache, to builder. */
+void snapshot_save(FrameBuilder *builder, const User *head);
+
+/*
+ * Recreate the users and cache saved in the snapshot at reader, in a
+ * process that has neither yet, putting the users in the list whose head is
+ * pointed to by *user_ptr_add. Return 0 on success and -1 if the snapshot
+ * is malformed.
+ */
+int snapshot_load(FrameReader *reader, User **user_ptr_add);
+
+#endif
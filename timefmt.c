@@ -0,0 +1,77 @@
+#include "timefmt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Offsets of the minute and second digits in "Www Mmm dd hh:mm:ss yyyy\n"
+#define MIN_OFFSET 14
+#define SEC_OFFSET 17
+
+/*
+ * Per-thread cache of the most recently formatted date. Any time in
+ * [window_start, window_start + window_len) shares everything but its
+ * minutes and seconds with cached_str. The window is normally the whole
+ * local hour, and is narrowed when a UTC offset change falls inside it.
+ */
+static __thread time_t window_start = -1;
+static __thread int window_len = 0;
+static __thread time_t cached_time = -1;
+static __thread char cached_str[DATE_STR_LEN + 1];
+
+
+static void put_two_digits(char *dest, int value) {
+    dest[0] = '0' + value / 10;
+    dest[1] = '0' + value % 10;
+}
+
+
+/* Return 1 if t has the UTC offset gmtoff, 0 otherwise. */
+static int has_offset(time_t t, long gmtoff) {
+    struct tm local;
+    return localtime_r(&t, &local) != NULL && local.tm_gmtoff == gmtoff;
+}
+
+
+/*
+ * Format t like asctime(localtime(&t)) into out.
+ */
+size_t format_date(time_t t, char *out) {
+    if (t != cached_time) {
+        if (window_start != -1 && t >= window_start && t < window_start + window_len) {
+            int into_window = t - window_start;
+            if (window_len == 3600) {
+                put_two_digits(cached_str + MIN_OFFSET, into_window / 60);
+            }
+            put_two_digits(cached_str + SEC_OFFSET, into_window % 60);
+        } else {
+            struct tm local;
+            char formatted[26 + DATE_STR_LEN]; // asctime_r wants at least 26 bytes
+            if (localtime_r(&t, &local) == NULL || asctime_r(&local, formatted) == NULL
+                    || strlen(formatted) != DATE_STR_LEN) {
+                // Year out of four digit range; don't cache something we can't patch
+                snprintf(out, DATE_STR_LEN + 1, "%-*ld\n", DATE_STR_LEN - 1, (long) t);
+                return DATE_STR_LEN;
+            }
+            memcpy(cached_str, formatted, DATE_STR_LEN + 1);
+
+            // Use the whole hour unless the offset changes during it (some
+            // zones shift by 30 or 45 minutes), then the minute, then just t.
+            window_start = t - (local.tm_min * 60 + local.tm_sec);
+            window_len = 3600;
+            if (!has_offset(window_start, local.tm_gmtoff) ||
+                    !has_offset(window_start + window_len - 1, local.tm_gmtoff)) {
+                window_start = t - local.tm_sec;
+                window_len = 60;
+                if (!has_offset(window_start, local.tm_gmtoff) ||
+                        !has_offset(window_start + window_len - 1, local.tm_gmtoff)) {
+                    window_start = t;
+                    window_len = 1;
+                }
+            }
+        }
+        cached_time = t;
+    }
+
+    memcpy(out, cached_str, DATE_STR_LEN + 1);
+    return DATE_STR_LEN;
+}
@@ -0,0 +1,19 @@
+#ifndef TIMEFMT_H
+#define TIMEFMT_H
+
+#include <stddef.h>
+#include <time.h>
+
+// Length of a formatted date, "Www Mmm dd hh:mm:ss yyyy\n", without the null
+#define DATE_STR_LEN 25
+
+/*
+ * Write t, formatted the same way as asctime(localtime(&t)), into out, which
+ * must have room for DATE_STR_LEN + 1 characters. Return DATE_STR_LEN.
+ *
+ * Safe to call from multiple threads. Each thread caches the last local hour
+ * it formatted, so dates close together only cost a memcpy and a few digits.
+ */
+size_t format_date(time_t t, char *out);
+
+#endif
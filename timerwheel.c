@@ -0,0 +1,150 @@
+#include "timerwheel.h"
+#include <stddef.h>
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+/* Start wheel off empty at now_us. */
+void wheel_init(TimerWheel *wheel, uint64_t now_us) {
+    wheel->start_us = now_us;
+    wheel->now_tick = 0;
+    wheel->num_timers = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            wheel->slots[level][slot] = NULL;
+        }
+    }
+}
+
+void timer_init(Timer *timer, void (*expire)(Timer *timer)) {
+    timer->expires = 0;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expire = expire;
+}
+
+int timer_pending(const Timer *timer) {
+    return timer->pprev != NULL;
+}
+
+uint64_t timer_expires_us(const TimerWheel *wheel, const Timer *timer) {
+    return wheel->start_us + timer->expires * WHEEL_TICK_US;
+}
+
+/*
+ * Put timer, which must fire after the current tick, into the slot for its
+ * tick: level 0 holds the next WHEEL_SLOTS ticks one per slot, level 1 the
+ * ones after that WHEEL_SLOTS ticks per slot, and so on.
+ */
+static void insert(TimerWheel *wheel, Timer *timer) {
+    uint64_t delta = timer->expires - wheel->now_tick;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    if (delta >= (uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) {
+        // Too far away to fit; it's moved again once it's in range
+        timer->expires = wheel->now_tick + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+
+    Timer **slot = &wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) & SLOT_MASK];
+    timer->next = *slot;
+    if (timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/* Take timer out of its slot. */
+static void unlink_timer(Timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void wheel_schedule(TimerWheel *wheel, Timer *timer, uint64_t expires_us) {
+    if (timer_pending(timer)) {
+        unlink_timer(timer);
+        wheel->num_timers--;
+    }
+
+    // Round up, so the timer never fires early
+    uint64_t expires = 0;
+    if (expires_us > wheel->start_us) {
+        expires = (expires_us - wheel->start_us + WHEEL_TICK_US - 1) / WHEEL_TICK_US;
+    }
+    if (expires <= wheel->now_tick) {
+        expires = wheel->now_tick + 1;
+    }
+    timer->expires = expires;
+    insert(wheel, timer);
+    wheel->num_timers++;
+}
+
+void wheel_cancel(TimerWheel *wheel, Timer *timer) {
+    if (timer_pending(timer)) {
+        unlink_timer(timer);
+        wheel->num_timers--;
+    }
+}
+
+/* Move every timer in the given slot down to the level that now suits it. */
+static void cascade(TimerWheel *wheel, int level, int slot) {
+    Timer *timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        insert(wheel, timer);
+        timer = next;
+    }
+}
+
+void wheel_advance(TimerWheel *wheel, uint64_t now_us) {
+    if (now_us < wheel->start_us) {
+        return;
+    }
+    uint64_t target = (now_us - wheel->start_us) / WHEEL_TICK_US;
+    while (wheel->now_tick < target) {
+        if (wheel->num_timers == 0) {
+            wheel->now_tick = target;  // Nothing to run, so skip straight there
+            break;
+        }
+        wheel->now_tick++;
+
+        // At the start of each level's slot, move its timers down a level,
+        // highest level first so they can keep moving down
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 && (wheel->now_tick & (((uint64_t) 1 << (WHEEL_BITS * (top + 1))) - 1)) == 0) {
+            top++;
+        }
+        for (int level = top; level > 0; level--) {
+            cascade(wheel, level, (wheel->now_tick >> (WHEEL_BITS * level)) & SLOT_MASK);
+        }
+
+        Timer **slot = &wheel->slots[0][wheel->now_tick & SLOT_MASK];
+        while (*slot != NULL) {
+            Timer *timer = *slot;
+            unlink_timer(timer);
+            wheel->num_timers--;
+            timer->expire(timer);
+        }
+    }
+}
+
+uint64_t wheel_timeout_us(const TimerWheel *wheel, uint64_t now_us) {
+    if (wheel->num_timers == 0) {
+        return UINT64_MAX;
+    }
+
+    // Only the rest of level 0 needs to be looked at: the wheel must be
+    // advanced at the end of it anyway, to move timers down from level 1.
+    uint64_t tick = wheel->now_tick + 1;
+    while ((tick & SLOT_MASK) != 0 && wheel->slots[0][tick & SLOT_MASK] == NULL) {
+        tick++;
+    }
+    uint64_t due_us = wheel->start_us + tick * WHEEL_TICK_US;
+    return due_us > now_us ? due_us - now_us : 0;
+}
@@ -0,0 +1,72 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+/*
+ * A hierarchical timer wheel. Scheduling and cancelling a timer are O(1),
+ * and so is the work per tick: timers sit in the level whose slots are just
+ * fine enough for how far away they are, and are moved down a level (at
+ * most WHEEL_LEVELS - 1 times) as their time approaches.
+ *
+ * Time is counted in ticks of WHEEL_TICK_US, so timers fire up to one tick
+ * late, never early.
+ */
+#ifndef WHEEL_TICK_US
+  #define WHEEL_TICK_US 100000  // 100 ms
+#endif
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)  // Slots per level
+#define WHEEL_LEVELS 4                 // Covers 2^24 ticks, about 19 days
+
+/* A timer. Embed one in whatever it times and get back to that with its address. */
+typedef struct timer {
+    uint64_t expires;     // Tick the timer fires on
+    struct timer *next;
+    struct timer **pprev; // The pointer to this timer, or NULL if it isn't scheduled
+    void (*expire)(struct timer *timer);  // Called when it fires
+} Timer;
+
+typedef struct timer_wheel {
+    uint64_t start_us;    // When tick 0 began
+    uint64_t now_tick;    // Every tick up to and including this one has been run
+    long num_timers;
+    Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+/* Start wheel off empty at now_us. */
+void wheel_init(TimerWheel *wheel, uint64_t now_us);
+
+/* Start timer off unscheduled, calling expire whenever it fires. */
+void timer_init(Timer *timer, void (*expire)(Timer *timer));
+
+/* Return 1 if timer is scheduled, 0 otherwise. */
+int timer_pending(const Timer *timer);
+
+/* Return when timer will fire. Only meaningful if it is pending. */
+uint64_t timer_expires_us(const TimerWheel *wheel, const Timer *timer);
+
+/*
+ * Schedule timer to fire at expires_us (or on the next tick, if that has
+ * passed), rescheduling it if it was already pending.
+ */
+void wheel_schedule(TimerWheel *wheel, Timer *timer, uint64_t expires_us);
+
+/* Unschedule timer. Does nothing if it isn't pending. */
+void wheel_cancel(TimerWheel *wheel, Timer *timer);
+
+/*
+ * Run every tick up to now_us, calling the expire function of each timer
+ * that fires. Timers are unscheduled before that is called, so it may
+ * reschedule them, cancel others or free them.
+ */
+void wheel_advance(TimerWheel *wheel, uint64_t now_us);
+
+/*
+ * Return how many microseconds after now_us the wheel next needs to be
+ * advanced, or UINT64_MAX if no timers are scheduled. This may be earlier
+ * than the next timer fires, but never later.
+ */
+uint64_t wheel_timeout_us(const TimerWheel *wheel, uint64_t now_us);
+
+#endif
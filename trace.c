@@ -0,0 +1,97 @@
+#include "trace.h"
+#include "friends.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+typedef struct trace_record {
+    const char *name;
+    uint64_t time_ns;
+    char phase;
+} TraceRecord;
+
+/* One thread's ring of events. Rings are never freed, so a dump can read them at any time. */
+typedef struct trace_ring {
+    long tid;
+    uint64_t count;  // Events ever recorded; the newest is at (count - 1) % TRACE_RING_SIZE
+    TraceRecord records[TRACE_RING_SIZE];
+    struct trace_ring *next;
+} TraceRing;
+
+static __thread TraceRing *ring = NULL;
+static TraceRing *all_rings = NULL;  // Every thread's ring, newest first
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Allocate and register this thread's ring the first time it records an event. */
+static TraceRing *new_ring(void) {
+    TraceRing *new = Malloc(sizeof(TraceRing));
+    new->tid = syscall(SYS_gettid);
+    new->count = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    new->next = all_rings;
+    all_rings = new;
+    pthread_mutex_unlock(&rings_lock);
+    return new;
+}
+
+
+/*
+ * Record that the phase name began or ended on this thread.
+ */
+void trace_event(const char *name, char phase) {
+    if (ring == NULL) {
+        ring = new_ring();
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    TraceRecord *record = &ring->records[ring->count % TRACE_RING_SIZE];
+    record->name = name;
+    record->time_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    record->phase = phase;
+    __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Write every thread's recorded events to path as Chrome trace JSON.
+ * Events other threads record while the dump runs may or may not be included.
+ */
+long trace_dump(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    TraceRing *rings = all_rings;
+    pthread_mutex_unlock(&rings_lock);
+
+    long written = 0;
+    fprintf(out, "{\"traceEvents\":[");
+    for (TraceRing *curr = rings; curr != NULL; curr = curr->next) {
+        uint64_t count = __atomic_load_n(&curr->count, __ATOMIC_ACQUIRE);
+        uint64_t first = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+        for (uint64_t i = first; i < count; i++) {
+            const TraceRecord *record = &curr->records[i % TRACE_RING_SIZE];
+            fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%ld}",
+                    written == 0 ? "" : ",", record->name, record->phase,
+                    (unsigned long long) (record->time_ns / 1000),
+                    (unsigned long long) (record->time_ns % 1000),
+                    (int) getpid(), curr->tid);
+            written++;
+        }
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    if (fclose(out) != 0) {
+        return -1;
+    }
+    return written;
+}
@@ -0,0 +1,34 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Low overhead phase tracing. Build with -DTRACE (make TRACE=1) to record
+ * timestamped begin/end events into a per-thread ring buffer; otherwise the
+ * TRACE_* macros compile to nothing.
+ *
+ * Event names must be string literals (or otherwise outlive the trace),
+ * since only the pointer is recorded.
+ */
+#ifndef TRACE_RING_SIZE
+  #define TRACE_RING_SIZE 65536  // Events kept per thread; older ones are overwritten
+#endif
+
+#ifdef TRACE
+  #define TRACE_BEGIN(name) trace_event((name), 'B')
+  #define TRACE_END(name) trace_event((name), 'E')
+#else
+  #define TRACE_BEGIN(name) ((void) 0)
+  #define TRACE_END(name) ((void) 0)
+#endif
+
+/* Record that the phase name began ('B') or ended ('E') on this thread. */
+void trace_event(const char *name, char phase);
+
+/*
+ * Write every thread's recorded events to the file at path in the Chrome
+ * trace event JSON format, which chrome://tracing and Perfetto can open.
+ * Return the number of events written, or -1 if the file can't be written.
+ */
+long trace_dump(const char *path);
+
+#endif
@@ -0,0 +1,168 @@
+#include "worker.h"
+#include "epoch.h"
+#include "friends.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+typedef struct job {
+    void (*run)(void *arg);
+    void (*finish)(void *arg);
+    void *arg;
+    EpochReader *reader;  // Entered on submission, left once run returns
+    struct job *next;     // In the queue, then on the done stack, then on the spare list
+} Job;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static Job *queue_head = NULL;  // Submitted jobs no worker has taken yet, oldest first
+static Job *queue_tail = NULL;
+
+// Finished jobs, most recently finished first. Workers push onto it with
+// compare-and-swap, and the event loop takes the whole stack at once.
+static Job *done = NULL;
+static int event_fd = -1;  // Counts pushes onto done since the event loop last looked
+
+// Only touched by the event loop's thread
+static Job *spare = NULL;  // Collected jobs, kept for reuse since readers are never freed
+static int outstanding = 0;  // Submitted and not yet collected
+
+
+/* A worker thread: run jobs as they're queued, forever. */
+static void *work(void *unused) {
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&queued, &lock);
+        }
+        Job *job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+
+        job->run(job->arg);
+        epoch_exit_as(job->reader);
+
+        job->next = __atomic_load_n(&done, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&done, &job->next, job, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) == -1) {
+            perror("worker: write");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+
+void worker_start(void) {
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        perror("worker: eventfd");
+        exit(1);
+    }
+
+    // Workers inherit a mask blocking every signal, so signals go to the event loop
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 0; i < WORKER_THREADS; i++) {
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, work, NULL);
+        if (error != 0) {
+            errno = error;
+            perror("worker: pthread_create");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+int worker_fd(void) {
+    return event_fd;
+}
+
+
+int worker_submit(void (*run)(void *arg), void (*finish)(void *arg), void *arg) {
+    if (event_fd == -1 || outstanding >= WORKER_QUEUE) {
+        return -1;
+    }
+
+    Job *job = spare;
+    if (job != NULL) {
+        spare = job->next;
+    } else {
+        job = Malloc(sizeof(Job));
+        job->reader = epoch_reader_new();
+    }
+    job->run = run;
+    job->finish = finish;
+    job->arg = arg;
+    job->next = NULL;
+    epoch_enter_as(job->reader);
+    outstanding++;
+
+    pthread_mutex_lock(&lock);
+    if (queue_tail == NULL) {
+        queue_head = job;
+    } else {
+        queue_tail->next = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+
+void worker_collect(void) {
+    // Reset the count before taking the stack: a job pushed after that
+    // makes the descriptor readable again, so it can't be missed
+    uint64_t count;
+    if (read(event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("worker: read");
+        exit(1);
+    }
+
+    Job *finished = __atomic_exchange_n(&done, NULL, __ATOMIC_ACQUIRE);
+    Job *in_order = NULL;
+    while (finished != NULL) {
+        Job *next = finished->next;
+        finished->next = in_order;
+        in_order = finished;
+        finished = next;
+    }
+
+    while (in_order != NULL) {
+        Job *job = in_order;
+        in_order = job->next;
+        outstanding--;
+        job->finish(job->arg);
+        job->next = spare;
+        spare = job;
+    }
+}
+
+
+void worker_drain(void) {
+    while (outstanding > 0) {
+        struct pollfd ready = {.fd = event_fd, .events = POLLIN};
+        if (poll(&ready, 1, -1) == -1 && errno != EINTR) {
+            perror("worker: poll");
+            exit(1);
+        }
+        worker_collect();
+    }
+}
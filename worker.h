@@ -0,0 +1,43 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+/*
+ * A pool of worker threads for work that only reads the shared data, e.g.
+ * rendering a big profile, so the event loop can get on with other clients
+ * meanwhile. Jobs are submitted and collected on the event loop's thread.
+ *
+ * A job may read whatever it could reach when it was submitted: it runs in
+ * an epoch section (see epoch.h) entered on submission, so nothing it can
+ * see is freed until it's done. When a job is done, its finish function is
+ * called back on the event loop's thread by worker_collect, in the order
+ * the jobs finished. Finished jobs are handed back without locks, and
+ * worker_fd becomes readable when there are any to collect.
+ */
+#ifndef WORKER_THREADS
+  #define WORKER_THREADS 4
+#endif
+#ifndef WORKER_QUEUE
+  #define WORKER_QUEUE 64  // Most jobs submitted and not yet collected
+#endif
+
+/* Start the worker threads. */
+void worker_start(void);
+
+/* Return a descriptor that is readable while there are finished jobs to collect. */
+int worker_fd(void);
+
+/*
+ * Have a worker call run(arg), and then have worker_collect call
+ * finish(arg). Return 0 on success, and -1 if WORKER_QUEUE jobs are
+ * already waiting (or the pool hasn't been started), in which case the
+ * caller should do the work itself.
+ */
+int worker_submit(void (*run)(void *arg), void (*finish)(void *arg), void *arg);
+
+/* Call the finish function of every job that is done. */
+void worker_collect(void);
+
+/* Wait for every job submitted so far to finish, and collect them. */
+void worker_drain(void);
+
+#endif
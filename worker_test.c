@@ -0,0 +1,176 @@
+#include "archive.h"
+#include "epoch.h"
+#include "friends.h"
+#include "memstats.h"
+#include "retention.h"
+#include "worker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Tests for the worker pool and epoch reclamation: profiles and the user
+ * list are rendered on workers, from views taken on this thread, while this
+ * thread goes on archiving and deleting the posts and users they point to.
+ * Deleted posts and users are overwritten before they're freed, so a render
+ * reading one too soon comes out different from the render of the same
+ * view done when it was taken.
+ */
+#define ROUNDS 2000
+#define NUM_POSTS 200    // Kept on the profile being rendered
+#define NUM_VICTIMS 500  // Users deleted while the user list is rendered
+
+typedef struct job {
+    UserView profile;
+    UserListView list;
+    int is_list;
+    char *expected;  // Rendered when the view was taken
+    char *rendered;  // Rendered by the worker
+} Job;
+
+static int failures = 0;
+static int finished = 0;
+
+
+/* Overwrite and free a post, for epoch_retire. */
+static void poison_post(void *ptr) {
+    Post *post = ptr;
+    memset(post->contents, '#', strlen(post->contents));
+    post->author = NO_USER;
+    free_post(post);
+}
+
+/* Overwrite and free a user, for epoch_retire. */
+static void poison_user(void *ptr) {
+    User *user = ptr;
+    memset(user->name, '#', strlen(user->name));
+    free_user(user);
+}
+
+
+static void run_job(void *arg) {
+    Job *job = arg;
+    job->rendered = job->is_list ? print_user_list_view(&job->list) : print_user_view(&job->profile);
+}
+
+static void finish_job(void *arg) {
+    Job *job = arg;
+    if (strcmp(job->rendered, job->expected) != 0) {
+        fprintf(stderr, "FAIL: %s rendered on a worker differs from its view\n",
+                job->is_list ? "user list" : "profile");
+        failures++;
+    }
+    if (job->is_list) {
+        free_user_list_view(&job->list);
+    } else {
+        free_user_view(&job->profile);
+    }
+    mem_free(MEM_RESPONSES, job->expected);
+    mem_free(MEM_RESPONSES, job->rendered);
+    free(job);
+    finished++;
+}
+
+
+/* Have a worker render user's profile, or the list of users from head if user is NULL. */
+static void submit(const User *user, const User *head) {
+    Job *job = Malloc(sizeof(Job));
+    job->is_list = user == NULL;
+    if (job->is_list) {
+        view_users(head, &job->list);
+        job->expected = print_user_list_view(&job->list);
+    } else {
+        view_user(user, &job->profile);
+        job->expected = print_user_view(&job->profile);
+    }
+    while (worker_submit(run_job, finish_job, job) == -1) {
+        worker_drain();  // The queue is full
+    }
+}
+
+/* Add a post from author to target, with some text worth rendering. */
+static void add_test_post(User *target, const User *author, int n) {
+    size_t size = 128 + 2 * MAX_NAME;
+    char *contents = mem_alloc(MEM_POSTS, size);
+    snprintf(contents, size, "Post number %d, from %s to %s, which is long enough to take a while to copy", n,
+             author->name, target->name);
+    add_post(target, author->id, contents, 1000000000 + n);
+}
+
+
+int main(void) {
+    char path[] = "/tmp/worker_test.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1 || archive_open(path) == -1) {
+        perror("worker_test: archive");
+        return 1;
+    }
+    close(fd);
+    unlink(path);
+
+    User *users = NULL;
+    create_user("reader", &users);
+    create_user("writer", &users);
+    User *reader = find_user("reader", users);
+    User *writer = find_user("writer", users);
+    make_friends_users(reader, writer);
+    char name[MAX_NAME];
+    for (int i = 0; i < NUM_VICTIMS; i++) {
+        snprintf(name, sizeof(name), "victim%d", i);
+        create_user(name, &users);
+        if (i % 2 == 0) {
+            add_test_post(reader, find_user(name, users), i);  // Shown as by DELETED_NAME later
+        }
+    }
+    int next_post = 0;
+    while (reader->num_posts < NUM_POSTS) {
+        add_test_post(reader, writer, next_post++);
+    }
+
+    worker_start();
+    int victim = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        submit(reader, users);
+        if (round % 4 == 0) {
+            submit(NULL, users);
+        }
+
+        // Change what the workers are reading: archive the oldest post,
+        // delete one from the middle, and every so often a user
+        if (archive_oldest_post(reader) == -1) {
+            fprintf(stderr, "FAIL: couldn't archive a post\n");
+            failures++;
+        }
+        Post *post = reader->first_post;
+        for (unsigned int i = 0; i < reader->num_posts / 2; i++) {
+            post = post->next;
+        }
+        remove_post(reader, post);
+        epoch_retire(post, poison_post);
+        if (victim < NUM_VICTIMS && round % 3 == 0) {
+            snprintf(name, sizeof(name), "victim%d", victim++);
+            User *user = find_user(name, users);
+            remove_user(user, &users);
+            epoch_retire(user, poison_user);
+        }
+        while (reader->num_posts < NUM_POSTS) {
+            add_test_post(reader, writer, next_post++);
+        }
+
+        worker_collect();
+        epoch_reclaim();
+    }
+    worker_drain();
+
+    if (user_count() != 2 + NUM_VICTIMS - victim) {
+        fprintf(stderr, "FAIL: user_count is %zu, not %d\n", user_count(), 2 + NUM_VICTIMS - victim);
+        failures++;
+    }
+    if (reader->num_archived != ROUNDS) {
+        fprintf(stderr, "FAIL: %lu posts archived, not %d\n", reader->num_archived, ROUNDS);
+        failures++;
+    }
+    printf("worker_test: %d renders, %d failures\n", finished, failures);
+    return failures == 0 ? 0 : 1;
+}